@@ -6,19 +6,26 @@ include $(CLEAR_VARS)
 
 LOCAL_SRC_FILES:= \
 	a2dp.c \
+	at.c \
 	avdtp.c \
 	control.c \
 	device.c \
+	encoder.c \
 	gateway.c \
 	headset.c \
 	ipc.c \
 	main.c \
 	manager.c \
 	module-bluetooth-sink.c \
+	pacing.c \
 	sink.c \
 	source.c \
 	telephony-dummy.c \
-	unix.c
+	unix.c \
+	../common/uinput.c \
+	../sbc/sbc.c.arm \
+	../sbc/sbc_primitives.c \
+	../sbc/sbc_primitives_neon.c
 
 LOCAL_CFLAGS:= \
 	-DVERSION=\"4.47\" \
@@ -32,6 +39,7 @@ LOCAL_C_INCLUDES:= \
 	$(LOCAL_PATH)/../common \
 	$(LOCAL_PATH)/../gdbus \
 	$(LOCAL_PATH)/../src \
+	$(LOCAL_PATH)/../sbc \
 	$(call include-path-for, glib) \
 	$(call include-path-for, dbus)
 
@@ -56,6 +64,7 @@ include $(CLEAR_VARS)
 LOCAL_SRC_FILES:= \
 	liba2dp.c \
 	ipc.c \
+	pacing.c \
 	../sbc/sbc.c.arm \
 	../sbc/sbc_primitives.c \
 	../sbc/sbc_primitives_neon.c
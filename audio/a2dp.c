@@ -43,6 +43,7 @@
 #include "sink.h"
 #include "source.h"
 #include "a2dp.h"
+#include "encoder.h"
 #include "sdpd.h"
 
 /* The duration that streams without users are allowed to stay in
@@ -68,6 +69,8 @@ struct a2dp_sep {
 	gboolean locked;
 	gboolean suspending;
 	gboolean starting;
+	gboolean warm;			/* suspend_timer is a keep-warm timer */
+	unsigned int warm_window;	/* Current keep-warm period (s) */
 };
 
 struct a2dp_setup_cb {
@@ -106,6 +109,11 @@ static GSList *servers = NULL;
 static GSList *setups = NULL;
 static unsigned int cb_id = 0;
 
+/* Seconds a stream may stay in STREAMING state after its last user
+ * suspended it, so that the next resume needs no AVDTP START. 0 disables
+ * keeping streams warm */
+static unsigned int keep_warm = 0;
+
 static struct a2dp_setup *setup_ref(struct a2dp_setup *setup)
 {
 	setup->ref++;
@@ -274,6 +282,7 @@ static void stream_state_changed(struct avdtp_stream *stream,
 		sep->session = NULL;
 	}
 
+	sep->warm = FALSE;
 	sep->stream = NULL;
 
 }
@@ -605,6 +614,44 @@ static gboolean suspend_timeout(struct a2dp_sep *sep)
 	return FALSE;
 }
 
+static gboolean keep_warm_timeout(struct a2dp_sep *sep)
+{
+	/* Nobody came back in time, so keep the stream warm for a shorter
+	 * period next time */
+	sep->warm = FALSE;
+	sep->warm_window = MAX(sep->warm_window / 2, 1);
+
+	debug("SEP %p no resume while warm, next window %us", sep->sep,
+							sep->warm_window);
+
+	return suspend_timeout(sep);
+}
+
+/* Defer suspending a streaming SEP for the keep-warm period instead of
+ * sending AVDTP SUSPEND right away */
+static gboolean keep_warm_start(struct a2dp_sep *sep, struct avdtp *session)
+{
+	if (keep_warm == 0 || sep->suspending)
+		return FALSE;
+
+	if (sep->warm_window == 0)
+		sep->warm_window = keep_warm;
+
+	if (sep->suspend_timer) {
+		g_source_remove(sep->suspend_timer);
+		avdtp_unref(sep->session);
+	}
+
+	debug("SEP %p kept warm for %us", sep->sep, sep->warm_window);
+
+	sep->session = avdtp_ref(session);
+	sep->warm = TRUE;
+	sep->suspend_timer = g_timeout_add_seconds(sep->warm_window,
+					(GSourceFunc) keep_warm_timeout, sep);
+
+	return TRUE;
+}
+
 static gboolean start_ind(struct avdtp *session, struct avdtp_local_sep *sep,
 				struct avdtp_stream *stream, uint8_t *err,
 				void *user_data)
@@ -684,6 +731,8 @@ static gboolean suspend_ind(struct avdtp *session, struct avdtp_local_sep *sep,
 		a2dp_sep->session = NULL;
 	}
 
+	a2dp_sep->warm = FALSE;
+
 	return TRUE;
 }
 
@@ -1082,7 +1131,7 @@ int a2dp_register(DBusConnection *conn, const bdaddr_t *src, GKeyFile *config)
 {
 	int sbc_srcs = 1, sbc_sinks = 1;
 	int mpeg12_srcs = 0, mpeg12_sinks = 0;
-	gboolean source = TRUE, sink = FALSE;
+	gboolean source = TRUE, sink = FALSE, tmp;
 	char *str;
 	GError *err = NULL;
 	int i;
@@ -1153,6 +1202,22 @@ int a2dp_register(DBusConnection *conn, const bdaddr_t *src, GKeyFile *config)
 		g_free(str);
 	}
 
+	str = g_key_file_get_string(config, "A2DP", "KeepWarm", &err);
+	if (err) {
+		debug("audio.conf: %s", err->message);
+		g_clear_error(&err);
+	} else {
+		keep_warm = MAX(atoi(str), 0);
+		g_free(str);
+	}
+
+	tmp = g_key_file_get_boolean(config, "A2DP", "SharedPCM", &err);
+	if (err) {
+		debug("audio.conf: %s", err->message);
+		g_clear_error(&err);
+	} else
+		a2dp_encoder_enable(tmp);
+
 proceed:
 	if (!connection)
 		connection = dbus_connection_ref(conn);
@@ -1439,6 +1504,12 @@ unsigned int a2dp_resume(struct avdtp *session, struct a2dp_sep *sep,
 			avdtp_unref(sep->session);
 			sep->session = NULL;
 		}
+		if (sep->warm) {
+			/* The warm period paid off, keep it at full length */
+			debug("SEP %p resumed while warm", sep->sep);
+			sep->warm = FALSE;
+			sep->warm_window = keep_warm;
+		}
 		if (sep->suspending)
 			setup->start = TRUE;
 		else
@@ -1490,6 +1561,10 @@ unsigned int a2dp_suspend(struct avdtp *session, struct a2dp_sep *sep,
 		g_idle_add((GSourceFunc) finalize_suspend, setup);
 		break;
 	case AVDTP_STATE_STREAMING:
+		if (keep_warm_start(sep, session)) {
+			g_idle_add((GSourceFunc) finalize_suspend, setup);
+			break;
+		}
 		if (avdtp_suspend(session, sep->stream) < 0) {
 			error("avdtp_suspend failed");
 			goto failed;
@@ -1572,6 +1647,8 @@ gboolean a2dp_sep_unlock(struct a2dp_sep *sep, struct avdtp *session)
 		/* Set timer here */
 		break;
 	case AVDTP_STATE_STREAMING:
+		if (keep_warm_start(sep, session))
+			break;
 		if (avdtp_suspend(session, sep->stream) == 0)
 			sep->suspending = TRUE;
 		break;
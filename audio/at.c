@@ -0,0 +1,289 @@
+/*
+ *
+ *  BlueZ - Bluetooth protocol stack for Linux
+ *
+ *  Copyright (C) 2004-2009  Marcel Holtmann <marcel@holtmann.org>
+ *
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <errno.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <glib.h>
+
+#include "logging.h"
+#include "at.h"
+
+/* Seeds tried for each table size before doubling it */
+#define AT_TABLE_SEEDS 32
+
+struct at_entry {
+	const char *name;
+	size_t len;
+	void *data;
+};
+
+struct at_table {
+	struct at_entry *entries;
+	unsigned int count;
+	unsigned int *slots;	/* entry index + 1, 0 for empty slots */
+	unsigned int mask;
+	uint32_t seed;
+};
+
+void at_parser_reset(struct at_parser *p)
+{
+	p->start = 0;
+	p->len = 0;
+	p->scan = 0;
+}
+
+char *at_parser_space(struct at_parser *p, size_t *size)
+{
+	/* Only a partial line is ever left behind, move it to the front */
+	if (p->start > 0) {
+		if (p->len > 0)
+			memmove(p->buf, p->buf + p->start, p->len);
+		p->start = 0;
+	}
+
+	*size = sizeof(p->buf) - p->len;
+
+	return p->buf + p->len;
+}
+
+void at_parser_commit(struct at_parser *p, size_t len)
+{
+	p->len += len;
+}
+
+static void parse_command(char *line, struct at_command *cmd)
+{
+	char *p = line + 2;
+
+	cmd->name = p;
+
+	if (*p == '+' || *p == '&') {
+		p++;
+		while (*p >= 'A' && *p <= 'Z')
+			p++;
+	} else if (*p != '\0')
+		p++;
+
+	cmd->name_len = p - cmd->name;
+
+	/* Basic commands take everything up to the end of the line */
+	if (cmd->name[0] != '+') {
+		cmd->type = AT_CMD_EXEC;
+		cmd->args = p;
+		return;
+	}
+
+	if (p[0] == '?') {
+		cmd->type = AT_CMD_READ;
+		cmd->args = p + 1;
+	} else if (p[0] == '=' && p[1] == '?') {
+		cmd->type = AT_CMD_TEST;
+		cmd->args = p + 2;
+	} else if (p[0] == '=') {
+		cmd->type = AT_CMD_SET;
+		cmd->args = p + 1;
+	} else {
+		cmd->type = AT_CMD_EXEC;
+		cmd->args = p;
+	}
+}
+
+static void parse_result(char *line, size_t len, struct at_command *cmd)
+{
+	char *colon = memchr(line, ':', len);
+
+	cmd->type = AT_RESULT;
+	cmd->name = line;
+
+	if (colon == NULL) {
+		cmd->name_len = len;
+		cmd->args = line + len;
+		return;
+	}
+
+	cmd->name_len = colon - line;
+	for (cmd->args = colon + 1; *cmd->args == ' '; cmd->args++);
+}
+
+int at_parser_next(struct at_parser *p, struct at_command *cmd)
+{
+	while (p->len > 0) {
+		char *line = p->buf + p->start;
+		char *end;
+		size_t len;
+
+		/* Line feeds around result codes and empty commands */
+		if (*line == '\r' || *line == '\n') {
+			p->start++;
+			p->len--;
+			continue;
+		}
+
+		end = memchr(line + p->scan, '\r', p->len - p->scan);
+		if (end == NULL) {
+			p->scan = p->len;
+			return FALSE;
+		}
+
+		*end = '\0';
+		len = end - line;
+
+		p->start += len + 1;
+		p->len -= len + 1;
+		p->scan = 0;
+
+		cmd->line = line;
+
+		if (len >= 2 && line[0] == 'A' && line[1] == 'T')
+			parse_command(line, cmd);
+		else
+			parse_result(line, len, cmd);
+
+		return TRUE;
+	}
+
+	return FALSE;
+}
+
+static inline uint32_t at_hash(const char *name, size_t len, uint32_t seed)
+{
+	uint32_t h = 2166136261U ^ seed;
+
+	while (len-- > 0) {
+		h ^= (uint8_t) *name++;
+		h *= 16777619U;
+	}
+
+	return h;
+}
+
+static gboolean table_try(struct at_table *t, unsigned int size,
+								uint32_t seed)
+{
+	unsigned int i;
+
+	memset(t->slots, 0, size * sizeof(*t->slots));
+
+	for (i = 0; i < t->count; i++) {
+		struct at_entry *e = &t->entries[i];
+		uint32_t h = at_hash(e->name, e->len, seed) & (size - 1);
+
+		if (t->slots[h])
+			return FALSE;
+
+		t->slots[h] = i + 1;
+	}
+
+	return TRUE;
+}
+
+static void table_build(struct at_table *t)
+{
+	unsigned int size;
+
+	for (size = 8; size < t->count * 2; size <<= 1);
+
+	/* Names are unique, so this ends once the table is large enough */
+	while (1) {
+		uint32_t seed;
+
+		t->slots = g_renew(unsigned int, t->slots, size);
+
+		for (seed = 0; seed < AT_TABLE_SEEDS; seed++) {
+			if (table_try(t, size, seed)) {
+				t->mask = size - 1;
+				t->seed = seed;
+				debug("AT table: %u names in %u slots, seed %u",
+							t->count, size, seed);
+				return;
+			}
+		}
+
+		size <<= 1;
+	}
+}
+
+struct at_table *at_table_new(void)
+{
+	return g_new0(struct at_table, 1);
+}
+
+void at_table_free(struct at_table *t)
+{
+	g_free(t->entries);
+	g_free(t->slots);
+	g_free(t);
+}
+
+int at_table_add(struct at_table *t, const char *name, void *data)
+{
+	size_t len = strlen(name);
+	struct at_entry *e;
+	unsigned int i;
+
+	for (i = 0; i < t->count; i++) {
+		if (t->entries[i].len == len &&
+				!memcmp(t->entries[i].name, name, len))
+			return -EEXIST;
+	}
+
+	t->entries = g_renew(struct at_entry, t->entries, t->count + 1);
+	e = &t->entries[t->count++];
+	e->name = name;
+	e->len = len;
+	e->data = data;
+
+	/* Rebuilt on the next lookup */
+	g_free(t->slots);
+	t->slots = NULL;
+
+	return 0;
+}
+
+void *at_table_lookup(struct at_table *t, const struct at_command *cmd)
+{
+	struct at_entry *e;
+	unsigned int slot;
+
+	if (t->count == 0)
+		return NULL;
+
+	if (t->slots == NULL)
+		table_build(t);
+
+	slot = t->slots[at_hash(cmd->name, cmd->name_len, t->seed) & t->mask];
+	if (slot == 0)
+		return NULL;
+
+	e = &t->entries[slot - 1];
+	if (e->len != cmd->name_len || memcmp(e->name, cmd->name, e->len))
+		return NULL;
+
+	return e->data;
+}
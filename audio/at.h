@@ -0,0 +1,79 @@
+/*
+ *
+ *  BlueZ - Bluetooth protocol stack for Linux
+ *
+ *  Copyright (C) 2004-2009  Marcel Holtmann <marcel@holtmann.org>
+ *
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#ifndef BT_AT_H
+#define BT_AT_H
+
+#include <stddef.h>
+
+/* Streaming AT command and result code tokenizer.
+ *
+ * Data is read straight into the parser's buffer and lines are split in
+ * place at their terminating '\r', so commands are handed out as pointers
+ * into the buffer without being copied. Each one is valid until the next
+ * call to at_parser_space(). */
+
+#define AT_BUF_SIZE 1024
+
+typedef enum {
+	AT_CMD_EXEC,		/* AT+X or basic commands like ATD123; */
+	AT_CMD_READ,		/* AT+X? */
+	AT_CMD_TEST,		/* AT+X=? */
+	AT_CMD_SET,		/* AT+X=<args> */
+	AT_RESULT,		/* +X: <args>, OK, RING... */
+} at_type_t;
+
+struct at_command {
+	char *line;		/* whole line, NUL terminated */
+	const char *name;	/* "+CIND", "D", "OK"... not NUL terminated */
+	size_t name_len;
+	at_type_t type;
+	char *args;		/* rest of the line, may be modified in place */
+};
+
+struct at_parser {
+	char buf[AT_BUF_SIZE];
+	size_t start;		/* first unparsed byte */
+	size_t len;		/* unparsed bytes */
+	size_t scan;		/* unparsed bytes known to hold no '\r' */
+};
+
+void at_parser_reset(struct at_parser *p);
+
+/* Room for reading more data, 0 bytes means a line overflowed the buffer */
+char *at_parser_space(struct at_parser *p, size_t *size);
+void at_parser_commit(struct at_parser *p, size_t len);
+
+/* Next complete line, empty ones are skipped */
+int at_parser_next(struct at_parser *p, struct at_command *cmd);
+
+/* Command or result code name dispatch through a perfect hash, which is
+ * built on the first lookup after the table changes */
+struct at_table;
+
+struct at_table *at_table_new(void);
+void at_table_free(struct at_table *t);
+int at_table_add(struct at_table *t, const char *name, void *data);
+void *at_table_lookup(struct at_table *t, const struct at_command *cmd);
+
+#endif /* BT_AT_H */
@@ -33,6 +33,8 @@
 #include <assert.h>
 #include <signal.h>
 #include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
 
 #include <bluetooth/bluetooth.h>
 #include <bluetooth/sdp.h>
@@ -85,6 +87,10 @@
 #define DISCONNECT_TIMEOUT 1
 #define STREAM_TIMEOUT 20
 
+/* Transaction labels are 4 bits; one stays free for session->req */
+#define MAX_PIPELINE 15
+#define SEP_CACHE_SIZE 8
+
 #if __BYTE_ORDER == __LITTLE_ENDIAN
 
 struct avdtp_common_header {
@@ -282,8 +288,10 @@ struct in_buf {
 	uint8_t transaction;
 	uint8_t message_type;
 	uint8_t signal_id;
-	uint8_t buf[1024];
-	uint8_t data_size;
+	uint8_t *buf;		/* Reassembly buffer, reused across signals */
+	gsize buf_size;
+	uint8_t *data;		/* Payload of the complete signal */
+	gsize data_size;
 };
 
 struct pending_req {
@@ -309,6 +317,13 @@ struct avdtp_server {
 	GIOChannel *io;
 	GSList *seps;
 	GSList *sessions;
+	GSList *sep_cache; /* struct sep_cache, most recently used first */
+};
+
+/* Remote SEPs and capabilities kept after a session goes away */
+struct sep_cache {
+	bdaddr_t dst;
+	GSList *seps;
 };
 
 struct avdtp_local_sep {
@@ -377,6 +392,15 @@ struct avdtp {
 
 	GSList *req_queue; /* Elements of type struct pending_req * */
 	GSList *prio_queue; /* Same as req_queue but is processed before it */
+	GSList *pipeline; /* GET_CAPABILITIES requests sent alongside req */
+
+	/* Remote SEPs proved outdated or did not match what was asked for */
+	gboolean seps_stale;
+	/* Remote SEPs come from a clean discovery and may be cached */
+	gboolean seps_complete;
+	/* A DISCOVER is running, and whether it had to skip any SEP */
+	gboolean discovering;
+	gboolean seps_partial;
 
 	struct avdtp_stream *pending_open;
 
@@ -417,6 +441,9 @@ static gboolean avdtp_parse_rej(struct avdtp *session,
 					struct avdtp_stream *stream,
 					uint8_t transaction, uint8_t signal_id,
 					void *buf, int size);
+static struct pending_req *find_pipelined(struct avdtp *session,
+							uint8_t transaction);
+static gboolean pipelined_resp(struct avdtp *session, struct pending_req *req);
 static int process_queue(struct avdtp *session);
 static void connection_lost(struct avdtp *session, int err);
 static void avdtp_sep_set_state(struct avdtp *session,
@@ -457,19 +484,29 @@ static const char *avdtp_statestr(avdtp_state_t state)
 	}
 }
 
-static gboolean try_send(int sk, void *data, size_t len)
+static gboolean try_send(int sk, struct iovec *iov, int iovcnt)
 {
-	int err;
+	struct msghdr msg;
+	size_t len;
+	ssize_t err;
+	int i;
+
+	for (i = 0, len = 0; i < iovcnt; i++)
+		len += iov[i].iov_len;
+
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = iov;
+	msg.msg_iovlen = iovcnt;
 
 	do {
-		err = send(sk, data, len, 0);
+		err = sendmsg(sk, &msg, 0);
 	} while (err < 0 && errno == EINTR);
 
 	if (err < 0) {
 		error("send: %s (%d)", strerror(errno), errno);
 		return FALSE;
 	} else if ((size_t) err != len) {
-		error("try_send: complete buffer not sent (%d/%zu bytes)",
+		error("try_send: complete buffer not sent (%zd/%zu bytes)",
 								err, len);
 		return FALSE;
 	}
@@ -477,14 +514,52 @@ static gboolean try_send(int sk, void *data, size_t len)
 	return TRUE;
 }
 
-static gboolean avdtp_send(struct avdtp *session, uint8_t transaction,
+/* Point iov at the next len bytes of data, advancing the *cur / *offset
+ * cursor. Returns the number of entries used, at most count */
+static int iov_slice(struct iovec *iov, const struct iovec *data, int count,
+				int *cur, size_t *offset, size_t len)
+{
+	int n = 0;
+
+	while (len > 0 && *cur < count) {
+		size_t chunk = data[*cur].iov_len - *offset;
+
+		if (chunk > len)
+			chunk = len;
+
+		if (chunk > 0) {
+			iov[n].iov_base = (uint8_t *) data[*cur].iov_base +
+								*offset;
+			iov[n].iov_len = chunk;
+			n++;
+		}
+
+		*offset += chunk;
+		len -= chunk;
+
+		if (*offset == data[*cur].iov_len) {
+			(*cur)++;
+			*offset = 0;
+		}
+	}
+
+	return n;
+}
+
+/* Send a signal whose payload is scattered over count buffers. Every
+ * packet is a single sendmsg() pointing into the caller's buffers, so
+ * nothing gets staged in session->buf */
+static gboolean avdtp_sendv(struct avdtp *session, uint8_t transaction,
 				uint8_t message_type, uint8_t signal_id,
-				void *data, size_t len)
+				const struct iovec *data, int count)
 {
-	unsigned int cont_fragments, sent;
+	unsigned int cont_fragments;
 	struct avdtp_start_header start;
 	struct avdtp_continue_header cont;
-	int sock;
+	struct iovec *iov;
+	size_t len, sent, offset;
+	int sock, cur, n, i;
+	gboolean ret = FALSE;
 
 	if (session->io == NULL) {
 		error("avdtp_send: session is closed");
@@ -493,6 +568,14 @@ static gboolean avdtp_send(struct avdtp *session, uint8_t transaction,
 
 	sock = g_io_channel_unix_get_fd(session->io);
 
+	for (i = 0, len = 0; i < count; i++)
+		len += data[i].iov_len;
+
+	/* Room for the packet header plus the payload slices */
+	iov = g_new(struct iovec, count + 1);
+	cur = 0;
+	offset = 0;
+
 	/* Single packet - no fragmentation */
 	if (sizeof(struct avdtp_single_header) + len <= session->omtu) {
 		struct avdtp_single_header single;
@@ -504,10 +587,12 @@ static gboolean avdtp_send(struct avdtp *session, uint8_t transaction,
 		single.message_type = message_type;
 		single.signal_id = signal_id;
 
-		memcpy(session->buf, &single, sizeof(single));
-		memcpy(session->buf + sizeof(single), data, len);
+		iov[0].iov_base = &single;
+		iov[0].iov_len = sizeof(single);
+		n = iov_slice(iov + 1, data, count, &cur, &offset, len);
 
-		return try_send(sock, session->buf, sizeof(single) + len);
+		ret = try_send(sock, iov, n + 1);
+		goto done;
 	}
 
 	/* Count the number of needed fragments */
@@ -525,12 +610,13 @@ static gboolean avdtp_send(struct avdtp *session, uint8_t transaction,
 	start.no_of_packets = cont_fragments + 1;
 	start.signal_id = signal_id;
 
-	memcpy(session->buf, &start, sizeof(start));
-	memcpy(session->buf + sizeof(start), data,
+	iov[0].iov_base = &start;
+	iov[0].iov_len = sizeof(start);
+	n = iov_slice(iov + 1, data, count, &cur, &offset,
 					session->omtu - sizeof(start));
 
-	if (!try_send(sock, session->buf, session->omtu))
-		return FALSE;
+	if (!try_send(sock, iov, n + 1))
+		goto done;
 
 	debug("avdtp_send: first packet with %zu bytes sent",
 						session->omtu - sizeof(start));
@@ -557,16 +643,35 @@ static gboolean avdtp_send(struct avdtp *session, uint8_t transaction,
 		cont.transaction = transaction;
 		cont.message_type = message_type;
 
-		memcpy(session->buf, &cont, sizeof(cont));
-		memcpy(session->buf + sizeof(cont), data + sent, to_copy);
+		iov[0].iov_base = &cont;
+		iov[0].iov_len = sizeof(cont);
+		n = iov_slice(iov + 1, data, count, &cur, &offset, to_copy);
 
-		if (!try_send(sock, session->buf, to_copy + sizeof(cont)))
-			return FALSE;
+		if (!try_send(sock, iov, n + 1))
+			goto done;
 
 		sent += to_copy;
 	}
 
-	return TRUE;
+	ret = TRUE;
+
+done:
+	g_free(iov);
+
+	return ret;
+}
+
+static gboolean avdtp_send(struct avdtp *session, uint8_t transaction,
+				uint8_t message_type, uint8_t signal_id,
+				void *data, size_t len)
+{
+	struct iovec iov;
+
+	iov.iov_base = data;
+	iov.iov_len = len;
+
+	return avdtp_sendv(session, transaction, message_type, signal_id,
+								&iov, 1);
 }
 
 static void pending_req_free(struct pending_req *req)
@@ -577,6 +682,96 @@ static void pending_req_free(struct pending_req *req)
 	g_free(req);
 }
 
+static void pipeline_free(struct avdtp *session)
+{
+	g_slist_foreach(session->pipeline, (GFunc) pending_req_free, NULL);
+	g_slist_free(session->pipeline);
+	session->pipeline = NULL;
+}
+
+static void remote_sep_free(struct avdtp_remote_sep *sep)
+{
+	g_slist_foreach(sep->caps, (GFunc) g_free, NULL);
+	g_slist_free(sep->caps);
+	g_free(sep);
+}
+
+static void sep_cache_free(struct sep_cache *cache)
+{
+	g_slist_foreach(cache->seps, (GFunc) remote_sep_free, NULL);
+	g_slist_free(cache->seps);
+	g_free(cache);
+}
+
+static struct sep_cache *find_sep_cache(struct avdtp_server *server,
+							const bdaddr_t *dst)
+{
+	GSList *l;
+
+	for (l = server->sep_cache; l; l = l->next) {
+		struct sep_cache *cache = l->data;
+
+		if (bacmp(&cache->dst, dst) == 0)
+			return cache;
+	}
+
+	return NULL;
+}
+
+/* Hand the cached remote SEPs of dst over to a new session */
+static GSList *sep_cache_take(struct avdtp_server *server, const bdaddr_t *dst)
+{
+	struct sep_cache *cache;
+	GSList *seps;
+
+	cache = find_sep_cache(server, dst);
+	if (!cache)
+		return NULL;
+
+	server->sep_cache = g_slist_remove(server->sep_cache, cache);
+
+	seps = cache->seps;
+	g_free(cache);
+
+	return seps;
+}
+
+/* Keep the remote SEPs of a finished session for the next connection */
+static void sep_cache_store(struct avdtp_server *server, const bdaddr_t *dst,
+								GSList *seps)
+{
+	struct sep_cache *cache;
+	GSList *l;
+
+	cache = find_sep_cache(server, dst);
+	if (cache) {
+		server->sep_cache = g_slist_remove(server->sep_cache, cache);
+		sep_cache_free(cache);
+	}
+
+	if (!seps)
+		return;
+
+	for (l = seps; l; l = l->next) {
+		struct avdtp_remote_sep *sep = l->data;
+
+		sep->stream = NULL;
+	}
+
+	cache = g_new0(struct sep_cache, 1);
+	bacpy(&cache->dst, dst);
+	cache->seps = seps;
+
+	server->sep_cache = g_slist_prepend(server->sep_cache, cache);
+
+	l = g_slist_nth(server->sep_cache, SEP_CACHE_SIZE);
+	if (l) {
+		cache = l->data;
+		server->sep_cache = g_slist_remove(server->sep_cache, cache);
+		sep_cache_free(cache);
+	}
+}
+
 static void close_stream(struct avdtp_stream *stream)
 {
 	int sock;
@@ -947,6 +1142,20 @@ static void finalize_discovery(struct avdtp *session, int err)
 
 	avdtp_error_init(&avdtp_err, AVDTP_ERROR_ERRNO, err);
 
+	if (session->discovering) {
+		GSList *l;
+
+		session->discovering = FALSE;
+		session->seps_complete = !err && !session->seps_partial;
+
+		for (l = session->seps; l; l = l->next) {
+			struct avdtp_remote_sep *sep = l->data;
+
+			if (!sep->caps)
+				session->seps_complete = FALSE;
+		}
+	}
+
 	if (!session->discov_cb)
 		return;
 
@@ -982,6 +1191,8 @@ static void connection_lost(struct avdtp *session, int err)
 
 	session->free_lock = 1;
 
+	pipeline_free(session);
+
 	finalize_discovery(session, err);
 
 	g_slist_foreach(session->streams, (GFunc) release_stream, session);
@@ -1057,10 +1268,19 @@ void avdtp_unref(struct avdtp *session)
 	if (session->req)
 		pending_req_free(session->req);
 
-	g_slist_foreach(session->seps, (GFunc) g_free, NULL);
-	g_slist_free(session->seps);
+	pipeline_free(session);
+
+	/* Only cache what a later session can rely on without DISCOVER */
+	if (session->seps_stale || !session->seps_complete) {
+		g_slist_foreach(session->seps, (GFunc) remote_sep_free, NULL);
+		g_slist_free(session->seps);
+		session->seps = NULL;
+	}
+
+	sep_cache_store(server, &session->dst, session->seps);
 
 	g_free(session->buf);
+	g_free(session->in.buf);
 
 	g_free(session);
 }
@@ -1192,8 +1412,10 @@ static gboolean avdtp_getcap_cmd(struct avdtp *session, uint8_t transaction,
 {
 	GSList *l, *caps;
 	struct avdtp_local_sep *sep = NULL;
-	unsigned int rsp_size;
-	uint8_t err, buf[1024], *ptr = buf;
+	struct iovec *iov;
+	unsigned int count, i;
+	gboolean ret;
+	uint8_t err;
 
 	if (size < sizeof(struct seid_req)) {
 		err = AVDTP_BAD_LENGTH;
@@ -1210,23 +1432,25 @@ static gboolean avdtp_getcap_cmd(struct avdtp *session, uint8_t transaction,
 					sep->user_data))
 		goto failed;
 
-	for (l = caps, rsp_size = 0; l != NULL; l = g_slist_next(l)) {
-		struct avdtp_service_capability *cap = l->data;
+	/* Capabilities are already in wire format, send them in place */
+	count = g_slist_length(caps);
+	iov = g_new(struct iovec, MAX(count, 1));
 
-		if (rsp_size + cap->length + 2 > sizeof(buf))
-			break;
-
-		memcpy(ptr, cap, cap->length + 2);
-		rsp_size += cap->length + 2;
-		ptr += cap->length + 2;
+	for (l = caps, i = 0; l != NULL; l = g_slist_next(l), i++) {
+		struct avdtp_service_capability *cap = l->data;
 
-		g_free(cap);
+		iov[i].iov_base = cap;
+		iov[i].iov_len = cap->length + 2;
 	}
 
+	ret = avdtp_sendv(session, transaction, AVDTP_MSG_TYPE_ACCEPT,
+				AVDTP_GET_CAPABILITIES, iov, count);
+
+	g_free(iov);
+	g_slist_foreach(caps, (GFunc) g_free, NULL);
 	g_slist_free(caps);
 
-	return avdtp_send(session, transaction, AVDTP_MSG_TYPE_ACCEPT,
-				AVDTP_GET_CAPABILITIES, buf, rsp_size);
+	return ret;
 
 failed:
 	return avdtp_send(session, transaction, AVDTP_MSG_TYPE_REJECT,
@@ -1698,17 +1922,16 @@ static enum avdtp_parse_result avdtp_parse_data(struct avdtp *session,
 			return PARSE_ERROR;
 		}
 
-		payload = session->buf + sizeof(*single);
-		payload_size = size - sizeof(*single);
-
-		session->in.active = TRUE;
-		session->in.data_size = 0;
 		session->in.no_of_packets = 1;
 		session->in.transaction = header->transaction;
 		session->in.message_type = header->message_type;
 		session->in.signal_id = single->signal_id;
 
-		break;
+		/* Nothing to reassemble, use the payload where it is */
+		session->in.data = (uint8_t *) session->buf + sizeof(*single);
+		session->in.data_size = size - sizeof(*single);
+
+		return PARSE_SUCCESS;
 	case AVDTP_PKT_TYPE_START:
 		if (size < sizeof(*start)) {
 			error("Received too small start packet (%zu bytes)", size);
@@ -1780,14 +2003,20 @@ static enum avdtp_parse_result avdtp_parse_data(struct avdtp *session,
 		return PARSE_ERROR;
 	}
 
-	if (session->in.data_size + payload_size >
-					sizeof(session->in.buf)) {
-		error("Not enough incoming buffer space!");
-		return PARSE_ERROR;
+	/* Grow the reassembly buffer once; it is kept for later signals */
+	if (session->in.data_size + payload_size > session->in.buf_size) {
+		gsize buf_size = MAX(session->in.buf_size * 2, session->imtu);
+
+		while (buf_size < session->in.data_size + payload_size)
+			buf_size *= 2;
+
+		session->in.buf = g_realloc(session->in.buf, buf_size);
+		session->in.buf_size = buf_size;
 	}
 
 	memcpy(session->in.buf + session->in.data_size, payload, payload_size);
 	session->in.data_size += payload_size;
+	session->in.data = session->in.buf;
 
 	if (session->in.no_of_packets > 1) {
 		session->in.no_of_packets--;
@@ -1806,6 +2035,7 @@ static gboolean session_cb(GIOChannel *chan, GIOCondition cond,
 {
 	struct avdtp *session = data;
 	struct avdtp_common_header *header;
+	struct pending_req *req;
 	gsize size;
 
 	debug("session_cb");
@@ -1841,13 +2071,14 @@ static gboolean session_cb(GIOChannel *chan, GIOCondition cond,
 	if (session->in.message_type == AVDTP_MSG_TYPE_COMMAND) {
 		if (!avdtp_parse_cmd(session, session->in.transaction,
 					session->in.signal_id,
-					session->in.buf,
+					session->in.data,
 					session->in.data_size)) {
 			error("Unable to handle command. Disconnecting");
 			goto failed;
 		}
 
-		if (session->ref == 1 && !session->streams && !session->req)
+		if (session->ref == 1 && !session->streams && !session->req &&
+							!session->pipeline)
 			set_disconnect_timer(session);
 
 		if (session->streams && session->dc_timer)
@@ -1856,6 +2087,13 @@ static gboolean session_cb(GIOChannel *chan, GIOCondition cond,
 		return TRUE;
 	}
 
+	req = find_pipelined(session, session->in.transaction);
+	if (req) {
+		if (!pipelined_resp(session, req))
+			goto failed;
+		return TRUE;
+	}
+
 	if (session->req == NULL) {
 		error("No pending request, ignoring message");
 		return TRUE;
@@ -1879,7 +2117,7 @@ static gboolean session_cb(GIOChannel *chan, GIOCondition cond,
 		if (!avdtp_parse_resp(session, session->req->stream,
 						session->in.transaction,
 						session->in.signal_id,
-						session->in.buf,
+						session->in.data,
 						session->in.data_size)) {
 			error("Unable to parse accept response");
 			goto failed;
@@ -1889,7 +2127,7 @@ static gboolean session_cb(GIOChannel *chan, GIOCondition cond,
 		if (!avdtp_parse_rej(session, session->req->stream,
 						session->in.transaction,
 						session->in.signal_id,
-						session->in.buf,
+						session->in.data,
 						session->in.data_size)) {
 			error("Unable to parse reject response");
 			goto failed;
@@ -1959,6 +2197,10 @@ static struct avdtp *avdtp_get_internal(const bdaddr_t *src, const bdaddr_t *dst
 	session->state = AVDTP_SESSION_STATE_DISCONNECTED;
 	session->auto_dc = TRUE;
 
+	/* Skip discovery if the device was seen before */
+	session->seps = sep_cache_take(server, dst);
+	session->seps_complete = session->seps != NULL;
+
 	server->sessions = g_slist_append(server->sessions, session);
 
 	return session;
@@ -2301,10 +2543,91 @@ done:
 	return FALSE;
 }
 
+static gboolean transaction_in_use(struct avdtp *session, uint8_t transaction)
+{
+	GSList *l;
+
+	if (session->req && session->req->transaction == transaction)
+		return TRUE;
+
+	for (l = session->pipeline; l; l = l->next) {
+		struct pending_req *req = l->data;
+
+		if (req->transaction == transaction)
+			return TRUE;
+	}
+
+	return FALSE;
+}
+
+static uint8_t next_transaction(struct avdtp *session)
+{
+	static uint8_t transaction = 0;
+	uint8_t label;
+	int i;
+
+	for (i = 0; i < 16; i++) {
+		label = transaction;
+		transaction = (transaction + 1) % 16;
+
+		if (!transaction_in_use(session, label))
+			break;
+	}
+
+	return label;
+}
+
+static struct pending_req *find_pipelined(struct avdtp *session,
+							uint8_t transaction)
+{
+	GSList *l;
+
+	for (l = session->pipeline; l; l = l->next) {
+		struct pending_req *req = l->data;
+
+		if (req->transaction == transaction)
+			return req;
+	}
+
+	return NULL;
+}
+
+static gboolean pipeline_timeout(gpointer user_data)
+{
+	struct avdtp *session = user_data;
+
+	error("GetCapabilities request timed out");
+
+	connection_lost(session, ETIMEDOUT);
+
+	return FALSE;
+}
+
+/* GET_CAPABILITIES does not change any state on either side, so these
+ * requests are sent back-to-back and their responses are matched by
+ * transaction label instead of waiting for session->req */
+static int send_pipelined(struct avdtp *session, struct pending_req *req)
+{
+	req->transaction = next_transaction(session);
+
+	if (!avdtp_send(session, req->transaction, AVDTP_MSG_TYPE_COMMAND,
+				req->signal_id, req->data, req->data_size)) {
+		g_free(req->data);
+		g_free(req);
+		return -EIO;
+	}
+
+	req->timeout = g_timeout_add_seconds(REQ_TIMEOUT, pipeline_timeout,
+								session);
+
+	session->pipeline = g_slist_append(session->pipeline, req);
+
+	return 0;
+}
+
 static int send_req(struct avdtp *session, gboolean priority,
 			struct pending_req *req)
 {
-	static int transaction = 0;
 	int err;
 
 	if (session->state == AVDTP_SESSION_STATE_DISCONNECTED) {
@@ -2314,14 +2637,18 @@ static int send_req(struct avdtp *session, gboolean priority,
 		avdtp_set_state(session, AVDTP_SESSION_STATE_CONNECTING);
 	}
 
+	if (session->state == AVDTP_SESSION_STATE_CONNECTED &&
+			req->signal_id == AVDTP_GET_CAPABILITIES &&
+			g_slist_length(session->pipeline) < MAX_PIPELINE)
+		return send_pipelined(session, req);
+
 	if (session->state < AVDTP_SESSION_STATE_CONNECTED ||
 			session->req != NULL) {
 		queue_request(session, req, priority);
 		return 0;
 	}
 
-	req->transaction = transaction++;
-	transaction %= 16;
+	req->transaction = next_transaction(session);
 
 	/* FIXME: Should we retry to send if the buffer
 	was not totally sent or in case of EINTR? */
@@ -2382,8 +2709,10 @@ static gboolean avdtp_discover_resp(struct avdtp *session,
 
 		sep = find_remote_sep(session->seps, resp->seps[i].seid);
 		if (!sep) {
-			if (resp->seps[i].inuse && !stream)
+			if (resp->seps[i].inuse && !stream) {
+				session->seps_partial = TRUE;
 				continue;
+			}
 			sep = g_new0(struct avdtp_remote_sep, 1);
 			session->seps = g_slist_append(session->seps, sep);
 		}
@@ -2408,7 +2737,39 @@ static gboolean avdtp_discover_resp(struct avdtp *session,
 	return TRUE;
 }
 
+static gboolean getcap_in_queue(GSList *queue)
+{
+	for (; queue; queue = queue->next) {
+		struct pending_req *req = queue->data;
+
+		if (req->signal_id == AVDTP_GET_CAPABILITIES)
+			return TRUE;
+	}
+
+	return FALSE;
+}
+
+/* Discovery is complete once no other GET_CAPABILITIES than done is sent
+ * or queued */
+static gboolean getcap_pending(struct avdtp *session, struct pending_req *done)
+{
+	GSList *l;
+
+	for (l = session->pipeline; l; l = l->next) {
+		if (l->data != done)
+			return TRUE;
+	}
+
+	if (session->req && session->req != done &&
+			session->req->signal_id == AVDTP_GET_CAPABILITIES)
+		return TRUE;
+
+	return getcap_in_queue(session->prio_queue) ||
+				getcap_in_queue(session->req_queue);
+}
+
 static gboolean avdtp_get_capabilities_resp(struct avdtp *session,
+						struct pending_req *req,
 						struct getcap_resp *resp,
 						unsigned int size)
 {
@@ -2427,9 +2788,13 @@ static gboolean avdtp_get_capabilities_resp(struct avdtp *session,
 		return FALSE;
 	}
 
-	seid = ((struct seid_req *) session->req->data)->acp_seid;
+	seid = ((struct seid_req *) req->data)->acp_seid;
 
 	sep = find_remote_sep(session->seps, seid);
+	if (!sep) {
+		error("getcap resp for unknown seid %d", seid);
+		return TRUE;
+	}
 
 	debug("seid %d type %d media %d", sep->seid,
 					sep->type, sep->media_type);
@@ -2550,24 +2915,16 @@ static gboolean avdtp_parse_resp(struct avdtp *session,
 					uint8_t transaction, uint8_t signal_id,
 					void *buf, int size)
 {
-	struct pending_req *next;
-
-	if (session->prio_queue)
-		next = session->prio_queue->data;
-	else if (session->req_queue)
-		next = session->req_queue->data;
-	else
-		next = NULL;
-
 	switch (signal_id) {
 	case AVDTP_DISCOVER:
 		debug("DISCOVER request succeeded");
 		return avdtp_discover_resp(session, buf, size);
 	case AVDTP_GET_CAPABILITIES:
 		debug("GET_CAPABILITIES request succeeded");
-		if (!avdtp_get_capabilities_resp(session, buf, size))
+		if (!avdtp_get_capabilities_resp(session, session->req,
+								buf, size))
 			return FALSE;
-		if (!(next && next->signal_id == AVDTP_GET_CAPABILITIES))
+		if (!getcap_pending(session, session->req))
 			finalize_discovery(session, 0);
 		return TRUE;
 	}
@@ -2675,6 +3032,8 @@ static gboolean avdtp_parse_rej(struct avdtp *session,
 			return FALSE;
 		error("GET_CAPABILITIES request rejected: %s (%d)",
 				avdtp_strerror(&err), err.err.error_code);
+		if (!getcap_pending(session, session->req))
+			finalize_discovery(session, 0);
 		return TRUE;
 	case AVDTP_OPEN:
 		if (!seid_rej_to_err(buf, size, &err))
@@ -2690,6 +3049,8 @@ static gboolean avdtp_parse_rej(struct avdtp *session,
 			return FALSE;
 		error("SET_CONFIGURATION request rejected: %s (%d)",
 				avdtp_strerror(&err), err.err.error_code);
+		/* The remote SEPs may have changed since they were cached */
+		session->seps_stale = TRUE;
 		if (sep && sep->cfm && sep->cfm->set_configuration)
 			sep->cfm->set_configuration(session, sep, stream,
 							&err, sep->user_data);
@@ -2747,6 +3108,48 @@ static gboolean avdtp_parse_rej(struct avdtp *session,
 	}
 }
 
+static gboolean pipelined_resp(struct avdtp *session, struct pending_req *req)
+{
+	struct avdtp_error err;
+	gboolean ret = TRUE;
+
+	if (session->in.signal_id != req->signal_id) {
+		error("Reponse signal doesn't match");
+		return TRUE;
+	}
+
+	session->pipeline = g_slist_remove(session->pipeline, req);
+
+	switch (session->in.message_type) {
+	case AVDTP_MSG_TYPE_ACCEPT:
+		debug("GET_CAPABILITIES request succeeded");
+		ret = avdtp_get_capabilities_resp(session, req,
+							(void *) session->in.data,
+							session->in.data_size);
+		break;
+	case AVDTP_MSG_TYPE_REJECT:
+		if (!seid_rej_to_err((void *) session->in.data,
+					session->in.data_size, &err)) {
+			ret = FALSE;
+			break;
+		}
+		error("GET_CAPABILITIES request rejected: %s (%d)",
+				avdtp_strerror(&err), err.err.error_code);
+		break;
+	default:
+		error("Unknown message type 0x%02X",
+						session->in.message_type);
+		break;
+	}
+
+	pending_req_free(req);
+
+	if (ret && !getcap_pending(session, NULL))
+		finalize_discovery(session, 0);
+
+	return ret;
+}
+
 gboolean avdtp_is_connected(const bdaddr_t *src, const bdaddr_t *dst)
 {
 	struct avdtp_server *server;
@@ -2842,24 +3245,34 @@ static int process_queue(struct avdtp *session)
 {
 	GSList **queue, *l;
 	struct pending_req *req;
+	int err;
 
-	if (session->req)
-		return 0;
+	/* Pipelined requests leave session->req free, so keep going until
+	 * a request occupies it */
+	while (!session->req) {
+		if (session->prio_queue)
+			queue = &session->prio_queue;
+		else
+			queue = &session->req_queue;
 
-	if (session->prio_queue)
-		queue = &session->prio_queue;
-	else
-		queue = &session->req_queue;
+		if (!*queue)
+			return 0;
 
-	if (!*queue)
-		return 0;
+		l = *queue;
+		req = l->data;
 
-	l = *queue;
-	req = l->data;
+		*queue = g_slist_remove(*queue, req);
 
-	*queue = g_slist_remove(*queue, req);
+		err = send_req(session, FALSE, req);
+		if (err < 0)
+			return err;
+
+		/* Not connected yet, the request went back to the queue */
+		if (session->state < AVDTP_SESSION_STATE_CONNECTED)
+			break;
+	}
 
-	return send_req(session, FALSE, req);
+	return 0;
 }
 
 struct avdtp_remote_sep *avdtp_get_remote_sep(struct avdtp *session,
@@ -2941,6 +3354,9 @@ int avdtp_discover(struct avdtp *session, avdtp_discover_cb_t cb,
 	if (ret == 0) {
 		session->discov_cb = cb;
 		session->user_data = user_data;
+		session->discovering = TRUE;
+		session->seps_partial = FALSE;
+		session->seps_complete = FALSE;
 	}
 
 	return ret;
@@ -2986,6 +3402,9 @@ int avdtp_get_seps(struct avdtp *session, uint8_t acp_type, uint8_t media_type,
 		}
 	}
 
+	/* Don't let a cached list hide a SEP the remote may have gained */
+	session->seps_stale = TRUE;
+
 	return -EINVAL;
 }
 
@@ -3458,6 +3877,9 @@ void avdtp_exit(const bdaddr_t *src)
 
 	servers = g_slist_remove(servers, server);
 
+	g_slist_foreach(server->sep_cache, (GFunc) sep_cache_free, NULL);
+	g_slist_free(server->sep_cache);
+
 	g_io_channel_shutdown(server->io, TRUE, NULL);
 	g_io_channel_unref(server->io);
 	g_free(server);
@@ -102,6 +102,16 @@
 #define FORWARD_OP		0x4b
 #define BACKWARD_OP		0x4c
 
+/* Passthrough commands in flight, each holding a transaction label */
+#define AVCTP_TX_WINDOW		4
+/* Time the target gets to answer before we stop waiting, in ms */
+#define AVCTP_TX_TIMEOUT	1000
+/* Presses of one key kept queued, further ones are dropped */
+#define AVCTP_MAX_REPEAT	32
+
+#define AVCTP_PASSTHROUGH_LENGTH (AVCTP_HEADER_LENGTH + \
+					AVRCP_HEADER_LENGTH + 2)
+
 static DBusConnection *connection = NULL;
 static gchar *input_device_name = NULL;
 static GSList *servers = NULL;
@@ -178,6 +188,20 @@ struct control {
 	uint16_t mtu;
 
 	gboolean target;
+
+	GSList *keys;		/* queued struct avctp_key */
+	uint8_t transaction;	/* next transaction label to try */
+	uint16_t tx_labels;	/* labels of outstanding commands */
+	uint16_t tx_stale;	/* labels of timed out commands */
+	unsigned int tx_pending;
+	guint tx_timer;
+	guint tx_watch;		/* waiting for room in the socket */
+};
+
+struct avctp_key {
+	uint8_t op;
+	unsigned int count;	/* presses left */
+	gboolean pressed;	/* release goes out next */
 };
 
 static struct {
@@ -323,25 +347,16 @@ static sdp_record_t *avrcp_tg_record()
 	return record;
 }
 
-static int send_event(int fd, uint16_t type, uint16_t code, int32_t value)
-{
-	struct uinput_event event;
-
-	memset(&event, 0, sizeof(event));
-	event.type	= type;
-	event.code	= code;
-	event.value	= value;
-
-	return write(fd, &event, sizeof(event));
-}
-
 static void send_key(int fd, uint16_t key, int pressed)
 {
+	struct uinput_batch batch;
+
 	if (fd < 0)
 		return;
 
-	send_event(fd, EV_KEY, key, pressed);
-	send_event(fd, EV_SYN, SYN_REPORT, 0);
+	uinput_batch_init(&batch, fd);
+	uinput_batch_key(&batch, key, pressed);
+	uinput_batch_flush(&batch);
 }
 
 static void handle_panel_passthrough(struct control *control,
@@ -375,6 +390,289 @@ static void handle_panel_passthrough(struct control *control,
 						operands[0] & 0x7F, status);
 }
 
+static void avctp_tx_clear(struct control *control)
+{
+	g_slist_foreach(control->keys, (GFunc) g_free, NULL);
+	g_slist_free(control->keys);
+	control->keys = NULL;
+
+	if (control->tx_timer) {
+		g_source_remove(control->tx_timer);
+		control->tx_timer = 0;
+	}
+
+	if (control->tx_watch) {
+		g_source_remove(control->tx_watch);
+		control->tx_watch = 0;
+	}
+
+	control->tx_labels = 0;
+	control->tx_stale = 0;
+	control->tx_pending = 0;
+}
+
+static void avctp_tx_flush(struct control *control);
+
+/* The target stopped answering, give up on the outstanding commands. Their
+ * labels stay reserved until a late response or the next timeout, so that
+ * such a response can't be taken for the answer to a newer command */
+static gboolean avctp_tx_timeout(gpointer user_data)
+{
+	struct control *control = user_data;
+
+	error("AVCTP: no response to %u passthrough commands",
+							control->tx_pending);
+
+	control->tx_timer = 0;
+	control->tx_stale = control->tx_labels;
+	control->tx_labels = 0;
+	control->tx_pending = 0;
+
+	avctp_tx_flush(control);
+
+	return FALSE;
+}
+
+static void avctp_tx_restart_timer(struct control *control)
+{
+	if (control->tx_timer)
+		g_source_remove(control->tx_timer);
+
+	control->tx_timer = 0;
+
+	if (control->tx_pending > 0)
+		control->tx_timer = g_timeout_add(AVCTP_TX_TIMEOUT,
+						avctp_tx_timeout, control);
+}
+
+static uint8_t avctp_tx_label(struct control *control)
+{
+	uint8_t label;
+
+	/* At most AVCTP_TX_WINDOW labels are outstanding and as many stale,
+	 * so one is free */
+	while ((control->tx_labels | control->tx_stale) &
+						(1 << control->transaction))
+		control->transaction = (control->transaction + 1) & 0x0f;
+
+	label = control->transaction;
+	control->transaction = (control->transaction + 1) & 0x0f;
+
+	control->tx_labels |= 1 << label;
+	control->tx_pending++;
+
+	return label;
+}
+
+static void avctp_tx_release(struct control *control, uint8_t label)
+{
+	control->tx_labels &= ~(1 << label);
+	control->tx_pending--;
+}
+
+static void avctp_build_passthrough(unsigned char *buf, uint8_t label,
+								uint8_t op)
+{
+	struct avctp_header *avctp = (void *) buf;
+	struct avrcp_header *avrcp = (void *) &buf[AVCTP_HEADER_LENGTH];
+	uint8_t *operands = &buf[AVCTP_HEADER_LENGTH + AVRCP_HEADER_LENGTH];
+
+	memset(buf, 0, AVCTP_PASSTHROUGH_LENGTH);
+
+	avctp->transaction = label;
+	avctp->packet_type = AVCTP_PACKET_SINGLE;
+	avctp->cr = AVCTP_COMMAND;
+	avctp->pid = htons(AV_REMOTE_SVCLASS_ID);
+
+	avrcp->code = CTYPE_CONTROL;
+	avrcp->subunit_type = SUBUNIT_PANEL;
+	avrcp->opcode = OP_PASSTHROUGH;
+
+	operands[0] = op;
+	operands[1] = 0;
+}
+
+/* Account for one frame of the head key having gone out */
+static void avctp_key_sent(struct control *control)
+{
+	struct avctp_key *key = control->keys->data;
+
+	if (!key->pressed) {
+		key->pressed = TRUE;
+		return;
+	}
+
+	key->pressed = FALSE;
+
+	if (--key->count == 0) {
+		control->keys = g_slist_remove(control->keys, key);
+		g_free(key);
+	}
+}
+
+static gboolean avctp_tx_writable(GIOChannel *chan, GIOCondition cond,
+							gpointer user_data)
+{
+	struct control *control = user_data;
+
+	control->tx_watch = 0;
+
+	if (!(cond & G_IO_NVAL))
+		avctp_tx_flush(control);
+
+	return FALSE;
+}
+
+/* Send as many press and release frames as the window allows. The queue
+ * only moves on for frames that really went out, so a press is never lost
+ * without its release */
+static void avctp_tx_flush(struct control *control)
+{
+	unsigned char frames[AVCTP_TX_WINDOW][AVCTP_PASSTHROUGH_LENGTH];
+	uint8_t labels[AVCTP_TX_WINDOW];
+	struct avctp_key *key = NULL;
+	unsigned int count = 0;
+	gboolean pressed = FALSE;
+	GSList *l;
+	int n, sent, sk, err = 0;
+
+	if (!control->io || control->tx_watch)
+		return;
+
+	l = control->keys;
+	if (l) {
+		key = l->data;
+		count = key->count;
+		pressed = key->pressed;
+	}
+
+	for (n = 0; l && control->tx_pending < AVCTP_TX_WINDOW; n++) {
+		uint8_t op = key->op;
+
+		if (pressed) {
+			/* Button release */
+			op |= 0x80;
+			pressed = FALSE;
+
+			if (--count == 0) {
+				l = l->next;
+				if (l) {
+					key = l->data;
+					count = key->count;
+					pressed = key->pressed;
+				}
+			}
+		} else
+			pressed = TRUE;
+
+		labels[n] = avctp_tx_label(control);
+		avctp_build_passthrough(frames[n], labels[n], op);
+	}
+
+	if (n == 0)
+		return;
+
+	sk = g_io_channel_unix_get_fd(control->io);
+
+	for (sent = 0; sent < n; sent++) {
+		if (send(sk, frames[sent], AVCTP_PASSTHROUGH_LENGTH,
+							MSG_DONTWAIT) < 0) {
+			err = errno;
+			break;
+		}
+
+		avctp_key_sent(control);
+	}
+
+	if (sent < n) {
+		while (n > sent)
+			avctp_tx_release(control, labels[--n]);
+
+		/* The rest stays queued, retry once the socket drains */
+		if (err == EAGAIN || err == EWOULDBLOCK)
+			control->tx_watch = g_io_add_watch(control->io,
+						G_IO_OUT | G_IO_NVAL,
+						avctp_tx_writable, control);
+		else
+			error("AVCTP: passthrough frames not sent: %s (%d)",
+							strerror(err), err);
+	}
+
+	if (!control->tx_timer)
+		avctp_tx_restart_timer(control);
+}
+
+static void avctp_tx_response(struct control *control,
+					struct avctp_header *avctp,
+					struct avrcp_header *avrcp)
+{
+	if (control->tx_stale & (1 << avctp->transaction)) {
+		debug("AVCTP: late response with transaction %u",
+							avctp->transaction);
+		control->tx_stale &= ~(1 << avctp->transaction);
+		return;
+	}
+
+	if (!(control->tx_labels & (1 << avctp->transaction))) {
+		debug("AVCTP: unexpected response with transaction %u",
+							avctp->transaction);
+		return;
+	}
+
+	if (avrcp->code != CTYPE_ACCEPTED)
+		debug("AVRCP: passthrough not accepted (0x%01X)",
+								avrcp->code);
+
+	avctp_tx_release(control, avctp->transaction);
+	avctp_tx_restart_timer(control);
+
+	avctp_tx_flush(control);
+}
+
+static uint8_t opposite_key(uint8_t op)
+{
+	switch (op) {
+	case VOL_UP_OP:
+		return VOL_DOWN_OP;
+	case VOL_DOWN_OP:
+		return VOL_UP_OP;
+	default:
+		return 0;
+	}
+}
+
+/* Queue one press and release of op. Repeats of the last queued key only
+ * bump its count, and a volume step cancels a queued opposite one that
+ * has not been pressed yet */
+static void avctp_queue_key(struct control *control, uint8_t op)
+{
+	GSList *last = g_slist_last(control->keys);
+	struct avctp_key *key = last ? last->data : NULL;
+
+	if (key && key->op == op) {
+		if (key->count < AVCTP_MAX_REPEAT)
+			key->count++;
+		else
+			debug("AVCTP: too many queued presses of 0x%02X", op);
+		return;
+	}
+
+	if (key && key->op == opposite_key(op) &&
+				key->count > (key->pressed ? 1U : 0U)) {
+		if (--key->count == 0) {
+			control->keys = g_slist_remove(control->keys, key);
+			g_free(key);
+		}
+		return;
+	}
+
+	key = g_new0(struct avctp_key, 1);
+	key->op = op;
+	key->count = 1;
+
+	control->keys = g_slist_append(control->keys, key);
+}
+
 static void avctp_disconnected(struct audio_device *dev)
 {
 	struct control *control = dev->control;
@@ -393,6 +691,8 @@ static void avctp_disconnected(struct audio_device *dev)
 		control->io_id = 0;
 	}
 
+	avctp_tx_clear(control);
+
 	if (control->uinput >= 0) {
 		ioctl(control->uinput, UI_DEV_DESTROY);
 		close(control->uinput);
@@ -499,6 +799,12 @@ static gboolean control_cb(GIOChannel *chan, GIOCondition cond,
 			avrcp->code, avrcp->subunit_type, avrcp->subunit_id,
 			avrcp->opcode, operand_count);
 
+	/* Answers to our passthrough commands */
+	if (avctp->cr == AVCTP_RESPONSE) {
+		avctp_tx_response(control, avctp, avrcp);
+		return TRUE;
+	}
+
 	if (avctp->packet_type != AVCTP_PACKET_SINGLE) {
 		avctp->cr = AVCTP_RESPONSE;
 		avrcp->code = CTYPE_NOT_IMPLEMENTED;
@@ -543,66 +849,11 @@ failed:
 	return FALSE;
 }
 
-static int uinput_create(char *name)
-{
-	struct uinput_dev dev;
-	int fd, err, i;
-
-	fd = open("/dev/uinput", O_RDWR);
-	if (fd < 0) {
-		fd = open("/dev/input/uinput", O_RDWR);
-		if (fd < 0) {
-			fd = open("/dev/misc/uinput", O_RDWR);
-			if (fd < 0) {
-				err = errno;
-				error("Can't open input device: %s (%d)",
-							strerror(err), err);
-				return -err;
-			}
-		}
-	}
-
-	memset(&dev, 0, sizeof(dev));
-	if (name)
-		strncpy(dev.name, name, UINPUT_MAX_NAME_SIZE - 1);
-
-	dev.id.bustype = BUS_BLUETOOTH;
-	dev.id.vendor  = 0x0000;
-	dev.id.product = 0x0000;
-	dev.id.version = 0x0000;
-
-	if (write(fd, &dev, sizeof(dev)) < 0) {
-		err = errno;
-		error("Can't write device information: %s (%d)",
-						strerror(err), err);
-		close(fd);
-		errno = err;
-		return -err;
-	}
-
-	ioctl(fd, UI_SET_EVBIT, EV_KEY);
-	ioctl(fd, UI_SET_EVBIT, EV_REL);
-	ioctl(fd, UI_SET_EVBIT, EV_REP);
-	ioctl(fd, UI_SET_EVBIT, EV_SYN);
-
-	for (i = 0; key_map[i].name != NULL; i++)
-		ioctl(fd, UI_SET_KEYBIT, key_map[i].uinput);
-
-	if (ioctl(fd, UI_DEV_CREATE, NULL) < 0) {
-		err = errno;
-		error("Can't create uinput device: %s (%d)",
-						strerror(err), err);
-		close(fd);
-		errno = err;
-		return -err;
-	}
-
-	return fd;
-}
-
 static void init_uinput(struct control *control)
 {
+	unsigned int keys[G_N_ELEMENTS(key_map)];
 	char address[18], *name;
+	int i;
 
 	ba2str(&control->dev->dst, address);
 
@@ -611,9 +862,15 @@ static void init_uinput(struct control *control)
 	if (!name)
 		name = address;
 
-	control->uinput = uinput_create(name);
+	for (i = 0; key_map[i].name != NULL; i++)
+		keys[i] = key_map[i].uinput;
+
+	control->uinput = uinput_create(name, 0x0000, 0x0000,
+				(1 << EV_KEY) | (1 << EV_REL) |
+				(1 << EV_REP) | (1 << EV_SYN), keys, i);
 	if (control->uinput < 0)
-		error("AVRCP: failed to init uinput for %s", address);
+		error("AVRCP: failed to init uinput for %s: %s (%d)", address,
+				strerror(-control->uinput), -control->uinput);
 	else
 		debug("AVRCP: uinput initialized for %s", address);
 }
@@ -926,96 +1183,92 @@ static DBusMessage *control_is_connected(DBusConnection *conn,
 	return reply;
 }
 
-static int avctp_send_passthrough(struct control *control, uint8_t op)
+static DBusMessage *control_check_target(DBusMessage *msg,
+						struct control *control)
 {
-	unsigned char buf[AVCTP_HEADER_LENGTH + AVRCP_HEADER_LENGTH + 2];
-	struct avctp_header *avctp = (void *) buf;
-	struct avrcp_header *avrcp = (void *) &buf[AVCTP_HEADER_LENGTH];
-	uint8_t *operands = &buf[AVCTP_HEADER_LENGTH + AVRCP_HEADER_LENGTH];
-	int err, sk = g_io_channel_unix_get_fd(control->io);
-	static uint8_t transaction = 0;
-
-	memset(buf, 0, sizeof(buf));
+	if (control->state != AVCTP_STATE_CONNECTED)
+		return g_dbus_create_error(msg,
+					ERROR_INTERFACE ".NotConnected",
+					"Device not Connected");
 
-	avctp->transaction = transaction++;
-	avctp->packet_type = AVCTP_PACKET_SINGLE;
-	avctp->cr = AVCTP_COMMAND;
-	avctp->pid = htons(AV_REMOTE_SVCLASS_ID);
+	if (!control->target)
+		return g_dbus_create_error(msg,
+					ERROR_INTERFACE ".NotSupported",
+					"AVRCP Target role not supported");
 
-	avrcp->code = CTYPE_CONTROL;
-	avrcp->subunit_type = SUBUNIT_PANEL;
-	avrcp->opcode = OP_PASSTHROUGH;
+	return NULL;
+}
 
-	operands[0] = op & 0x7f;
-	operands[1] = 0;
+static DBusMessage *volume_up(DBusConnection *conn, DBusMessage *msg,
+								void *data)
+{
+	struct audio_device *device = data;
+	struct control *control = device->control;
+	DBusMessage *reply;
 
-	err = write(sk, buf, sizeof(buf));
-	if (err < 0)
-		return err;
+	reply = control_check_target(msg, control);
+	if (reply)
+		return reply;
 
-	/* Button release */
-	avctp->transaction = transaction++;
-	operands[0] |= 0x80;
+	avctp_queue_key(control, VOL_UP_OP);
+	avctp_tx_flush(control);
 
-	return write(sk, buf, sizeof(buf));
+	return dbus_message_new_method_return(msg);
 }
 
-static DBusMessage *volume_up(DBusConnection *conn, DBusMessage *msg,
+static DBusMessage *volume_down(DBusConnection *conn, DBusMessage *msg,
 								void *data)
 {
 	struct audio_device *device = data;
 	struct control *control = device->control;
 	DBusMessage *reply;
-	int err;
-
-	reply = dbus_message_new_method_return(msg);
-	if (!reply)
-		return NULL;
 
-	if (control->state != AVCTP_STATE_CONNECTED)
-		return g_dbus_create_error(msg,
-					ERROR_INTERFACE ".NotConnected",
-					"Device not Connected");
+	reply = control_check_target(msg, control);
+	if (reply)
+		return reply;
 
-	if (!control->target)
-		return g_dbus_create_error(msg,
-					ERROR_INTERFACE ".NotSupported",
-					"AVRCP Target role not supported");
-
-	err = avctp_send_passthrough(control, VOL_UP_OP);
-	if (err < 0)
-		return g_dbus_create_error(msg, ERROR_INTERFACE ".Failed",
-							strerror(-err));
+	avctp_queue_key(control, VOL_DOWN_OP);
+	avctp_tx_flush(control);
 
 	return dbus_message_new_method_return(msg);
 }
 
-static DBusMessage *volume_down(DBusConnection *conn, DBusMessage *msg,
+static DBusMessage *send_keys(DBusConnection *conn, DBusMessage *msg,
 								void *data)
 {
 	struct audio_device *device = data;
 	struct control *control = device->control;
 	DBusMessage *reply;
-	int err;
-
-	reply = dbus_message_new_method_return(msg);
-	if (!reply)
-		return NULL;
+	uint8_t *ops;
+	int count, i, j;
 
-	if (control->state != AVCTP_STATE_CONNECTED)
+	if (!dbus_message_get_args(msg, NULL,
+				DBUS_TYPE_ARRAY, DBUS_TYPE_BYTE, &ops, &count,
+				DBUS_TYPE_INVALID))
 		return g_dbus_create_error(msg,
-					ERROR_INTERFACE ".NotConnected",
-					"Device not Connected");
+					ERROR_INTERFACE ".InvalidArguments",
+					"Invalid arguments in method call");
 
-	if (!control->target)
-		return g_dbus_create_error(msg,
-					ERROR_INTERFACE ".NotSupported",
-					"AVRCP Target role not supported");
+	for (i = 0; i < count; i++) {
+		for (j = 0; key_map[j].name != NULL; j++) {
+			if (key_map[j].avrcp == ops[i])
+				break;
+		}
+
+		if (key_map[j].name == NULL)
+			return g_dbus_create_error(msg,
+					ERROR_INTERFACE ".InvalidArguments",
+					"Unknown operation 0x%02X", ops[i]);
+	}
+
+	reply = control_check_target(msg, control);
+	if (reply)
+		return reply;
+
+	for (i = 0; i < count; i++)
+		avctp_queue_key(control, ops[i]);
 
-	err = avctp_send_passthrough(control, VOL_DOWN_OP);
-	if (err < 0)
-		return g_dbus_create_error(msg, ERROR_INTERFACE ".Failed",
-							strerror(-err));
+	avctp_tx_flush(control);
 
 	return dbus_message_new_method_return(msg);
 }
@@ -1055,6 +1308,7 @@ static GDBusMethodTable control_methods[] = {
 	{ "GetProperties",	"",	"a{sv}",control_get_properties },
 	{ "VolumeUp",		"",	"",	volume_up },
 	{ "VolumeDown",		"",	"",	volume_down },
+	{ "SendKeys",		"ay",	"",	send_keys },
 	{ NULL, NULL, NULL, NULL }
 };
 
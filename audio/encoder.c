@@ -0,0 +1,579 @@
+/*
+ *
+ *  BlueZ - Bluetooth protocol stack for Linux
+ *
+ *  Copyright (C) 2004-2009  Marcel Holtmann <marcel@holtmann.org>
+ *
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdint.h>
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+
+#include <bluetooth/bluetooth.h>
+
+#include <glib.h>
+#include <dbus/dbus.h>
+
+#include "logging.h"
+#include "ipc.h"
+#include "sbc.h"
+#include "rtp.h"
+#include "pacing.h"
+#include "device.h"
+#include "avdtp.h"
+#include "a2dp.h"
+#include "encoder.h"
+
+#ifndef MFD_CLOEXEC
+#define MFD_CLOEXEC		0x0001U
+#endif
+
+#ifndef MFD_ALLOW_SEALING
+#define MFD_ALLOW_SEALING	0x0002U
+#endif
+
+#ifndef F_ADD_SEALS
+#define F_ADD_SEALS		1033
+#define F_SEAL_SHRINK		0x0002
+#define F_SEAL_GROW		0x0004
+#endif
+
+/* Packets we aim to keep queued in the transport socket */
+#define ENCODER_QUEUE_TARGET	2
+
+/* Packets the transport socket buffer is sized for */
+#define ENCODER_SNDBUF_PACKETS	10
+
+struct pcm_ring {
+	unsigned int id;
+	struct bt_pcm_ring *shm;
+	size_t len;
+	uint32_t size;		/* of shm->data, never read back from shm */
+	uint32_t tail;		/* our copy, the client can scribble on shm */
+};
+
+struct a2dp_encoder {
+	struct avdtp *session;
+	struct a2dp_sep *sep;
+	struct avdtp_stream *stream;
+	unsigned int cb_id;
+	int sk;
+	uint16_t omtu;
+	sbc_t sbc;
+	unsigned int codesize;		/* PCM bytes per SBC frame */
+	unsigned int frame_duration;	/* us */
+	unsigned int frames;		/* SBC frames per packet */
+	unsigned int channels;
+	struct a2dp_pacing pacing;
+	struct a2dp_bitpool bitpool;
+	guint watch;			/* pacing timer */
+	guint stop_id;
+	int16_t *mix;			/* one packet worth of mixed PCM */
+	uint8_t *packets;		/* A2DP_MAX_BATCH packets of omtu */
+	uint16_t seq_num;
+	uint32_t timestamp;		/* in samples */
+	GSList *rings;
+};
+
+static gboolean enabled = FALSE;
+
+static GSList *encoders = NULL;
+
+static unsigned int next_id = 0;
+
+static void encoder_schedule(struct a2dp_encoder *enc);
+
+static int memfd_new(const char *name, size_t len)
+{
+#ifdef __NR_memfd_create
+	int fd;
+
+	fd = syscall(__NR_memfd_create, name, MFD_CLOEXEC | MFD_ALLOW_SEALING);
+	if (fd < 0)
+		return -errno;
+
+	if (ftruncate(fd, len) < 0) {
+		int err = -errno;
+		close(fd);
+		return err;
+	}
+
+	/* A client truncating the ring would fault us on the next mix */
+	if (fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW) < 0) {
+		int err = -errno;
+		close(fd);
+		return err;
+	}
+
+	return fd;
+#else
+	return -ENOSYS;
+#endif
+}
+
+void a2dp_encoder_enable(gboolean enable)
+{
+	int fd;
+
+	if (enable) {
+		fd = memfd_new("bluetooth-pcm", 1);
+		if (fd < 0) {
+			error("Shared PCM streams unavailable: %s (%d)",
+							strerror(-fd), -fd);
+			enable = FALSE;
+		} else
+			close(fd);
+	}
+
+	enabled = enable;
+}
+
+gboolean a2dp_encoder_enabled(void)
+{
+	return enabled;
+}
+
+static void ring_free(struct pcm_ring *ring)
+{
+	/* A client still writing finds out it has to reopen */
+	ring->shm->flags |= BT_PCM_RING_CLOSED;
+	munmap(ring->shm, ring->len);
+	g_free(ring);
+}
+
+/* Add up to samples samples of ring into mix, returns the number used */
+static unsigned int ring_mix(struct pcm_ring *ring, int16_t *mix,
+				unsigned int samples, unsigned int channels)
+{
+	struct bt_pcm_ring *shm = ring->shm;
+	uint32_t mask = ring->size - 1;
+	uint32_t tail = ring->tail;
+	uint32_t fill;
+	unsigned int avail, i;
+
+	__sync_synchronize();
+
+	/* The mapping is client writable, so bound whatever it says by
+	 * our own ring size and keep the indices sample aligned */
+	fill = (shm->head & ~1U) - tail;
+	if (fill > ring->size)
+		fill = ring->size;
+
+	/* Only whole sample frames, a client may be mid-write */
+	avail = fill / 2;
+	avail -= avail % channels;
+	if (avail > samples)
+		avail = samples;
+
+	for (i = 0; i < avail; i++) {
+		int16_t *pcm = (void *) (shm->data + ((tail + i * 2) & mask));
+		int32_t s = mix[i] + *pcm;
+
+		mix[i] = s > INT16_MAX ? INT16_MAX :
+				(s < INT16_MIN ? INT16_MIN : s);
+	}
+
+	__sync_synchronize();
+	ring->tail = tail + avail * 2;
+	shm->tail = ring->tail;
+
+	if (avail < samples)
+		shm->underruns++;
+
+	return avail;
+}
+
+/* Mix the rings into one packet at buf, returns its length */
+static size_t encoder_packet(struct a2dp_encoder *enc, uint8_t *buf)
+{
+	struct rtp_header *header = (void *) buf;
+	struct rtp_payload *payload = (void *) (buf + sizeof(*header));
+	size_t count = sizeof(*header) + sizeof(*payload);
+	unsigned int samples = enc->frames * enc->codesize / 2;
+	const uint8_t *pcm = (void *) enc->mix;
+	unsigned int i;
+	GSList *l;
+
+	memset(enc->mix, 0, samples * 2);
+
+	for (l = enc->rings; l; l = l->next)
+		ring_mix(l->data, enc->mix, samples, enc->channels);
+
+	memset(buf, 0, count);
+	header->v = 2;
+	header->pt = 1;
+	header->sequence_number = htons(enc->seq_num++);
+	header->timestamp = htonl(enc->timestamp);
+	header->ssrc = htonl(1);
+
+	for (i = 0; i < enc->frames; i++) {
+		ssize_t encoded;
+		size_t written;
+
+		encoded = sbc_encode(&enc->sbc, pcm, enc->codesize,
+					buf + count, enc->omtu - count,
+					&written);
+		if (encoded <= 0)
+			break;
+
+		pcm += encoded;
+		count += written;
+	}
+
+	payload->frame_count = i;
+	enc->timestamp += samples / enc->channels;
+
+	return count;
+}
+
+static gboolean encoder_tick(GIOChannel *chan, GIOCondition cond,
+							gpointer data)
+{
+	struct a2dp_encoder *enc = data;
+	struct iovec iov[A2DP_MAX_BATCH];
+	unsigned int duration = 0;
+	int count = 0, ret, err = 0;
+
+	if (!a2dp_pacing_expired(&enc->pacing))
+		return TRUE;
+
+	/* Catch up with every packet that is already due */
+	do {
+		uint8_t *buf = enc->packets + count * enc->omtu;
+
+		iov[count].iov_base = buf;
+		iov[count].iov_len = encoder_packet(enc, buf);
+		duration += enc->frames * enc->frame_duration;
+		count++;
+	} while (count < A2DP_MAX_BATCH &&
+			a2dp_pacing_due(&enc->pacing, duration));
+
+	ret = a2dp_send_packets(enc->sk, iov, count,
+					MSG_DONTWAIT | MSG_NOSIGNAL);
+	if (ret < 0) {
+		err = errno;
+		debug("encoder: send failed: %s (%d)", strerror(err), err);
+	} else if (ret < count)
+		err = EAGAIN;
+
+	/* The socket is non-blocking, so a full send queue shows up as
+	 * EAGAIN rather than as send latency */
+	if (a2dp_bitpool_update(&enc->bitpool,
+				a2dp_pacing_update(&enc->pacing),
+				err == EAGAIN ? 2 * enc->bitpool.max_latency
+									: 0)) {
+		enc->sbc.bitpool = enc->bitpool.bitpool;
+		debug("encoder: bitpool %u", enc->sbc.bitpool);
+	}
+
+	a2dp_pacing_next(&enc->pacing, duration);
+
+	return TRUE;
+}
+
+static gboolean encoder_timeout(gpointer data)
+{
+	struct a2dp_encoder *enc = data;
+
+	enc->watch = 0;
+	encoder_tick(NULL, 0, enc);
+	encoder_schedule(enc);
+
+	return FALSE;
+}
+
+static void encoder_schedule(struct a2dp_encoder *enc)
+{
+	GIOChannel *io;
+
+	if (enc->watch)
+		return;
+
+	if (enc->pacing.fd < 0) {
+		/* No timerfd, poll the schedule from a timeout instead */
+		enc->watch = g_timeout_add(a2dp_pacing_timeout(&enc->pacing),
+						encoder_timeout, enc);
+		return;
+	}
+
+	io = g_io_channel_unix_new(enc->pacing.fd);
+	enc->watch = g_io_add_watch(io, G_IO_IN, encoder_tick, enc);
+	g_io_channel_unref(io);
+}
+
+static void encoder_free(struct a2dp_encoder *enc)
+{
+	encoders = g_slist_remove(encoders, enc);
+
+	if (enc->watch)
+		g_source_remove(enc->watch);
+
+	if (enc->stop_id)
+		g_source_remove(enc->stop_id);
+
+	if (enc->cb_id)
+		avdtp_stream_remove_cb(enc->session, enc->stream, enc->cb_id);
+
+	g_slist_foreach(enc->rings, (GFunc) ring_free, NULL);
+	g_slist_free(enc->rings);
+
+	a2dp_sep_unlock(enc->sep, enc->session);
+	avdtp_unref(enc->session);
+
+	a2dp_pacing_close(&enc->pacing);
+	sbc_finish(&enc->sbc);
+	g_free(enc->mix);
+	g_free(enc->packets);
+	g_free(enc);
+}
+
+static gboolean encoder_stop(gpointer data)
+{
+	struct a2dp_encoder *enc = data;
+
+	enc->stop_id = 0;
+	encoder_free(enc);
+
+	return FALSE;
+}
+
+static void encoder_state_changed(struct avdtp_stream *stream,
+					avdtp_state_t old_state,
+					avdtp_state_t new_state,
+					struct avdtp_error *err,
+					void *user_data)
+{
+	struct a2dp_encoder *enc = user_data;
+
+	if (new_state == AVDTP_STATE_STREAMING || enc->stop_id)
+		return;
+
+	debug("encoder: stream left streaming state, closing rings");
+
+	if (enc->watch) {
+		g_source_remove(enc->watch);
+		enc->watch = 0;
+	}
+
+	/* The callback list is being walked and goes away with an idle
+	 * stream, so only drop our entry from an idle handler */
+	if (new_state == AVDTP_STATE_IDLE)
+		enc->cb_id = 0;
+
+	enc->stop_id = g_idle_add(encoder_stop, enc);
+}
+
+static gboolean encoder_setup_sbc(struct a2dp_encoder *enc,
+					struct sbc_codec_cap *cap)
+{
+	sbc_init(&enc->sbc, 0);
+
+	if (cap->frequency & SBC_SAMPLING_FREQ_48000)
+		enc->sbc.frequency = SBC_FREQ_48000;
+	else if (cap->frequency & SBC_SAMPLING_FREQ_44100)
+		enc->sbc.frequency = SBC_FREQ_44100;
+	else if (cap->frequency & SBC_SAMPLING_FREQ_32000)
+		enc->sbc.frequency = SBC_FREQ_32000;
+	else
+		enc->sbc.frequency = SBC_FREQ_16000;
+
+	if (cap->channel_mode & SBC_CHANNEL_MODE_JOINT_STEREO)
+		enc->sbc.mode = SBC_MODE_JOINT_STEREO;
+	else if (cap->channel_mode & SBC_CHANNEL_MODE_STEREO)
+		enc->sbc.mode = SBC_MODE_STEREO;
+	else if (cap->channel_mode & SBC_CHANNEL_MODE_DUAL_CHANNEL)
+		enc->sbc.mode = SBC_MODE_DUAL_CHANNEL;
+	else
+		enc->sbc.mode = SBC_MODE_MONO;
+
+	enc->sbc.allocation = cap->allocation_method == SBC_ALLOCATION_SNR ?
+					SBC_AM_SNR : SBC_AM_LOUDNESS;
+	enc->sbc.subbands = cap->subbands == SBC_SUBBANDS_4 ?
+					SBC_SB_4 : SBC_SB_8;
+
+	if (cap->block_length & SBC_BLOCK_LENGTH_16)
+		enc->sbc.blocks = SBC_BLK_16;
+	else if (cap->block_length & SBC_BLOCK_LENGTH_12)
+		enc->sbc.blocks = SBC_BLK_12;
+	else if (cap->block_length & SBC_BLOCK_LENGTH_8)
+		enc->sbc.blocks = SBC_BLK_8;
+	else
+		enc->sbc.blocks = SBC_BLK_4;
+
+	enc->sbc.bitpool = cap->max_bitpool;
+	enc->channels = enc->sbc.mode == SBC_MODE_MONO ? 1 : 2;
+	enc->codesize = sbc_get_codesize(&enc->sbc);
+	enc->frame_duration = sbc_get_frame_duration(&enc->sbc);
+	enc->frames = (enc->omtu - sizeof(struct rtp_header) -
+			sizeof(struct rtp_payload)) /
+			sbc_get_frame_length(&enc->sbc);
+
+	return enc->frames > 0;
+}
+
+struct a2dp_encoder *a2dp_encoder_find(struct avdtp *session)
+{
+	GSList *l;
+
+	for (l = encoders; l; l = l->next) {
+		struct a2dp_encoder *enc = l->data;
+
+		if (enc->session == session && !enc->stop_id)
+			return enc;
+	}
+
+	return NULL;
+}
+
+struct a2dp_encoder *a2dp_encoder_new(struct avdtp *session,
+					struct a2dp_sep *sep,
+					struct avdtp_stream *stream)
+{
+	struct a2dp_encoder *enc;
+	struct avdtp_service_capability *cap;
+	struct sbc_codec_cap *sbc_cap;
+	int bytes;
+
+	cap = avdtp_stream_get_codec(stream);
+	sbc_cap = (void *) cap->data;
+	if (sbc_cap->cap.media_codec_type != A2DP_CODEC_SBC)
+		return NULL;
+
+	enc = g_new0(struct a2dp_encoder, 1);
+
+	if (!avdtp_stream_get_transport(stream, &enc->sk, NULL, &enc->omtu,
+								NULL) ||
+			!encoder_setup_sbc(enc, sbc_cap)) {
+		error("encoder: unusable transport");
+		sbc_finish(&enc->sbc);
+		g_free(enc);
+		return NULL;
+	}
+
+	enc->session = avdtp_ref(session);
+	enc->sep = sep;
+	enc->stream = stream;
+	enc->mix = g_malloc(enc->frames * enc->codesize);
+	enc->packets = g_malloc(A2DP_MAX_BATCH * enc->omtu);
+
+	bytes = enc->omtu * ENCODER_SNDBUF_PACKETS;
+	setsockopt(enc->sk, SOL_SOCKET, SO_SNDBUF, &bytes, sizeof(bytes));
+
+	a2dp_pacing_init(&enc->pacing);
+	a2dp_pacing_start(&enc->pacing, enc->sk,
+				enc->omtu * ENCODER_QUEUE_TARGET);
+
+	/* A packet taking more than half its own duration to go out means
+	 * the link can't keep up with the current bitpool */
+	a2dp_bitpool_init(&enc->bitpool,
+				MAX(MIN_BITPOOL, sbc_cap->min_bitpool),
+				enc->sbc.bitpool,
+				enc->omtu * ENCODER_QUEUE_TARGET,
+				enc->frames * enc->frame_duration / 2);
+
+	enc->cb_id = avdtp_stream_add_cb(session, stream,
+					encoder_state_changed, enc);
+
+	encoder_schedule(enc);
+
+	encoders = g_slist_append(encoders, enc);
+
+	debug("encoder: %u frames of %u bytes per packet, %u channels",
+			enc->frames, enc->codesize, enc->channels);
+
+	return enc;
+}
+
+struct avdtp_stream *a2dp_encoder_get_stream(struct a2dp_encoder *enc)
+{
+	return enc->stream;
+}
+
+unsigned int a2dp_encoder_attach(struct a2dp_encoder *enc, int *fd)
+{
+	struct pcm_ring *ring;
+	size_t len = sizeof(struct bt_pcm_ring) + BT_PCM_RING_SIZE;
+	void *shm;
+
+	*fd = memfd_new("bluetooth-pcm", len);
+	if (*fd < 0) {
+		error("encoder: memfd: %s (%d)", strerror(-*fd), -*fd);
+		goto failed;
+	}
+
+	shm = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, *fd, 0);
+	if (shm == MAP_FAILED) {
+		error("encoder: mmap: %s (%d)", strerror(errno), errno);
+		close(*fd);
+		goto failed;
+	}
+
+	ring = g_new0(struct pcm_ring, 1);
+	ring->id = ++next_id;
+	ring->shm = shm;
+	ring->len = len;
+	ring->size = BT_PCM_RING_SIZE;
+	ring->shm->size = BT_PCM_RING_SIZE;
+
+	enc->rings = g_slist_append(enc->rings, ring);
+
+	return ring->id;
+
+failed:
+	*fd = -1;
+
+	if (!enc->rings)
+		encoder_free(enc);
+
+	return 0;
+}
+
+void a2dp_encoder_detach(unsigned int id)
+{
+	GSList *l, *r;
+
+	for (l = encoders; l; l = l->next) {
+		struct a2dp_encoder *enc = l->data;
+
+		for (r = enc->rings; r; r = r->next) {
+			struct pcm_ring *ring = r->data;
+
+			if (ring->id != id)
+				continue;
+
+			enc->rings = g_slist_remove(enc->rings, ring);
+			ring_free(ring);
+
+			if (!enc->rings)
+				encoder_free(enc);
+
+			return;
+		}
+	}
+}
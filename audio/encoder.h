@@ -0,0 +1,51 @@
+/*
+ *
+ *  BlueZ - Bluetooth protocol stack for Linux
+ *
+ *  Copyright (C) 2004-2009  Marcel Holtmann <marcel@holtmann.org>
+ *
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+/* In-daemon SBC encoder for BT_FLAG_SHARED_PCM streams.
+ *
+ * One encoder runs per streaming sink. Clients get a shared memory
+ * struct bt_pcm_ring each, which the encoder mixes and paces onto the
+ * transport from the main loop. The encoder holds the SEP lock and a
+ * session reference for as long as it has rings attached. */
+
+struct a2dp_encoder;
+
+/* Enabled from the SharedPCM option, if the kernel has memfd */
+void a2dp_encoder_enable(gboolean enable);
+gboolean a2dp_encoder_enabled(void);
+
+struct a2dp_encoder *a2dp_encoder_find(struct avdtp *session);
+
+/* Take over sep's lock and start encoding onto stream, which must be
+ * streaming. The encoder goes away with its last ring */
+struct a2dp_encoder *a2dp_encoder_new(struct avdtp *session,
+					struct a2dp_sep *sep,
+					struct avdtp_stream *stream);
+
+struct avdtp_stream *a2dp_encoder_get_stream(struct a2dp_encoder *enc);
+
+/* Add a ring, returns its id and the memfd to hand to the client in *fd,
+ * which the caller closes once sent. On failure 0 is returned and an
+ * encoder without rings is freed */
+unsigned int a2dp_encoder_attach(struct a2dp_encoder *enc, int *fd);
+void a2dp_encoder_detach(unsigned int id);
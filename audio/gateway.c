@@ -29,6 +29,7 @@
 
 #include <stdint.h>
 #include <stdlib.h>
+#include <stdarg.h>
 #include <string.h>
 #include <fcntl.h>
 #include <errno.h>
@@ -51,11 +52,12 @@
 #include "error.h"
 #include "btio.h"
 #include "dbus-common.h"
+#include "at.h"
 
-#define RFCOMM_BUF_SIZE 256
 /* not-more-then-16 defined by GSM + 1 for NULL + padding */
 #define AG_INDICATOR_DESCR_SIZE 20
-#define AG_CALLER_NUM_SIZE 64	/* size of number + type */
+/* Seconds to wait for the final result code of a command */
+#define AG_CMD_TIMEOUT 5
 
 /* commands */
 #define AG_FEATURES "AT+BRSF=26\r"     /* = 0x7F = All features supported */
@@ -92,9 +94,6 @@
  * functionality is optional for the HF. */
 #define AG_CHLD_4 0x40
 
-#define OK_RESPONSE "\r\nOK\r\n"
-#define ERROR_RESPONSE "\r\nERROR\r\n"
-
 struct indicator {
 	gchar descr[AG_INDICATOR_DESCR_SIZE];
 	gint value;
@@ -116,6 +115,30 @@ struct gateway {
 
 	int sp_gain;
 	int mic_gain;
+
+	struct at_parser parser;
+
+	GSList *cmd_queue;
+	struct ag_cmd *cmd_pending;
+	guint cmd_timer;
+};
+
+typedef void (*ag_rsp_cb) (struct audio_device *dev, struct at_command *rsp,
+							void *user_data);
+typedef void (*ag_done_cb) (struct audio_device *dev, gboolean ok,
+							void *user_data);
+
+struct ag_cmd {
+	gchar *cmd;
+	const char *prefix;	/* intermediate result code for rsp_cb */
+	ag_rsp_cb rsp_cb;
+	ag_done_cb done_cb;
+	void *user_data;
+};
+
+struct result {
+	const char *name;
+	void (*callback) (struct audio_device *device, struct at_command *cmd);
 };
 
 static gboolean rfcomm_ag_data_cb(GIOChannel *chan, GIOCondition cond,
@@ -132,13 +155,6 @@ static void rfcomm_start_watch(struct audio_device *dev)
 			(GIOFunc) rfcomm_ag_data_cb, dev);
 }
 
-static void rfcomm_stop_watch(struct audio_device *dev)
-{
-	struct gateway *gw = dev->gateway;
-
-	g_source_remove(gw->rfcomm_watch_id);
-}
-
 static gboolean io_channel_write_all(GIOChannel *io, gchar *data,
 					gsize count)
 {
@@ -157,36 +173,126 @@ static gboolean io_channel_write_all(GIOChannel *io, gchar *data,
 	return TRUE;
 }
 
-/* it's worth to mention that data and response could be the same pointers */
-static gboolean rfcomm_send_and_read(struct gateway *gw, gchar *data,
-                                    gchar *response, gsize count)
+static void ag_cmd_free(struct ag_cmd *cmd)
 {
-	GIOChannel *rfcomm = gw->rfcomm;
-	gsize read = 0;
-	gboolean got_ok = FALSE;
-	gboolean got_error = FALSE;
-	gchar *resp_buf = response;
-	gsize toread = RFCOMM_BUF_SIZE - 1;
-	GIOStatus status;
+	g_free(cmd->cmd);
+	g_free(cmd);
+}
 
-	if (!io_channel_write_all(rfcomm, data, count))
-		return FALSE;
+static void ag_cmd_send_next(struct audio_device *dev);
 
-	while (!(got_ok || got_error)) {
-		status = g_io_channel_read_chars(rfcomm, resp_buf, toread,
-						&read, NULL);
-		if (status == G_IO_STATUS_NORMAL)
-			resp_buf[read] = '\0';
-		else {
-			debug("rfcomm_send_and_read(): %m");
-			return FALSE;
-		}
-		got_ok = NULL != strstr(resp_buf, OK_RESPONSE);
-		got_error = NULL != strstr(resp_buf, ERROR_RESPONSE);
-		resp_buf += read;
-		toread -= read;
+static void ag_cmd_complete(struct audio_device *dev, gboolean ok)
+{
+	struct gateway *gw = dev->gateway;
+	struct ag_cmd *cmd = gw->cmd_pending;
+
+	gw->cmd_pending = NULL;
+
+	if (gw->cmd_timer) {
+		g_source_remove(gw->cmd_timer);
+		gw->cmd_timer = 0;
 	}
-	return TRUE;
+
+	if (cmd->done_cb)
+		cmd->done_cb(dev, ok, cmd->user_data);
+
+	ag_cmd_free(cmd);
+
+	ag_cmd_send_next(dev);
+}
+
+static gboolean ag_cmd_timeout(gpointer user_data)
+{
+	struct audio_device *dev = user_data;
+	struct gateway *gw = dev->gateway;
+
+	error("AG did not answer %.*s in time",
+			(int) strlen(gw->cmd_pending->cmd) - 1,
+			gw->cmd_pending->cmd);
+
+	gw->cmd_timer = 0;
+	ag_cmd_complete(dev, FALSE);
+
+	return FALSE;
+}
+
+/* The AG handles one command at a time, the next one is written as soon
+ * as the final result code of the previous one has been parsed */
+static void ag_cmd_send_next(struct audio_device *dev)
+{
+	struct gateway *gw = dev->gateway;
+	struct ag_cmd *cmd;
+
+	if (gw->cmd_pending || !gw->cmd_queue || !gw->rfcomm)
+		return;
+
+	cmd = gw->cmd_queue->data;
+	gw->cmd_queue = g_slist_remove(gw->cmd_queue, cmd);
+	gw->cmd_pending = cmd;
+
+	if (!io_channel_write_all(gw->rfcomm, cmd->cmd, strlen(cmd->cmd))) {
+		error("Unable to send command to AG");
+		ag_cmd_complete(dev, FALSE);
+		return;
+	}
+
+	gw->cmd_timer = g_timeout_add_seconds(AG_CMD_TIMEOUT,
+						ag_cmd_timeout, dev);
+}
+
+/* Queue a command, rsp_cb gets the intermediate result codes named prefix
+ * and done_cb the outcome once OK or an error is received */
+static void ag_cmd_queue(struct audio_device *dev, const char *prefix,
+				ag_rsp_cb rsp_cb, ag_done_cb done_cb,
+				void *user_data, const char *format, ...)
+{
+	struct gateway *gw = dev->gateway;
+	struct ag_cmd *cmd;
+	va_list ap;
+
+	cmd = g_new0(struct ag_cmd, 1);
+
+	va_start(ap, format);
+	cmd->cmd = g_strdup_vprintf(format, ap);
+	va_end(ap);
+
+	cmd->prefix = prefix;
+	cmd->rsp_cb = rsp_cb;
+	cmd->done_cb = done_cb;
+	cmd->user_data = user_data;
+
+	gw->cmd_queue = g_slist_append(gw->cmd_queue, cmd);
+
+	ag_cmd_send_next(dev);
+}
+
+/* Fail the pending and queued commands, when the connection goes away */
+static void ag_cmd_flush(struct audio_device *dev)
+{
+	struct gateway *gw = dev->gateway;
+	GSList *l, *queue = gw->cmd_queue;
+
+	if (gw->cmd_pending)
+		queue = g_slist_prepend(queue, gw->cmd_pending);
+
+	gw->cmd_queue = NULL;
+	gw->cmd_pending = NULL;
+
+	if (gw->cmd_timer) {
+		g_source_remove(gw->cmd_timer);
+		gw->cmd_timer = 0;
+	}
+
+	for (l = queue; l != NULL; l = l->next) {
+		struct ag_cmd *cmd = l->data;
+
+		if (cmd->done_cb)
+			cmd->done_cb(dev, FALSE, cmd->user_data);
+
+		ag_cmd_free(cmd);
+	}
+
+	g_slist_free(queue);
 }
 
 /* get <descr> from the names: (<descr>, (<values>)), (<descr>, (<values>))
@@ -201,6 +307,8 @@ static GSList *parse_indicator_names(gchar *names, GSList *indies)
 	while (current != NULL) {
 		current += 2;
 		next = strstr(current, ",(");
+		if (!next || next - current >= AG_INDICATOR_DESCR_SIZE)
+			break;
 		ind = g_slice_new(struct indicator);
 		strncpy(ind->descr, current, 20);
 		ind->descr[(intptr_t) next - (intptr_t) current] = '\0';
@@ -223,6 +331,8 @@ static GSList *parse_indicator_values(gchar *values, GSList *indies)
 		sscanf(current, "%d", &val);
 		current = strchr(current, ',');
 		ind = g_slist_nth_data(runner, 0);
+		if (!ind)
+			break;
 		ind->value = val;
 		runner = g_slist_next(runner);
 	}
@@ -258,60 +368,152 @@ static guint get_hold_mpty_features(gchar *features)
 	return result;
 }
 
-static gboolean establish_service_level_conn(struct gateway *gw)
+/* Service level connection setup. The commands are queued up front and
+ * answered from rfcomm_ag_data_cb, so the main loop keeps running while
+ * the AG replies */
+static void slc_failed(struct audio_device *dev)
 {
-	gchar buf[RFCOMM_BUF_SIZE];
-	gboolean res;
+	struct gateway *gw = dev->gateway;
+	gchar gw_addr[18];
 
-	debug("at the begin of establish_service_level_conn()");
-	res = rfcomm_send_and_read(gw, AG_FEATURES, buf,
-				sizeof(AG_FEATURES) - 1);
-	if (!res || sscanf(buf, "\r\n+BRSF:%d", &gw->ag_features) != 1)
-		return FALSE;
+	if (gw->connect_message) {
+		error_common_reply(dev->conn, gw->connect_message,
+				ERROR_INTERFACE ".ConnectionAttemptFailed",
+				"Connection attempt failed");
+		dbus_message_unref(gw->connect_message);
+		gw->connect_message = NULL;
+	}
 
-	debug("features are 0x%X", gw->ag_features);
-	res = rfcomm_send_and_read(gw, AG_INDICATORS_SUPP, buf,
-				sizeof(AG_INDICATORS_SUPP) - 1);
-	if (!res || !strstr(buf, "+CIND:"))
-		return FALSE;
+	if (gw->sco_start_cb) {
+		gw->sco_start_cb(NULL, gw->sco_start_cb_data);
+		gw->sco_start_cb = NULL;
+	}
 
-	gw->indies = parse_indicator_names(strchr(buf, '('), NULL);
+	/* Queued commands fail as the connection goes down, only the
+	 * first failure closes it */
+	if (!gw->rfcomm)
+		return;
 
-	res = rfcomm_send_and_read(gw, AG_INDICATORS_VAL, buf,
-		sizeof(AG_INDICATORS_VAL) - 1);
-	if (!res || !strstr(buf, "+CIND:"))
-		return FALSE;
+	ba2str(&dev->dst, gw_addr);
+	error("%s: Failed to establish service layer connection to %s",
+			dev->path, gw_addr);
 
-	gw->indies = parse_indicator_values(strchr(buf, ':') + 1, gw->indies);
+	gateway_close(dev);
+}
 
-	res = rfcomm_send_and_read(gw, AG_INDICATORS_ENABLE, buf,
-				sizeof(AG_INDICATORS_ENABLE) - 1);
-	if (!res || !strstr(buf, "OK"))
-		return FALSE;
+static void slc_established(struct audio_device *dev)
+{
+	struct gateway *gw = dev->gateway;
+	DBusMessage *conn_mes = gw->connect_message;
+	gboolean value = TRUE;
+	gchar gw_addr[18];
 
-	if ((gw->ag_features & AG_FEATURE_3WAY) != 0) {
-		res = rfcomm_send_and_read(gw, AG_HOLD_MPTY_SUPP, buf,
-				sizeof(AG_HOLD_MPTY_SUPP) - 1);
-		if (!res || !strstr(buf, "+CHLD:")) {
-			g_slice_free1(RFCOMM_BUF_SIZE, buf);
-			return FALSE;
-		}
-		gw->hold_multiparty_features = get_hold_mpty_features(
-							strchr(buf, '('));
+	ba2str(&dev->dst, gw_addr);
+	debug("Service layer connection successfully established!");
+	debug("%s: Connected to %s", dev->path, gw_addr);
+
+	ag_cmd_queue(dev, NULL, NULL, NULL, NULL, AG_CALLER_IDENT_ENABLE);
+	ag_cmd_queue(dev, NULL, NULL, NULL, NULL, AG_CARRIER_FORMAT);
+	if ((gw->ag_features & AG_FEATURE_EXTENDED_RES_CODE) != 0)
+		ag_cmd_queue(dev, NULL, NULL, NULL, NULL,
+						AG_EXTENDED_RESULT_CODE);
+
+	if (conn_mes) {
+		DBusMessage *reply = dbus_message_new_method_return(conn_mes);
+		dbus_connection_send(dev->conn, reply, NULL);
+		dbus_message_unref(reply);
+		dbus_message_unref(conn_mes);
+		gw->connect_message = NULL;
+	}
+
+	gw->state = GATEWAY_STATE_CONNECTED;
+	emit_property_changed(dev->conn, dev->path,
+			AUDIO_GATEWAY_INTERFACE,
+			"Connected", DBUS_TYPE_BOOLEAN,	&value);
+}
 
-	} else
+static void brsf_rsp(struct audio_device *dev, struct at_command *rsp,
+							void *user_data)
+{
+	dev->gateway->ag_features = strtoul(rsp->args, NULL, 10);
+
+	debug("features are 0x%X", dev->gateway->ag_features);
+}
+
+static void cind_test_rsp(struct audio_device *dev, struct at_command *rsp,
+							void *user_data)
+{
+	struct gateway *gw = dev->gateway;
+
+	if (rsp->args[0] == '(')
+		gw->indies = parse_indicator_names(rsp->args, gw->indies);
+}
+
+static void cind_read_rsp(struct audio_device *dev, struct at_command *rsp,
+							void *user_data)
+{
+	struct gateway *gw = dev->gateway;
+
+	gw->indies = parse_indicator_values(rsp->args, gw->indies);
+}
+
+static void chld_rsp(struct audio_device *dev, struct at_command *rsp,
+							void *user_data)
+{
+	dev->gateway->hold_multiparty_features =
+					get_hold_mpty_features(rsp->args);
+}
+
+static void slc_cmd_done(struct audio_device *dev, gboolean ok,
+							void *user_data)
+{
+	if (!ok)
+		slc_failed(dev);
+}
+
+static void cind_done(struct audio_device *dev, gboolean ok, void *user_data)
+{
+	if (!ok || dev->gateway->indies == NULL)
+		slc_failed(dev);
+}
+
+static void chld_done(struct audio_device *dev, gboolean ok, void *user_data)
+{
+	if (ok)
+		slc_established(dev);
+	else
+		slc_failed(dev);
+}
+
+static void cmer_done(struct audio_device *dev, gboolean ok, void *user_data)
+{
+	struct gateway *gw = dev->gateway;
+
+	if (!ok) {
+		slc_failed(dev);
+		return;
+	}
+
+	if ((gw->ag_features & AG_FEATURE_3WAY) == 0) {
 		gw->hold_multiparty_features = 0;
+		slc_established(dev);
+		return;
+	}
 
-	debug("Service layer connection successfully established!");
-	rfcomm_send_and_read(gw, AG_CALLER_IDENT_ENABLE, buf,
-			sizeof(AG_CALLER_IDENT_ENABLE) - 1);
-	rfcomm_send_and_read(gw, AG_CARRIER_FORMAT, buf,
-			sizeof(AG_CARRIER_FORMAT) - 1);
-	if ((gw->ag_features & AG_FEATURE_EXTENDED_RES_CODE) != 0)
-		rfcomm_send_and_read(gw, AG_EXTENDED_RESULT_CODE, buf,
-			sizeof(AG_EXTENDED_RESULT_CODE) - 1);
+	ag_cmd_queue(dev, "+CHLD", chld_rsp, chld_done, NULL,
+							AG_HOLD_MPTY_SUPP);
+}
 
-	return TRUE;
+static void establish_service_level_conn(struct audio_device *dev)
+{
+	debug("at the begin of establish_service_level_conn()");
+
+	ag_cmd_queue(dev, "+BRSF", brsf_rsp, slc_cmd_done, NULL, AG_FEATURES);
+	ag_cmd_queue(dev, "+CIND", cind_test_rsp, cind_done, NULL,
+							AG_INDICATORS_SUPP);
+	ag_cmd_queue(dev, "+CIND", cind_read_rsp, cind_done, NULL,
+							AG_INDICATORS_VAL);
+	ag_cmd_queue(dev, NULL, NULL, cmer_done, NULL, AG_INDICATORS_ENABLE);
 }
 
 static void process_ind_change(struct audio_device *dev, guint index,
@@ -384,107 +586,177 @@ static void process_ind_change(struct audio_device *dev, guint index,
 				DBUS_TYPE_UINT16, &value);
 }
 
-static void process_ring(struct audio_device *device, GIOChannel *chan,
-			gchar *buf)
+static void process_ciev(struct audio_device *device, struct at_command *cmd)
 {
-	gchar number[AG_CALLER_NUM_SIZE];
-	gchar *cli;
-	gchar *sep;
-	gsize read;
-	GIOStatus status;
+	char *sep;
 
-	rfcomm_stop_watch(device);
-	status = g_io_channel_read_chars(chan, buf, RFCOMM_BUF_SIZE - 1, &read, NULL);
-	if (status != G_IO_STATUS_NORMAL)
+	sep = strchr(cmd->args, ',');
+	if (!sep) {
+		error("Invalid indicator event '%s'", cmd->line);
 		return;
+	}
 
-	debug("at the begin of process_ring");
-	if (strlen(buf) > AG_CALLER_NUM_SIZE + 10)
-		error("process_ring(): buf is too long '%s'", buf);
-	else if ((cli = strstr(buf, "\r\n+CLIP"))) {
-		if (sscanf(cli, "\r\n+CLIP: \"%s", number) == 1) {
-			sep = strchr(number, '"');
-			sep[0] = '\0';
-
-			/* FIXME:signal will be emitted on each RING+CLIP.
-			 * That's bad */
-			cli = number;
-			g_dbus_emit_signal(device->conn, device->path,
-					AUDIO_GATEWAY_INTERFACE, "Ring",
-					DBUS_TYPE_STRING, &cli,
-					DBUS_TYPE_INVALID);
-			device->gateway->is_dialing = TRUE;
-		} else
-			error("process_ring(): '%s' in place of +CLIP after RING", buf);
+	process_ind_change(device, atoi(cmd->args), atoi(sep + 1));
+}
+
+static void process_ring(struct audio_device *device, struct at_command *cmd)
+{
+	debug("RING from AG");
+}
+
+/* +CLIP follows each RING once caller identification is enabled */
+static void process_clip(struct audio_device *device, struct at_command *cmd)
+{
+	char *number, *sep;
+
+	if (cmd->args[0] != '"' || !(sep = strchr(cmd->args + 1, '"'))) {
+		error("Invalid caller identification '%s'", cmd->line);
+		return;
+	}
+
+	*sep = '\0';
+	number = cmd->args + 1;
+
+	/* FIXME:signal will be emitted on each RING+CLIP.
+	 * That's bad */
+	g_dbus_emit_signal(device->conn, device->path,
+			AUDIO_GATEWAY_INTERFACE, "Ring",
+			DBUS_TYPE_STRING, &number,
+			DBUS_TYPE_INVALID);
+	device->gateway->is_dialing = TRUE;
+}
+
+static void process_bvra(struct audio_device *device, struct at_command *cmd)
+{
+	if (atoi(cmd->args) == 0)
+		g_dbus_emit_signal(device->conn, device->path,
+				AUDIO_GATEWAY_INTERFACE,
+				"VoiceRecognitionActive",
+				DBUS_TYPE_INVALID);
+	else
+		g_dbus_emit_signal(device->conn, device->path,
+				AUDIO_GATEWAY_INTERFACE,
+				"VoiceRecognitionInactive",
+				DBUS_TYPE_INVALID);
+}
 
+static void process_gain(struct audio_device *device, struct at_command *cmd)
+{
+	struct gateway *gw = device->gateway;
+	int value = atoi(cmd->args);
+
+	/* +VGS or +VGM */
+	if (cmd->name[3] == 'S') {
+		gw->sp_gain = value;
+		emit_property_changed(device->conn, device->path,
+				AUDIO_GATEWAY_INTERFACE, "SpeakerGain",
+				DBUS_TYPE_UINT16, &value);
+	} else {
+		gw->mic_gain = value;
+		emit_property_changed(device->conn, device->path,
+				AUDIO_GATEWAY_INTERFACE, "MicrophoneGain",
+				DBUS_TYPE_UINT16, &value);
+	}
+}
+
+static void process_ok(struct audio_device *device, struct at_command *cmd)
+{
+	if (device->gateway->cmd_pending)
+		ag_cmd_complete(device, TRUE);
+}
+
+static void process_error(struct audio_device *device, struct at_command *cmd)
+{
+	if (device->gateway->cmd_pending)
+		ag_cmd_complete(device, FALSE);
+}
+
+static struct result result_callbacks[] = {
+	{ "OK", process_ok },
+	{ "ERROR", process_error },
+	{ "+CME ERROR", process_error },
+	{ "NO CARRIER", process_error },
+	{ "BUSY", process_error },
+	{ "NO ANSWER", process_error },
+	{ "+CIEV", process_ciev },
+	{ "RING", process_ring },
+	{ "+CLIP", process_clip },
+	{ "+BVRA", process_bvra },
+	{ "+VGS", process_gain },
+	{ "+VGM", process_gain },
+	{ 0 }
+};
+
+static struct at_table *result_table = NULL;
+
+static void handle_result(struct audio_device *device, struct at_command *cmd)
+{
+	struct ag_cmd *pending = device->gateway->cmd_pending;
+	struct result *res;
+
+	debug("Received %s", cmd->line);
+
+	if (pending && pending->prefix && cmd->type == AT_RESULT &&
+			cmd->name_len == strlen(pending->prefix) &&
+			!memcmp(cmd->name, pending->prefix, cmd->name_len)) {
+		pending->rsp_cb(device, cmd, pending->user_data);
+		return;
+	}
+
+	if (!result_table) {
+		result_table = at_table_new();
+		for (res = result_callbacks; res->name; res++)
+			at_table_add(result_table, res->name, res);
+	}
+
+	res = cmd->type == AT_RESULT ?
+				at_table_lookup(result_table, cmd) : NULL;
+	if (!res) {
+		error("rfcomm_ag_data_cb(): read wrong data '%s'", cmd->line);
+		return;
 	}
 
-	rfcomm_start_watch(device);
+	res->callback(device, cmd);
 }
 
 static gboolean rfcomm_ag_data_cb(GIOChannel *chan, GIOCondition cond,
 					struct audio_device *device)
 {
-	gchar buf[RFCOMM_BUF_SIZE];
 	struct gateway *gw;
-	gsize read;
-	/* some space for value */
-	gchar indicator[AG_INDICATOR_DESCR_SIZE + 4];
-	gint value;
-	guint index;
-	gchar *sep;
+	struct at_command cmd;
+	gsize read, size;
+	gchar *buf;
 
 	debug("at the begin of rfcomm_ag_data_cb()");
-	if (cond & G_IO_NVAL)
-		return FALSE;
-
 	gw = device->gateway;
 
+	if (cond & G_IO_NVAL) {
+		gw->rfcomm_watch_id = 0;
+		return FALSE;
+	}
+
 	if (cond & (G_IO_ERR | G_IO_HUP)) {
 		debug("connection with remote BT is closed");
+		gw->rfcomm_watch_id = 0;
 		gateway_close(device);
 		return FALSE;
 	}
 
-	if (g_io_channel_read_chars(chan, buf, sizeof(buf) - 1, &read, NULL)
+	buf = at_parser_space(&gw->parser, &size);
+	if (size == 0) {
+		error("rfcomm_ag_data_cb(): line too long, dropping it");
+		at_parser_reset(&gw->parser);
+		buf = at_parser_space(&gw->parser, &size);
+	}
+
+	if (g_io_channel_read_chars(chan, buf, size, &read, NULL)
 			!= G_IO_STATUS_NORMAL)
 		return TRUE;
-	buf[read] = '\0';
-
-	if (strlen(buf) > AG_INDICATOR_DESCR_SIZE + 14)
-		error("rfcomm_ag_data_cb(): buf is too long '%s'", buf);
-	else if (sscanf(buf, "\r\n+CIEV:%s\r\n", indicator) == 1) {
-		sep = strchr(indicator, ',');
-		sep[0] = '\0';
-		sep += 1;
-		index = atoi(indicator);
-		value = atoi(sep);
-		process_ind_change(device, index, value);
-	} else if (strstr(buf, "RING"))
-		process_ring(device, chan, buf);
-	else if (sscanf(buf, "\r\n+BVRA:%d\r\n", &value) == 1) {
-		if (value == 0)
-			g_dbus_emit_signal(device->conn, device->path,
-					AUDIO_GATEWAY_INTERFACE,
-					"VoiceRecognitionActive",
-					DBUS_TYPE_INVALID);
-		else
-			g_dbus_emit_signal(device->conn, device->path,
-					AUDIO_GATEWAY_INTERFACE,
-					"VoiceRecognitionInactive",
-					DBUS_TYPE_INVALID);
-	} else if (sscanf(buf, "\r\n+VGS:%d\r\n", &value) == 1) {
-		gw->sp_gain = value;
-		emit_property_changed(device->conn, device->path,
-				AUDIO_GATEWAY_INTERFACE, "SpeakerGain",
-				DBUS_TYPE_UINT16, &value);
-	} else if (sscanf(buf, "\r\n+VGM:%d\r\n", &value) == 1) {
-		gw->mic_gain = value;
-		emit_property_changed(device->conn, device->path,
-				AUDIO_GATEWAY_INTERFACE, "MicrophoneGain",
-				DBUS_TYPE_UINT16, &value);
-	} else
-		error("rfcomm_ag_data_cb(): read wrong data '%s'", buf);
+
+	at_parser_commit(&gw->parser, read);
+
+	while (at_parser_next(&gw->parser, &cmd))
+		handle_result(device, &cmd);
 
 	return TRUE;
 }
@@ -541,8 +813,6 @@ static void rfcomm_connect_cb(GIOChannel *chan, GError *err,
 {
 	struct audio_device *dev = user_data;
 	struct gateway *gw = dev->gateway;
-	DBusMessage *conn_mes = gw->connect_message;
-	gchar gw_addr[18];
 	GIOFlags flags;
 
 	if (err) {
@@ -552,7 +822,6 @@ static void rfcomm_connect_cb(GIOChannel *chan, GError *err,
 		return;
 	}
 
-	ba2str(&dev->dst, gw_addr);
 	/* Blocking mode should be default, but just in case: */
 	flags = g_io_channel_get_flags(chan);
 	flags &= ~G_IO_FLAG_NONBLOCK;
@@ -563,33 +832,10 @@ static void rfcomm_connect_cb(GIOChannel *chan, GError *err,
 	if (!gw->rfcomm)
 		gw->rfcomm = g_io_channel_ref(chan);
 
-	if (establish_service_level_conn(dev->gateway)) {
-		gboolean value = TRUE;
-
-		debug("%s: Connected to %s", dev->path, gw_addr);
-		rfcomm_start_watch(dev);
-		if (conn_mes) {
-			DBusMessage *reply =
-				dbus_message_new_method_return(conn_mes);
-			dbus_connection_send(dev->conn, reply, NULL);
-			dbus_message_unref(reply);
-			dbus_message_unref(conn_mes);
-			gw->connect_message = NULL;
-		}
-
-		gw->state = GATEWAY_STATE_CONNECTED;
-		emit_property_changed(dev->conn, dev->path,
-				AUDIO_GATEWAY_INTERFACE,
-				"Connected", DBUS_TYPE_BOOLEAN,	&value);
-		return;
-	} else
-		error("%s: Failed to establish service layer connection to %s",
-			dev->path, gw_addr);
-
-	if (NULL != gw->sco_start_cb)
-		gw->sco_start_cb(NULL, gw->sco_start_cb_data);
+	at_parser_reset(&gw->parser);
+	rfcomm_start_watch(dev);
 
-	gateway_close(dev);
+	establish_service_level_conn(dev);
 }
 
 static void get_record_cb(sdp_list_t *recs, int perr, gpointer user_data)
@@ -730,36 +976,86 @@ static DBusMessage *ag_disconnect(DBusConnection *conn, DBusMessage *msg,
 	return reply;
 }
 
-static DBusMessage *process_ag_reponse(DBusMessage *msg, gchar *response)
+/* Pending D-Bus method call answered once the AG replies */
+struct ag_request {
+	DBusMessage *msg;
+	gchar *result;
+	const gchar *next;	/* DTMF digits still to be sent */
+};
+
+static struct ag_request *ag_request_new(DBusMessage *msg)
 {
+	struct ag_request *req = g_new0(struct ag_request, 1);
+
+	req->msg = dbus_message_ref(msg);
+
+	return req;
+}
+
+static void ag_request_free(struct ag_request *req)
+{
+	dbus_message_unref(req->msg);
+	g_free(req->result);
+	g_free(req);
+}
+
+static DBusMessage *ag_request_error(DBusMessage *msg)
+{
+	/* FIXME: some code should be here to processes errors
+	 *  in better fasion */
+	debug("AG failed the %s method call", dbus_message_get_member(msg));
+
+	return dbus_message_new_error(msg, ERROR_INTERFACE
+				".OperationFailed",
+				"Operation failed.See log for details");
+}
+
+static void simple_done(struct audio_device *dev, gboolean ok,
+							void *user_data)
+{
+	struct ag_request *req = user_data;
 	DBusMessage *reply;
 
+	if (ok)
+		reply = dbus_message_new_method_return(req->msg);
+	else
+		reply = ag_request_error(req->msg);
+
+	g_dbus_send_message(dev->conn, reply);
+	ag_request_free(req);
+}
+
+/* Reply with the string an intermediate result code left in req->result */
+static void string_done(struct audio_device *dev, gboolean ok,
+							void *user_data)
+{
+	struct ag_request *req = user_data;
+	DBusMessage *reply;
 
-	debug("in process_ag_reponse, response is %s", response);
-	if (strstr(response, OK_RESPONSE))
-		reply = dbus_message_new_method_return(msg);
-	else {
-		/* FIXME: some code should be here to processes errors
-		 *  in better fasion */
-		debug("AG responded with '%s' to %s method call", response,
-				dbus_message_get_member(msg));
-		reply = dbus_message_new_error(msg, ERROR_INTERFACE
-					".OperationFailed",
-					"Operation failed.See log for details");
+	if (!ok)
+		reply = ag_request_error(req->msg);
+	else if (!req->result) {
+		info("%s: no result received from AG",
+					dbus_message_get_member(req->msg));
+		reply = dbus_message_new_error(req->msg, ERROR_INTERFACE
+					".Failed",
+					"Unexpected response from AG");
+	} else {
+		reply = dbus_message_new_method_return(req->msg);
+		dbus_message_append_args(reply, DBUS_TYPE_STRING,
+					&req->result, DBUS_TYPE_INVALID);
 	}
-	return reply;
+
+	g_dbus_send_message(dev->conn, reply);
+	ag_request_free(req);
 }
 
 static DBusMessage *process_simple(DBusMessage *msg, struct audio_device *dev,
 					gchar *data)
 {
-	struct gateway *gw = dev->gateway;
-	gchar buf[RFCOMM_BUF_SIZE];
+	ag_cmd_queue(dev, NULL, NULL, simple_done, ag_request_new(msg), data);
 
-	rfcomm_stop_watch(dev);
-	rfcomm_send_and_read(gw, data, buf, strlen(data));
-	rfcomm_start_watch(dev);
-	return process_ag_reponse(msg, buf);
+	return NULL;
 }
 
 #define AG_ANSWER "ATA\r"
@@ -810,10 +1106,7 @@ static DBusMessage *ag_call(DBusConnection *conn, DBusMessage *msg,
 {
 	struct audio_device *device = data;
 	struct gateway *gw = device->gateway;
-	gchar buf[RFCOMM_BUF_SIZE];
 	gchar *number;
-	gint atd_len;
-	DBusMessage *result;
 
 	debug("at the begin of ag_call()");
 	if (!gw->rfcomm)
@@ -828,83 +1121,76 @@ static DBusMessage *ag_call(DBusConnection *conn, DBusMessage *msg,
 			ERROR_INTERFACE ".BadNumber",
 			"Number contains characters which are not allowed");
 
-	atd_len = sprintf(buf, AG_PLACE_CALL, number);
-	rfcomm_stop_watch(device);
-	rfcomm_send_and_read(gw, buf, buf, atd_len);
-	rfcomm_start_watch(device);
+	ag_cmd_queue(device, NULL, NULL, simple_done, ag_request_new(msg),
+							AG_PLACE_CALL, number);
 
-	result = process_ag_reponse(msg, buf);
-	return result;
+	return NULL;
 }
 
 #define AG_GET_CARRIER "AT+COPS?\r"
 
+static void cops_rsp(struct audio_device *dev, struct at_command *rsp,
+							void *user_data)
+{
+	struct ag_request *req = user_data;
+	gchar *result, *sep;
+
+	g_free(req->result);
+
+	/* +COPS: <mode>[,<format>,"<operator>"] */
+	if (!strchr(rsp->args, ',') || !(result = strchr(rsp->args, '"'))) {
+		req->result = g_strdup("0");
+		return;
+	}
+
+	result++;
+	sep = strchr(result, '"');
+	if (sep)
+		*sep = '\0';
+
+	req->result = g_strdup(result);
+}
+
 static DBusMessage *ag_get_operator(DBusConnection *conn, DBusMessage *msg,
 					void *data)
 {
 	struct audio_device *dev = (struct audio_device *) data;
 	struct gateway *gw = dev->gateway;
-	gchar buf[RFCOMM_BUF_SIZE];
-	GIOChannel *rfcomm = gw->rfcomm;
-	gsize read;
-	gchar *result, *sep;
-	DBusMessage *reply;
-	GIOStatus status;
 
 	if (!gw->rfcomm)
 		return g_dbus_create_error(msg, ERROR_INTERFACE
 					".NotConnected",
 					"Not Connected");
 
-	rfcomm_stop_watch(dev);
-	io_channel_write_all(rfcomm, AG_GET_CARRIER, strlen(AG_GET_CARRIER));
+	ag_cmd_queue(dev, "+COPS", cops_rsp, string_done, ag_request_new(msg),
+							AG_GET_CARRIER);
 
-	status = g_io_channel_read_chars(rfcomm, buf, RFCOMM_BUF_SIZE - 1,
-						&read, NULL);
-	rfcomm_start_watch(dev);
-	if (G_IO_STATUS_NORMAL == status) {
-		buf[read] = '\0';
-		if (strstr(buf, "+COPS")) {
-			if (!strrchr(buf, ','))
-				result = "0";
-			else {
-				result = strchr(buf, '\"') + 1;
-				sep = strchr(result, '\"');
-				sep[0] = '\0';
-			}
+	return NULL;
+}
 
-			reply = dbus_message_new_method_return(msg);
-			dbus_message_append_args(reply, DBUS_TYPE_STRING,
-						&result, DBUS_TYPE_INVALID);
-		} else {
-			info("ag_get_operator(): '+COPS' expected but"
-				" '%s' received", buf);
-			reply = dbus_message_new_error(msg, ERROR_INTERFACE
-						".Failed",
-						"Unexpected response from AG");
-		}
-	} else {
-		error("ag_get_operator(): %m");
-		reply = dbus_message_new_error(msg, ERROR_INTERFACE
-					".ConnectionFailed",
-					"Failed to receive response from AG");
+#define AG_SEND_DTMF "AT+VTS=%c\r"
+
+/* Digits go out one at a time, stopping at the first one that fails */
+static void dtmf_done(struct audio_device *dev, gboolean ok, void *user_data)
+{
+	struct ag_request *req = user_data;
+
+	if (ok && *req->next != '\0' && dev->gateway->rfcomm) {
+		ag_cmd_queue(dev, NULL, NULL, dtmf_done, req, AG_SEND_DTMF,
+							*req->next++);
+		return;
 	}
 
-	return reply;
+	simple_done(dev, ok, req);
 }
 
-#define AG_SEND_DTMF "AT+VTS=%c\r"
 static DBusMessage *ag_send_dtmf(DBusConnection *conn, DBusMessage *msg,
 				void *data)
 {
 	struct audio_device *device = data;
 	struct gateway *gw = device->gateway;
-	gchar buf[RFCOMM_BUF_SIZE];
+	struct ag_request *req;
 	gchar *number;
-	gint com_len;
-	gboolean got_ok = TRUE;
-	gint num_len;
-	gint i = 0;
 
 	if (!gw->rfcomm)
 		return g_dbus_create_error(msg, ERROR_INTERFACE
@@ -918,55 +1204,59 @@ static DBusMessage *ag_send_dtmf(DBusConnection *conn, DBusMessage *msg,
 			ERROR_INTERFACE ".BadNumber",
 			"Number contains characters which are not allowed");
 
-	num_len = strlen(number);
-	rfcomm_stop_watch(device);
-	while (i < num_len && got_ok) {
-		com_len = sprintf(buf, AG_SEND_DTMF, number[i]);
-		rfcomm_send_and_read(gw, buf, buf, com_len);
-		got_ok = NULL != strstr(buf, OK_RESPONSE);
-		i += 1;
-	}
-	rfcomm_start_watch(device);
-	return process_ag_reponse(msg, buf);
+	if (*number == '\0')
+		return dbus_message_new_method_return(msg);
+
+	req = ag_request_new(msg);
+	req->next = number + 1;
+
+	/* number points into req->msg, which stays referenced */
+	ag_cmd_queue(device, NULL, NULL, dtmf_done, req, AG_SEND_DTMF,
+								number[0]);
+
+	return NULL;
 }
 
 #define AG_GET_SUBSCRIBER_NUMS "AT+CNUM\r"
-#define CNUM_LEN 5             /* length of "+CNUM" string */
-#define MAX_NUMBER_CNT 16
+
+static void cnum_rsp(struct audio_device *dev, struct at_command *rsp,
+							void *user_data)
+{
+	struct ag_request *req = user_data;
+	gchar *number, *end;
+
+	/* +CNUM: [<alpha>],<number>,<type>[,<speed>,<service>] */
+	number = strchr(rsp->args, ',');
+	if (!number || req->result)
+		return;
+
+	number++;
+	end = strchr(number, ',');
+	if (!end) {
+		error("ag_get_subscriber_num(): read wrong data '%s'",
+								rsp->line);
+		return;
+	}
+
+	*end = '\0';
+	req->result = g_strdup(number);
+}
+
 static DBusMessage *ag_get_subscriber_num(DBusConnection *conn,
 					DBusMessage *msg, void *data)
 {
 	struct audio_device *device = data;
 	struct gateway *gw = device->gateway;
-	gchar buf[RFCOMM_BUF_SIZE];
-	gchar *number, *end;
-	DBusMessage *reply = dbus_message_new_method_return(msg);
 
 	if (!gw->rfcomm)
 		return g_dbus_create_error(msg, ERROR_INTERFACE
 					".NotConnected",
 					"Not Connected");
 
-	rfcomm_stop_watch(device);
-	rfcomm_send_and_read(gw, AG_GET_SUBSCRIBER_NUMS, buf,
-			strlen(AG_GET_SUBSCRIBER_NUMS));
-	rfcomm_start_watch(device);
-
-	if (strlen(buf) > AG_CALLER_NUM_SIZE + 21)
-		error("ag_get_subscriber_num(): buf is too long '%s'", buf);
-	else if (strstr(buf, "+CNUM")) {
-		number = strchr(buf, ',');
-		number++;
-		end = strchr(number, ',');
-		if (end) {
-			*end = '\0';
-			dbus_message_append_args(reply, DBUS_TYPE_STRING,
-						&number, DBUS_TYPE_INVALID);
-		}
-	} else
-		error("ag_get_subscriber_num(): read wrong data '%s'", buf);
+	ag_cmd_queue(device, "+CNUM", cnum_rsp, string_done,
+				ag_request_new(msg), AG_GET_SUBSCRIBER_NUMS);
 
-	return reply;
+	return NULL;
 }
 
 static DBusMessage *ag_get_properties(DBusConnection *conn, DBusMessage *msg,
@@ -1030,12 +1320,18 @@ done:
 static GDBusMethodTable gateway_methods[] = {
 	{ "Connect", "", "", ag_connect, G_DBUS_METHOD_FLAG_ASYNC },
 	{ "Disconnect", "", "", ag_disconnect },
-	{ "AnswerCall", "", "", ag_answer },
-	{ "TerminateCall", "", "", ag_terminate_call },
-	{ "Call", "s", "", ag_call },
-	{ "GetOperatorName", "", "s", ag_get_operator },
-	{ "SendDTMF", "s", "", ag_send_dtmf },
-	{ "GetSubscriberNumber", "", "s", ag_get_subscriber_num },
+	{ "AnswerCall", "", "", ag_answer,
+						G_DBUS_METHOD_FLAG_ASYNC },
+	{ "TerminateCall", "", "", ag_terminate_call,
+						G_DBUS_METHOD_FLAG_ASYNC },
+	{ "Call", "s", "", ag_call,
+						G_DBUS_METHOD_FLAG_ASYNC },
+	{ "GetOperatorName", "", "s", ag_get_operator,
+						G_DBUS_METHOD_FLAG_ASYNC },
+	{ "SendDTMF", "s", "", ag_send_dtmf,
+						G_DBUS_METHOD_FLAG_ASYNC },
+	{ "GetSubscriberNumber", "", "s", ag_get_subscriber_num,
+						G_DBUS_METHOD_FLAG_ASYNC },
 	{ "GetProperties", "", "a{sv}", ag_get_properties },
 	{ NULL, NULL, NULL, NULL }
 };
@@ -1119,12 +1415,24 @@ int gateway_close(struct audio_device *device)
 
 	g_slist_foreach(gw->indies, (GFunc) indicator_slice_free, NULL);
 	g_slist_free(gw->indies);
+	gw->indies = NULL;
+
+	if (gw->rfcomm_watch_id) {
+		g_source_remove(gw->rfcomm_watch_id);
+		gw->rfcomm_watch_id = 0;
+	}
+
 	if (rfcomm) {
 		g_io_channel_shutdown(rfcomm, TRUE, NULL);
 		g_io_channel_unref(rfcomm);
 		gw->rfcomm = NULL;
 	}
 
+	/* Replies to the pending method calls, data still buffered from
+	 * the closed link must not be parsed */
+	at_parser_reset(&gw->parser);
+	ag_cmd_flush(device);
+
 	if (sco) {
 		g_io_channel_shutdown(sco, TRUE, NULL);
 		g_io_channel_unref(sco);
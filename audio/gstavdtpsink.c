@@ -39,7 +39,9 @@
 
 #include "ipc.h"
 #include "rtp.h"
+#include "pacing.h"
 
+#include "gstsbcutil.h"
 #include "gstavdtpsink.h"
 
 GST_DEBUG_CATEGORY_STATIC(avdtp_sink_debug);
@@ -52,6 +54,9 @@ GST_DEBUG_CATEGORY_STATIC(avdtp_sink_debug);
 
 #define DEFAULT_AUTOCONNECT TRUE
 
+/* Number of packets we aim to keep queued in the stream socket */
+#define PACKET_QUEUE_TARGET 2
+
 #define GST_AVDTP_SINK_MUTEX_LOCK(s) G_STMT_START {	\
 		g_mutex_lock(s->sink_lock);		\
 	} G_STMT_END
@@ -66,6 +71,13 @@ struct bluetooth_data {
 	guint link_mtu;
 
 	gchar buffer[BUFFER_SIZE];	/* Codec transfer buffer */
+
+	gboolean adaptive;		/* SBC stream with a bitpool range */
+	struct a2dp_bitpool bitpool;	/* Adapts bitpool to the link */
+	gint sndbuf;			/* Stream socket send buffer size */
+	gint queued;			/* Smoothed send queue level */
+	gint interval;			/* Smoothed time between packets in us */
+	GTimeVal last;			/* Time the last packet was written */
 };
 
 #define IS_SBC(n) (strcmp((n), "audio/x-sbc") == 0)
@@ -350,8 +362,11 @@ static gboolean gst_avdtp_sink_init_sbc_pkt_conf(GstAvdtpSink *sink,
 		return FALSE;
 	}
 
+	/* Keep the device minimum so the bitpool may drop below the one
+	 * negotiated upstream when the link gets congested */
 	value = gst_structure_get_value(structure, "bitpool");
-	cfg->max_bitpool = cfg->min_bitpool = g_value_get_int(value);
+	cfg->max_bitpool = g_value_get_int(value);
+	cfg->min_bitpool = MIN(MAX(cfg->min_bitpool, 2), cfg->max_bitpool);
 
 	memcpy(pkt, cfg, sizeof(*pkt));
 
@@ -908,6 +923,88 @@ failed:
 	return FALSE;
 }
 
+static void gst_avdtp_sink_bitpool_init(GstAvdtpSink *self)
+{
+	struct bluetooth_data *data = self->data;
+	sbc_capabilities_t *sbc;
+	GstStructure *structure;
+	socklen_t len = sizeof(data->sndbuf);
+	gint sk;
+
+	data->adaptive = FALSE;
+
+	if (self->stream_caps == NULL)
+		return;
+
+	structure = gst_caps_get_structure(self->stream_caps, 0);
+	if (!gst_structure_has_name(structure, "audio/x-sbc"))
+		return;
+
+	sbc = (void *) gst_avdtp_find_caps(self, BT_A2DP_SBC_SINK);
+	if (sbc == NULL || sbc->min_bitpool >= sbc->max_bitpool)
+		return;
+
+	sk = g_io_channel_unix_get_fd(self->stream);
+	if (getsockopt(sk, SOL_SOCKET, SO_SNDBUF, &data->sndbuf, &len) < 0)
+		return;
+
+	/* the send latency limit follows the packet interval, see
+	 * gst_avdtp_sink_bitpool_update() */
+	a2dp_bitpool_init(&data->bitpool, sbc->min_bitpool, sbc->max_bitpool,
+				data->link_mtu * PACKET_QUEUE_TARGET, G_MAXINT);
+
+	data->queued = 0;
+	data->interval = 0;
+	data->last.tv_sec = 0;
+	data->last.tv_usec = 0;
+	data->adaptive = TRUE;
+
+	GST_DEBUG_OBJECT(self, "adaptive bitpool %d-%d", sbc->min_bitpool,
+							sbc->max_bitpool);
+}
+
+static glong timeval_diff(GTimeVal *a, GTimeVal *b)
+{
+	return (a->tv_sec - b->tv_sec) * G_USEC_PER_SEC +
+						(a->tv_usec - b->tv_usec);
+}
+
+static void gst_avdtp_sink_bitpool_update(GstAvdtpSink *self,
+					GTimeVal *start, GTimeVal *end)
+{
+	struct bluetooth_data *data = self->data;
+	GstStructure *structure;
+	GstEvent *event;
+	gint level;
+
+	if (data->last.tv_sec != 0) {
+		glong interval = timeval_diff(start, &data->last);
+
+		data->interval = (data->interval * 7 + interval) / 8;
+		data->bitpool.max_latency = data->interval / 2;
+	}
+	data->last = *start;
+
+	level = a2dp_queue_level(g_io_channel_unix_get_fd(self->stream),
+							data->sndbuf);
+	data->queued = (data->queued * 7 + level) / 8;
+
+	if (!a2dp_bitpool_update(&data->bitpool, data->queued,
+						timeval_diff(end, start)))
+		return;
+
+	GST_DEBUG_OBJECT(self, "requesting bitpool %d (queued %d, "
+				"latency %d us)", data->bitpool.bitpool,
+				data->queued, data->bitpool.latency);
+
+	/* the encoder is upstream, possibly behind a payloader */
+	structure = gst_structure_new(GST_SBC_BITPOOL_EVENT,
+				"bitpool", G_TYPE_INT, data->bitpool.bitpool,
+				NULL);
+	event = gst_event_new_custom(GST_EVENT_CUSTOM_UPSTREAM, structure);
+	gst_pad_push_event(GST_BASE_SINK_PAD(self), event);
+}
+
 static gboolean gst_avdtp_sink_stream_start(GstAvdtpSink *self)
 {
 	gchar buf[BT_SUGGESTED_BUFFER_SIZE];
@@ -949,6 +1046,8 @@ static gboolean gst_avdtp_sink_stream_start(GstAvdtpSink *self)
 	if (!gst_avdtp_sink_conf_recv_stream_fd(self))
 		return FALSE;
 
+	gst_avdtp_sink_bitpool_init(self);
+
 	return TRUE;
 }
 
@@ -1147,9 +1246,12 @@ static GstFlowReturn gst_avdtp_sink_render(GstBaseSink *basesink,
 					GstBuffer *buffer)
 {
 	GstAvdtpSink *self = GST_AVDTP_SINK(basesink);
+	GTimeVal start, end;
 	gsize ret;
 	GIOError err;
 
+	g_get_current_time(&start);
+
 	err = g_io_channel_write(self->stream,
 				(gchar *) GST_BUFFER_DATA(buffer),
 				(gsize) (GST_BUFFER_SIZE(buffer)), &ret);
@@ -1160,6 +1262,11 @@ static GstFlowReturn gst_avdtp_sink_render(GstBaseSink *basesink,
 		return GST_FLOW_ERROR;
 	}
 
+	if (self->data->adaptive) {
+		g_get_current_time(&end);
+		gst_avdtp_sink_bitpool_update(self, &start, &end);
+	}
+
 	return GST_FLOW_OK;
 }
 
@@ -26,6 +26,7 @@
 #endif
 
 #include "gstrtpsbcpay.h"
+#include "gstsbcutil.h"
 #include <math.h>
 #include <string.h>
 
@@ -152,6 +153,10 @@ static gboolean gst_rtp_sbc_pay_set_caps(GstBaseRTPPayload *payload,
 				bitpool, channel_mode);
 
 	sbcpay->frame_length = frame_len;
+	sbcpay->subbands = subbands;
+	sbcpay->channels = channels;
+	sbcpay->blocks = blocks;
+	sbcpay->channel_mode = g_intern_string(channel_mode);
 
 	gst_basertppayload_set_options(payload, "audio", TRUE, "SBC", rate);
 
@@ -231,15 +236,46 @@ static GstFlowReturn gst_rtp_sbc_pay_handle_buffer(GstBaseRTPPayload *payload,
 	return GST_FLOW_OK;
 }
 
+static void gst_rtp_sbc_pay_set_bitpool(GstRtpSBCPay *sbcpay,
+			const GstStructure *structure)
+{
+	gint bitpool;
+
+	if (!gst_structure_get_int(structure, "bitpool", &bitpool))
+		return;
+
+	if (sbcpay->frame_length == 0 || sbcpay->channel_mode == NULL)
+		return;
+
+	/* frames already queued still have the old length */
+	while (gst_adapter_available(sbcpay->adapter) >= sbcpay->frame_length)
+		if (gst_rtp_sbc_pay_flush_buffers(sbcpay) != GST_FLOW_OK)
+			break;
+
+	sbcpay->frame_length = gst_rtp_sbc_pay_get_frame_len(sbcpay->subbands,
+				sbcpay->channels, sbcpay->blocks, bitpool,
+				sbcpay->channel_mode);
+
+	GST_DEBUG_OBJECT(sbcpay, "bitpool %d, frame length: %d", bitpool,
+						sbcpay->frame_length);
+}
+
 static gboolean gst_rtp_sbc_pay_handle_event(GstPad *pad,
 				GstEvent *event)
 {
 	GstRtpSBCPay *sbcpay = GST_RTP_SBC_PAY(GST_PAD_PARENT(pad));
+	const GstStructure *structure;
 
 	switch (GST_EVENT_TYPE(event)) {
 	case GST_EVENT_EOS:
 		gst_rtp_sbc_pay_flush_buffers(sbcpay);
 		break;
+	case GST_EVENT_CUSTOM_DOWNSTREAM:
+		structure = gst_event_get_structure(event);
+		if (structure && gst_structure_has_name(structure,
+							GST_SBC_BITPOOL_EVENT))
+			gst_rtp_sbc_pay_set_bitpool(sbcpay, structure);
+		break;
 	default:
 		break;
 	}
@@ -52,6 +52,12 @@ struct _GstRtpSBCPay {
 
 	guint frame_length;
 
+	/* kept to recompute frame_length on bitpool changes */
+	gint subbands;
+	gint channels;
+	gint blocks;
+	const gchar *channel_mode;
+
 	guint min_frames;
 };
 
@@ -362,6 +362,62 @@ fail:
 	return FALSE;
 }
 
+static gboolean sbc_enc_src_event(GstPad *pad, GstEvent *event)
+{
+	GstSbcEnc *enc = GST_SBC_ENC(gst_pad_get_parent(pad));
+	const GstStructure *structure;
+	gint bitpool;
+	gboolean res;
+
+	structure = gst_event_get_structure(event);
+
+	if (GST_EVENT_TYPE(event) != GST_EVENT_CUSTOM_UPSTREAM ||
+			structure == NULL || !gst_structure_has_name(structure,
+							GST_SBC_BITPOOL_EVENT)) {
+		res = gst_pad_event_default(pad, event);
+		goto done;
+	}
+
+	/* a bitpool set through the property always wins, otherwise the
+	 * change is applied on the next frame boundary in the chain */
+	if (enc->bitpool == SBC_ENC_BITPOOL_AUTO &&
+			gst_structure_get_int(structure, "bitpool", &bitpool) &&
+			bitpool >= SBC_ENC_BITPOOL_MIN &&
+			bitpool <= SBC_ENC_BITPOOL_MAX)
+		enc->pending_bitpool = bitpool;
+
+	gst_event_unref(event);
+	res = TRUE;
+
+done:
+	gst_object_unref(enc);
+
+	return res;
+}
+
+static void sbc_enc_update_bitpool(GstSbcEnc *enc)
+{
+	GstStructure *structure;
+	gint bitpool = enc->pending_bitpool;
+
+	enc->pending_bitpool = 0;
+
+	if (bitpool == enc->sbc.bitpool)
+		return;
+
+	GST_DEBUG_OBJECT(enc, "switching bitpool %d -> %d", enc->sbc.bitpool,
+								bitpool);
+
+	enc->sbc.bitpool = bitpool;
+	enc->frame_length = sbc_get_frame_length(&enc->sbc);
+
+	/* let the payloader know before any frame with the new length */
+	structure = gst_structure_new(GST_SBC_BITPOOL_EVENT,
+				"bitpool", G_TYPE_INT, bitpool, NULL);
+	gst_pad_push_event(enc->srcpad, gst_event_new_custom(
+				GST_EVENT_CUSTOM_DOWNSTREAM, structure));
+}
+
 static GstFlowReturn sbc_enc_chain(GstPad *pad, GstBuffer *buffer)
 {
 	GstSbcEnc *enc = GST_SBC_ENC(gst_pad_get_parent(pad));
@@ -377,6 +433,9 @@ static GstFlowReturn sbc_enc_chain(GstPad *pad, GstBuffer *buffer)
 		const guint8 *data;
 		gint consumed;
 
+		if (enc->pending_bitpool)
+			sbc_enc_update_bitpool(enc);
+
 		caps = GST_PAD_CAPS(enc->srcpad);
 		res = gst_pad_alloc_buffer_and_set_caps(enc->srcpad,
 						GST_BUFFER_OFFSET_NONE,
@@ -574,6 +633,8 @@ static void gst_sbc_enc_init(GstSbcEnc *self, GstSbcEncClass *klass)
 		GST_DEBUG_FUNCPTR(sbc_enc_src_getcaps));
 	gst_pad_set_setcaps_function(self->srcpad,
 		GST_DEBUG_FUNCPTR(sbc_enc_src_setcaps));
+	gst_pad_set_event_function(self->srcpad,
+		GST_DEBUG_FUNCPTR(sbc_enc_src_event));
 	gst_element_add_pad(GST_ELEMENT(self), self->srcpad);
 
 	gst_pad_set_chain_function(self->sinkpad,
@@ -589,6 +650,7 @@ static void gst_sbc_enc_init(GstSbcEnc *self, GstSbcEncClass *klass)
 
 	self->frame_length = 0;
 	self->frame_duration = 0;
+	self->pending_bitpool = 0;
 
 	self->adapter = gst_adapter_new();
 }
@@ -61,6 +61,8 @@ struct _GstSbcEnc {
 	gint frame_length;
 	gint frame_duration;
 
+	gint pending_bitpool;	/* requested from downstream, 0 if none */
+
 	sbc_t sbc;
 };
 
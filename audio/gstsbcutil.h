@@ -29,6 +29,10 @@
 #define SBC_AM_AUTO 0x02
 #define SBC_MODE_AUTO 0x04
 
+/* Custom event asking the encoder upstream to switch bitpool, and telling
+ * the payloader downstream that it did. Carries an int "bitpool" field */
+#define GST_SBC_BITPOOL_EVENT "GstSbcBitpool"
+
 gint gst_sbc_select_rate_from_list(const GValue *value);
 
 gint gst_sbc_select_channels_from_range(const GValue *value);
@@ -56,6 +56,7 @@
 #include "manager.h"
 #include "error.h"
 #include "telephony.h"
+#include "at.h"
 #include "headset.h"
 #include "glib-helper.h"
 #include "btio.h"
@@ -67,15 +68,32 @@
 
 #define RING_INTERVAL 3
 
-#define BUF_SIZE 1024
+/* Least time between +CIEV updates of the debounced indicators, in ms */
+#define IND_DEBOUNCE_INTERVAL 1000
+
+/* Queued response bytes beyond which further output is dropped, a
+ * headset this far behind has stopped reading */
+#define OUTQ_HIGH_WATERMARK 4096
 
 #define HEADSET_GAIN_SPEAKER 'S'
 #define HEADSET_GAIN_MICROPHONE 'M'
 
+struct indicator_state {
+	gboolean debounce;		/* Rate limit +CIEV for this one */
+	int sent;			/* Last value reported to headsets */
+	guint timer;			/* Debounce period in progress */
+};
+
+/* Indicators whose updates are frequent and not time critical */
+static const char *debounced_indicators[] = { "signal", "battchg", NULL };
+
 static struct {
 	gboolean telephony_ready;	/* Telephony plugin initialized */
 	uint32_t features;		/* HFP AG features */
 	const struct indicator *indicators;	/* Available HFP indicators */
+	struct indicator_state *ind_state;	/* Per indicator +CIEV state */
+	char *cind_ranges;		/* Response to AT+CIND=? */
+	char *cind_values;		/* Response to AT+CIND?, NULL if stale */
 	int er_mode;			/* Event reporting mode */
 	int er_ind;			/* Event reporting for indicators */
 	int rh;				/* Response and Hold state */
@@ -144,9 +162,10 @@ struct headset {
 
 	guint dc_timer;
 
-	char buf[BUF_SIZE];
-	int data_start;
-	int data_length;
+	struct at_parser parser;
+
+	GString *outq;
+	guint outq_watch;
 
 	gboolean hfp_active;
 	gboolean search_hfp;
@@ -170,7 +189,7 @@ struct headset {
 
 struct event {
 	const char *cmd;
-	int (*callback) (struct audio_device *device, const char *buf);
+	int (*callback) (struct audio_device *device, struct at_command *cmd);
 };
 
 static GSList *headset_callbacks = NULL;
@@ -290,35 +309,85 @@ static const char *state2str(headset_state_t state)
 	return NULL;
 }
 
-static int headset_send_valist(struct headset *hs, char *format, va_list ap)
+/* Write as much of the output queue as the socket takes without
+ * blocking, returns the number of bytes left */
+static int headset_flush(struct headset *hs)
 {
-	char rsp[BUF_SIZE];
-	ssize_t total_written, count;
 	int fd;
 
-	count = vsnprintf(rsp, sizeof(rsp), format, ap);
+	if (!hs->rfcomm || hs->outq->len == 0)
+		return 0;
 
-	if (count < 0)
-		return -EINVAL;
+	fd = g_io_channel_unix_get_fd(hs->rfcomm);
+
+	while (hs->outq->len > 0) {
+		ssize_t written;
+
+		written = send(fd, hs->outq->str, hs->outq->len,
+						MSG_DONTWAIT | MSG_NOSIGNAL);
+		if (written < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN)
+				break;
+			return -errno;
+		}
+
+		g_string_erase(hs->outq, 0, written);
+	}
+
+	return hs->outq->len;
+}
+
+static gboolean outq_cb(GIOChannel *chan, GIOCondition cond,
+				struct headset *hs)
+{
+	int ret;
+
+	if (cond & (G_IO_ERR | G_IO_HUP | G_IO_NVAL))
+		goto done;
+
+	ret = headset_flush(hs);
+	if (ret > 0)
+		return TRUE;
+
+	if (ret < 0)
+		error("headset_send: %s (%d)", strerror(-ret), -ret);
+
+done:
+	g_string_truncate(hs->outq, 0);
+	hs->outq_watch = 0;
+
+	return FALSE;
+}
+
+/* Responses are queued and written once the socket is writable, so result
+ * codes sent from the same main loop iteration go out in one write and a
+ * stalled headset never blocks the daemon */
+static int headset_send_valist(struct headset *hs, char *format, va_list ap)
+{
+	gsize len;
 
 	if (!hs->rfcomm) {
 		error("headset_send: the headset is not connected");
 		return -EIO;
 	}
 
-	total_written = 0;
-	fd = g_io_channel_unix_get_fd(hs->rfcomm);
+	if (hs->outq->len >= OUTQ_HIGH_WATERMARK) {
+		error("headset_send: output queue full, dropping response");
+		return -ENOBUFS;
+	}
 
-	while (total_written < count) {
-		ssize_t written;
+	len = hs->outq->len;
+	g_string_append_vprintf(hs->outq, format, ap);
 
-		written = write(fd, rsp + total_written,
-				count - total_written);
-		if (written < 0)
-			return -errno;
+	if (hs->outq->len == len)
+		return -EINVAL;
 
-		total_written += written;
-	}
+	if (!hs->outq_watch)
+		hs->outq_watch = g_io_add_watch(hs->rfcomm,
+					G_IO_OUT | G_IO_ERR | G_IO_HUP |
+					G_IO_NVAL, (GIOFunc) outq_cb, hs);
 
 	return 0;
 }
@@ -335,15 +404,16 @@ static int headset_send(struct headset *hs, char *format, ...)
 	return ret;
 }
 
-static int supported_features(struct audio_device *device, const char *buf)
+static int supported_features(struct audio_device *device,
+				struct at_command *cmd)
 {
 	struct headset *hs = device->headset;
 	int err;
 
-	if (strlen(buf) < 9)
+	if (cmd->type != AT_CMD_SET || cmd->args[0] == '\0')
 		return -EINVAL;
 
-	hs->hf_features = strtoul(&buf[8], NULL, 10);
+	hs->hf_features = strtoul(cmd->args, NULL, 10);
 
 	print_hf_features(hs->hf_features);
 
@@ -396,13 +466,14 @@ static char *indicator_values(const struct indicator *indicators)
 	return g_string_free(gstr, FALSE);
 }
 
-static int report_indicators(struct audio_device *device, const char *buf)
+static int report_indicators(struct audio_device *device,
+				struct at_command *cmd)
 {
 	struct headset *hs = device->headset;
 	int err;
-	char *str;
+	const char *str;
 
-	if (strlen(buf) < 8)
+	if (cmd->type != AT_CMD_TEST && cmd->type != AT_CMD_READ)
 		return -EINVAL;
 
 	if (ag.indicators == NULL) {
@@ -410,14 +481,16 @@ static int report_indicators(struct audio_device *device, const char *buf)
 		return headset_send(hs, "\r\nERROR\r\n");
 	}
 
-	if (buf[7] == '=')
-		str = indicator_ranges(ag.indicators);
-	else
-		str = indicator_values(ag.indicators);
+	if (cmd->type == AT_CMD_TEST)
+		str = ag.cind_ranges;
+	else {
+		/* Only rebuilt after an indicator changed */
+		if (!ag.cind_values)
+			ag.cind_values = indicator_values(ag.indicators);
+		str = ag.cind_values;
+	}
 
-	err = headset_send(hs, str);
-
-	g_free(str);
+	err = headset_send(hs, "%s", str);
 
 	if (err < 0)
 		return err;
@@ -720,14 +793,14 @@ int telephony_event_reporting_rsp(void *telephony_device, cme_error_t err)
 	return 0;
 }
 
-static int event_reporting(struct audio_device *dev, const char *buf)
+static int event_reporting(struct audio_device *dev, struct at_command *cmd)
 {
 	char **tokens; /* <mode>, <keyp>, <disp>, <ind>, <bfr> */
 
-	if (strlen(buf) < 13)
+	if (cmd->type != AT_CMD_SET || strlen(cmd->args) < 5)
 		return -EINVAL;
 
-	tokens = g_strsplit(&buf[8], ",", 5);
+	tokens = g_strsplit(cmd->args, ",", 5);
 	if (g_strv_length(tokens) < 4) {
 		g_strfreev(tokens);
 		return -EINVAL;
@@ -754,19 +827,19 @@ static int event_reporting(struct audio_device *dev, const char *buf)
 	return 0;
 }
 
-static int call_hold(struct audio_device *dev, const char *buf)
+static int call_hold(struct audio_device *dev, struct at_command *cmd)
 {
 	struct headset *hs = dev->headset;
 	int err;
 
-	if (strlen(buf) < 9)
-		return -EINVAL;
-
-	if (buf[8] != '?') {
-		telephony_call_hold_req(dev, &buf[8]);
+	if (cmd->type == AT_CMD_SET && cmd->args[0] != '\0') {
+		telephony_call_hold_req(dev, cmd->args);
 		return 0;
 	}
 
+	if (cmd->type != AT_CMD_TEST)
+		return -EINVAL;
+
 	err = headset_send(hs, "\r\n+CHLD: (%s)\r\n", ag.chld);
 	if (err < 0)
 		return err;
@@ -788,9 +861,9 @@ int telephony_key_press_rsp(void *telephony_device, cme_error_t err)
 	return telephony_generic_rsp(telephony_device, err);
 }
 
-static int key_press(struct audio_device *device, const char *buf)
+static int key_press(struct audio_device *device, struct at_command *cmd)
 {
-	if (strlen(buf) < 9)
+	if (cmd->type != AT_CMD_SET || cmd->args[0] == '\0')
 		return -EINVAL;
 
 	g_dbus_emit_signal(device->conn, device->path,
@@ -802,7 +875,7 @@ static int key_press(struct audio_device *device, const char *buf)
 		ag.ring_timer = 0;
 	}
 
-	telephony_key_press_req(device, &buf[8]);
+	telephony_key_press_req(device, cmd->args);
 
 	return 0;
 }
@@ -812,7 +885,7 @@ int telephony_answer_call_rsp(void *telephony_device, cme_error_t err)
 	return telephony_generic_rsp(telephony_device, err);
 }
 
-static int answer_call(struct audio_device *device, const char *buf)
+static int answer_call(struct audio_device *device, struct at_command *cmd)
 {
 	if (ag.ring_timer) {
 		g_source_remove(ag.ring_timer);
@@ -845,7 +918,7 @@ int telephony_terminate_call_rsp(void *telephony_device,
 	return headset_send(hs, "\r\nOK\r\n");
 }
 
-static int terminate_call(struct audio_device *device, const char *buf)
+static int terminate_call(struct audio_device *device, struct at_command *cmd)
 {
 	if (ag.number) {
 		g_free(ag.number);
@@ -862,14 +935,14 @@ static int terminate_call(struct audio_device *device, const char *buf)
 	return 0;
 }
 
-static int cli_notification(struct audio_device *device, const char *buf)
+static int cli_notification(struct audio_device *device, struct at_command *cmd)
 {
 	struct headset *hs = device->headset;
 
-	if (strlen(buf) < 9)
+	if (cmd->type != AT_CMD_SET || cmd->args[0] == '\0')
 		return -EINVAL;
 
-	hs->cli_active = buf[8] == '1' ? TRUE : FALSE;
+	hs->cli_active = cmd->args[0] == '1' ? TRUE : FALSE;
 
 	return headset_send(hs, "\r\nOK\r\n");
 }
@@ -879,18 +952,19 @@ int telephony_response_and_hold_rsp(void *telephony_device, cme_error_t err)
 	return telephony_generic_rsp(telephony_device, err);
 }
 
-static int response_and_hold(struct audio_device *device, const char *buf)
+static int response_and_hold(struct audio_device *device,
+				struct at_command *cmd)
 {
 	struct headset *hs = device->headset;
 
-	if (strlen(buf) < 8)
-		return -EINVAL;
-
-	if (buf[7] == '=') {
-		telephony_response_and_hold_req(device, atoi(&buf[8]) < 0);
+	if (cmd->type == AT_CMD_SET) {
+		telephony_response_and_hold_req(device, atoi(cmd->args) < 0);
 		return 0;
 	}
 
+	if (cmd->type != AT_CMD_READ)
+		return -EINVAL;
+
 	if (ag.rh >= 0)
 		headset_send(hs, "\r\n+BTRH: %d\r\n", ag.rh);
 
@@ -902,7 +976,8 @@ int telephony_last_dialed_number_rsp(void *telephony_device, cme_error_t err)
 	return telephony_generic_rsp(telephony_device, err);
 }
 
-static int last_dialed_number(struct audio_device *device, const char *buf)
+static int last_dialed_number(struct audio_device *device,
+				struct at_command *cmd)
 {
 	telephony_last_dialed_number_req(device);
 
@@ -914,46 +989,47 @@ int telephony_dial_number_rsp(void *telephony_device, cme_error_t err)
 	return telephony_generic_rsp(telephony_device, err);
 }
 
-static int dial_number(struct audio_device *device, const char *buf)
+static int dial_number(struct audio_device *device, struct at_command *cmd)
 {
-	char number[BUF_SIZE];
-	size_t buf_len;
+	size_t len;
 
-	buf_len = strlen(buf);
+	len = strlen(cmd->args);
 
-	if (buf[buf_len - 1] != ';') {
+	if (len == 0 || cmd->args[len - 1] != ';') {
 		debug("Rejecting non-voice call dial request");
 		return -EINVAL;
 	}
 
-	memset(number, 0, sizeof(number));
-	strncpy(number, &buf[3], buf_len - 4);
+	/* Strip the ';' in place, the line is ours until we return */
+	cmd->args[len - 1] = '\0';
 
-	telephony_dial_number_req(device, number);
+	telephony_dial_number_req(device, cmd->args);
 
 	return 0;
 }
 
-static int signal_gain_setting(struct audio_device *device, const char *buf)
+static int signal_gain_setting(struct audio_device *device,
+				struct at_command *cmd)
 {
 	struct headset *hs = device->headset;
 	const char *property;
 	const char *name;
 	dbus_uint16_t gain;
 
-	if (strlen(buf) < 8) {
+	if (cmd->type != AT_CMD_SET || cmd->args[0] == '\0') {
 		error("Too short string for Gain setting");
 		return -EINVAL;
 	}
 
-	gain = (dbus_uint16_t) strtol(&buf[7], NULL, 10);
+	gain = (dbus_uint16_t) strtol(cmd->args, NULL, 10);
 
 	if (gain > 15) {
 		error("Invalid gain value received: %u", gain);
 		return -EINVAL;
 	}
 
-	switch (buf[5]) {
+	/* +VGS or +VGM */
+	switch (cmd->name[3]) {
 	case HEADSET_GAIN_SPEAKER:
 		if (hs->sp_gain == gain)
 			goto ok;
@@ -991,14 +1067,14 @@ int telephony_transmit_dtmf_rsp(void *telephony_device, cme_error_t err)
 	return telephony_generic_rsp(telephony_device, err);
 }
 
-static int dtmf_tone(struct audio_device *device, const char *buf)
+static int dtmf_tone(struct audio_device *device, struct at_command *cmd)
 {
-	if (strlen(buf) < 8) {
+	if (cmd->type != AT_CMD_SET || cmd->args[0] == '\0') {
 		error("Too short string for DTMF tone");
 		return -EINVAL;
 	}
 
-	telephony_transmit_dtmf_req(device, buf[7]);
+	telephony_transmit_dtmf_req(device, cmd->args[0]);
 
 	return 0;
 }
@@ -1008,7 +1084,8 @@ int telephony_subscriber_number_rsp(void *telephony_device, cme_error_t err)
 	return telephony_generic_rsp(telephony_device, err);
 }
 
-static int subscriber_number(struct audio_device *device, const char *buf)
+static int subscriber_number(struct audio_device *device,
+				struct at_command *cmd)
 {
 	telephony_subscriber_number_req(device);
 
@@ -1020,21 +1097,22 @@ int telephony_list_current_calls_rsp(void *telephony_device, cme_error_t err)
 	return telephony_generic_rsp(telephony_device, err);
 }
 
-static int list_current_calls(struct audio_device *device, const char *buf)
+static int list_current_calls(struct audio_device *device,
+				struct at_command *cmd)
 {
 	telephony_list_current_calls_req(device);
 
 	return 0;
 }
 
-static int extended_errors(struct audio_device *device, const char *buf)
+static int extended_errors(struct audio_device *device, struct at_command *cmd)
 {
 	struct headset *hs = device->headset;
 
-	if (strlen(buf) < 9)
+	if (cmd->type != AT_CMD_SET || cmd->args[0] == '\0')
 		return -EINVAL;
 
-	if (buf[8] == '1') {
+	if (cmd->args[0] == '1') {
 		hs->cme_enabled = TRUE;
 		debug("CME errors enabled for headset %p", hs);
 	} else {
@@ -1045,14 +1123,15 @@ static int extended_errors(struct audio_device *device, const char *buf)
 	return headset_send(hs, "\r\nOK\r\n");
 }
 
-static int call_waiting_notify(struct audio_device *device, const char *buf)
+static int call_waiting_notify(struct audio_device *device,
+				struct at_command *cmd)
 {
 	struct headset *hs = device->headset;
 
-	if (strlen(buf) < 9)
+	if (cmd->type != AT_CMD_SET || cmd->args[0] == '\0')
 		return -EINVAL;
 
-	if (buf[8] == '1') {
+	if (cmd->args[0] == '1') {
 		hs->cwa_enabled = TRUE;
 		debug("Call waiting notification enabled for headset %p", hs);
 	} else {
@@ -1095,18 +1174,16 @@ int telephony_operator_selection_ind(int mode, const char *oper)
 	return 0;
 }
 
-static int operator_selection(struct audio_device *device, const char *buf)
+static int operator_selection(struct audio_device *device,
+				struct at_command *cmd)
 {
 	struct headset *hs = device->headset;
 
-	if (strlen(buf) < 8)
-		return -EINVAL;
-
-	switch (buf[7]) {
-	case '?':
+	switch (cmd->type) {
+	case AT_CMD_READ:
 		telephony_operator_selection_req(device);
 		break;
-	case '=':
+	case AT_CMD_SET:
 		return headset_send(hs, "\r\nOK\r\n");
 	default:
 		return -EINVAL;
@@ -1115,14 +1192,14 @@ static int operator_selection(struct audio_device *device, const char *buf)
 	return 0;
 }
 
-static int nr_and_ec(struct audio_device *device, const char *buf)
+static int nr_and_ec(struct audio_device *device, struct at_command *cmd)
 {
 	struct headset *hs = device->headset;
 
-	if (strlen(buf) < 9)
+	if (cmd->type != AT_CMD_SET || cmd->args[0] == '\0')
 		return -EINVAL;
 
-	if (buf[8] == '0')
+	if (cmd->args[0] == '0')
 		hs->nrec_req = FALSE;
 	else
 		hs->nrec_req = TRUE;
@@ -1132,41 +1209,53 @@ static int nr_and_ec(struct audio_device *device, const char *buf)
 	return 0;
 }
 
+/* Names as split by the AT parser, without the "AT" prefix */
 static struct event event_callbacks[] = {
-	{ "ATA", answer_call },
-	{ "ATD", dial_number },
-	{ "AT+VG", signal_gain_setting },
-	{ "AT+BRSF", supported_features },
-	{ "AT+CIND", report_indicators },
-	{ "AT+CMER", event_reporting },
-	{ "AT+CHLD", call_hold },
-	{ "AT+CHUP", terminate_call },
-	{ "AT+CKPD", key_press },
-	{ "AT+CLIP", cli_notification },
-	{ "AT+BTRH", response_and_hold },
-	{ "AT+BLDN", last_dialed_number },
-	{ "AT+VTS", dtmf_tone },
-	{ "AT+CNUM", subscriber_number },
-	{ "AT+CLCC", list_current_calls },
-	{ "AT+CMEE", extended_errors },
-	{ "AT+CCWA", call_waiting_notify },
-	{ "AT+COPS", operator_selection },
-	{ "AT+NREC", nr_and_ec },
+	{ "A", answer_call },
+	{ "D", dial_number },
+	{ "+VGS", signal_gain_setting },
+	{ "+VGM", signal_gain_setting },
+	{ "+BRSF", supported_features },
+	{ "+CIND", report_indicators },
+	{ "+CMER", event_reporting },
+	{ "+CHLD", call_hold },
+	{ "+CHUP", terminate_call },
+	{ "+CKPD", key_press },
+	{ "+CLIP", cli_notification },
+	{ "+BTRH", response_and_hold },
+	{ "+BLDN", last_dialed_number },
+	{ "+VTS", dtmf_tone },
+	{ "+CNUM", subscriber_number },
+	{ "+CLCC", list_current_calls },
+	{ "+CMEE", extended_errors },
+	{ "+CCWA", call_waiting_notify },
+	{ "+COPS", operator_selection },
+	{ "+NREC", nr_and_ec },
 	{ 0 }
 };
 
-static int handle_event(struct audio_device *device, const char *buf)
+static struct at_table *event_table = NULL;
+
+static int handle_event(struct audio_device *device, struct at_command *cmd)
 {
 	struct event *ev;
 
-	debug("Received %s", buf);
+	debug("Received %s", cmd->line);
+
+	if (cmd->type == AT_RESULT)
+		return -EINVAL;
 
-	for (ev = event_callbacks; ev->cmd; ev++) {
-		if (!strncmp(buf, ev->cmd, strlen(ev->cmd)))
-			return ev->callback(device, buf);
+	if (!event_table) {
+		event_table = at_table_new();
+		for (ev = event_callbacks; ev->cmd; ev++)
+			at_table_add(event_table, ev->cmd, ev);
 	}
 
-	return -EINVAL;
+	ev = at_table_lookup(event_table, cmd);
+	if (!ev)
+		return -EINVAL;
+
+	return ev->callback(device, cmd);
 }
 
 static void close_sco(struct audio_device *device)
@@ -1191,9 +1280,10 @@ static gboolean rfcomm_io_cb(GIOChannel *chan, GIOCondition cond,
 				struct audio_device *device)
 {
 	struct headset *hs;
-	unsigned char buf[BUF_SIZE];
+	struct at_command cmd;
 	gsize bytes_read = 0;
 	gsize free_space;
+	char *buf;
 
 	if (cond & G_IO_NVAL)
 		return FALSE;
@@ -1205,58 +1295,34 @@ static gboolean rfcomm_io_cb(GIOChannel *chan, GIOCondition cond,
 		goto failed;
 	}
 
-	if (g_io_channel_read(chan, (gchar *) buf, sizeof(buf) - 1,
-				&bytes_read) != G_IO_ERROR_NONE)
-		return TRUE;
-
-	free_space = sizeof(hs->buf) - hs->data_start - hs->data_length - 1;
+	buf = at_parser_space(&hs->parser, &free_space);
 
-	if (free_space < bytes_read) {
+	if (free_space == 0) {
 		/* Very likely that the HS is sending us garbage so
 		 * just ignore the data and disconnect */
 		error("Too much data to fit incomming buffer");
 		goto failed;
 	}
 
-	memcpy(&hs->buf[hs->data_start], buf, bytes_read);
-	hs->data_length += bytes_read;
+	if (g_io_channel_read(chan, buf, free_space,
+				&bytes_read) != G_IO_ERROR_NONE)
+		return TRUE;
 
-	/* Make sure the data is null terminated so we can use string
-	 * functions */
-	hs->buf[hs->data_start + hs->data_length] = '\0';
+	at_parser_commit(&hs->parser, bytes_read);
 
-	while (hs->data_length > 0) {
-		char *cr;
+	/* Empty commands are silently skipped by the parser */
+	while (at_parser_next(&hs->parser, &cmd)) {
 		int err;
-		off_t cmd_len;
 
-		cr = strchr(&hs->buf[hs->data_start], '\r');
-		if (!cr)
-			break;
-
-		cmd_len = 1 + (off_t) cr - (off_t) &hs->buf[hs->data_start];
-		*cr = '\0';
-
-		if (cmd_len > 1)
-			err = handle_event(device, &hs->buf[hs->data_start]);
-		else
-			/* Silently skip empty commands */
-			err = 0;
+		err = handle_event(device, &cmd);
 
 		if (err == -EINVAL) {
 			error("Badly formated or unrecognized command: %s",
-					&hs->buf[hs->data_start]);
+					cmd.line);
 			err = headset_send(hs, "\r\nERROR\r\n");
 		} else if (err < 0)
 			error("Error handling command %s: %s (%d)",
-						&hs->buf[hs->data_start],
-						strerror(-err), -err);
-
-		hs->data_start += cmd_len;
-		hs->data_length -= cmd_len;
-
-		if (!hs->data_length)
-			hs->data_start = 0;
+					cmd.line, strerror(-err), -err);
 	}
 
 	return TRUE;
@@ -2089,6 +2155,16 @@ static int headset_close_rfcomm(struct audio_device *dev)
 	struct headset *hs = dev->headset;
 	GIOChannel *rfcomm = hs->tmp_rfcomm ? hs->tmp_rfcomm : hs->rfcomm;
 
+	/* Last chance for queued responses, e.g. the ERROR that made us
+	 * give up on the connection */
+	headset_flush(hs);
+	g_string_truncate(hs->outq, 0);
+
+	if (hs->outq_watch) {
+		g_source_remove(hs->outq_watch);
+		hs->outq_watch = 0;
+	}
+
 	if (rfcomm) {
 		g_io_channel_shutdown(rfcomm, TRUE, NULL);
 		g_io_channel_unref(rfcomm);
@@ -2096,8 +2172,7 @@ static int headset_close_rfcomm(struct audio_device *dev)
 		hs->rfcomm = NULL;
 	}
 
-	hs->data_start = 0;
-	hs->data_length = 0;
+	at_parser_reset(&hs->parser);
 
 	hs->nrec = TRUE;
 
@@ -2120,6 +2195,8 @@ static void headset_free(struct audio_device *dev)
 
 	headset_close_rfcomm(dev);
 
+	g_string_free(hs->outq, TRUE);
+
 	g_free(hs);
 	dev->headset = NULL;
 }
@@ -2192,6 +2269,8 @@ register_iface:
 	debug("Registered interface %s on path %s",
 		AUDIO_HEADSET_INTERFACE, dev->path);
 
+	hs->outq = g_string_sized_new(64);
+
 	return hs;
 }
 
@@ -2651,8 +2730,40 @@ void headset_shutdown(struct audio_device *dev)
 	headset_set_state(dev, HEADSET_STATE_DISCONNECTED);
 }
 
+static void send_indicator(int index)
+{
+	ag.ind_state[index].sent = ag.indicators[index].val;
+
+	send_foreach_headset(active_devices, hfp_cmp,
+				"\r\n+CIEV: %d,%d\r\n", index + 1,
+				ag.indicators[index].val);
+}
+
+/* Report the last value seen during the debounce period, if it differs
+ * from what the headsets already have */
+static gboolean indicator_debounce_cb(gpointer user_data)
+{
+	int index = GPOINTER_TO_INT(user_data);
+	struct indicator_state *state = &ag.ind_state[index];
+
+	if (active_devices && ag.er_ind &&
+			state->sent != ag.indicators[index].val) {
+		send_indicator(index);
+		return TRUE;
+	}
+
+	state->timer = 0;
+
+	return FALSE;
+}
+
 int telephony_event_ind(int index)
 {
+	struct indicator_state *state;
+
+	g_free(ag.cind_values);
+	ag.cind_values = NULL;
+
 	if (!active_devices)
 		return -ENODEV;
 
@@ -2661,9 +2772,24 @@ int telephony_event_ind(int index)
 		return -EINVAL;
 	}
 
-	send_foreach_headset(active_devices, hfp_cmp,
-				"\r\n+CIEV: %d,%d\r\n", index + 1,
-				ag.indicators[index].val);
+	state = &ag.ind_state[index];
+
+	if (!state->debounce) {
+		send_indicator(index);
+		return 0;
+	}
+
+	/* The first change goes out at once, later ones within the
+	 * period are folded into one update when it ends */
+	if (state->timer)
+		return 0;
+
+	if (state->sent != ag.indicators[index].val)
+		send_indicator(index);
+
+	state->timer = g_timeout_add(IND_DEBOUNCE_INTERVAL,
+					indicator_debounce_cb,
+					GINT_TO_POINTER(index));
 
 	return 0;
 }
@@ -2751,6 +2877,37 @@ int telephony_ready_ind(uint32_t features,
 			const struct indicator *indicators, int rh,
 			const char *chld)
 {
+	int i, count;
+
+	for (count = 0; indicators[count].desc != NULL; count++);
+
+	if (ag.ind_state) {
+		for (i = 0; ag.indicators[i].desc != NULL; i++) {
+			if (ag.ind_state[i].timer)
+				g_source_remove(ag.ind_state[i].timer);
+		}
+		g_free(ag.ind_state);
+	}
+
+	ag.ind_state = g_new0(struct indicator_state, count);
+
+	for (i = 0; i < count; i++) {
+		const char **name;
+
+		ag.ind_state[i].sent = indicators[i].val;
+
+		for (name = debounced_indicators; *name; name++) {
+			if (g_str_equal(indicators[i].desc, *name))
+				ag.ind_state[i].debounce = TRUE;
+		}
+	}
+
+	/* The ranges never change, the values are cached until they do */
+	g_free(ag.cind_ranges);
+	ag.cind_ranges = indicator_ranges(indicators);
+	g_free(ag.cind_values);
+	ag.cind_values = NULL;
+
 	ag.telephony_ready = TRUE;
 	ag.features = features;
 	ag.indicators = indicators;
@@ -55,6 +55,15 @@
 				on IPC close or appl crash
   <Moves to idle>
 
+  Clients which already know the configuration they want (or have one
+  cached from a previous stream to the same device) can collapse the
+  open, configure and start steps into a single round trip:
+
+				<--BT_OPEN_STREAM_REQ
+
+  <Moves to streaming state>
+  BT_OPEN_STREAM_RSP-->		(stream fd follows as ancilliary data)
+
  */
 
 #ifndef BT_AUDIOCLIENT_H
@@ -101,6 +110,7 @@ typedef struct {
 #define BT_STOP_STREAM			5
 #define BT_CLOSE			6
 #define BT_CONTROL			7
+#define BT_OPEN_STREAM			8
 
 #define BT_CAPABILITIES_TRANSPORT_A2DP	0
 #define BT_CAPABILITIES_TRANSPORT_SCO	1
@@ -111,6 +121,7 @@ typedef struct {
 #define BT_CAPABILITIES_ACCESS_MODE_READWRITE	3
 
 #define BT_FLAG_AUTOCONNECT	1
+#define BT_FLAG_SHARED_PCM	2
 
 struct bt_get_capabilities_req {
 	bt_audio_msg_header_t	h;
@@ -251,6 +262,46 @@ struct bt_set_configuration_rsp {
 	uint16_t		link_mtu;	/* Max length that transport supports */
 } __attribute__ ((packed));
 
+/* Combined BT_OPEN, BT_SET_CONFIGURATION and BT_START_STREAM. A zero seid
+   in codec picks the first remote sink matching the codec type */
+struct bt_open_stream_req {
+	bt_audio_msg_header_t	h;
+	char			source[18];	/* Address of the local Device */
+	char			destination[18];/* Address of the remote Device */
+	char			object[128];	/* DBus object path */
+	uint8_t			flags;		/* Requested flags */
+	uint8_t			lock;		/* Requested lock */
+	codec_capabilities_t	codec;		/* Requested codec */
+} __attribute__ ((packed));
+
+/* This message is followed by one byte of data containing the stream data fd
+   as ancilliary data. With BT_FLAG_SHARED_PCM set in flags that fd is a
+   struct bt_pcm_ring to mmap instead of the transport */
+struct bt_open_stream_rsp {
+	bt_audio_msg_header_t	h;
+	uint16_t		link_mtu;	/* Max length that transport supports */
+	uint8_t			flags;		/* Granted flags */
+	codec_capabilities_t	codec;		/* Selected configuration */
+} __attribute__ ((packed));
+
+/* Shared PCM ring for BT_FLAG_SHARED_PCM streams. The client writes native
+   endian 16 bit interleaved PCM at the rate and channels of the selected
+   configuration; bluetoothd mixes all the rings of a sink and encodes them.
+   The indices run freely, head is only moved by the client and tail only by
+   bluetoothd */
+#define BT_PCM_RING_SIZE		16384
+
+#define BT_PCM_RING_CLOSED		1
+
+struct bt_pcm_ring {
+	uint32_t		size;		/* Size of data, a power of two */
+	volatile uint32_t	flags;		/* BT_PCM_RING_* */
+	volatile uint32_t	head;		/* Write index */
+	volatile uint32_t	tail;		/* Read index */
+	volatile uint32_t	underruns;	/* Packets the ring came up short */
+	uint8_t			data[0];
+} __attribute__ ((packed));
+
 #define BT_STREAM_ACCESS_READ		0
 #define BT_STREAM_ACCESS_WRITE		1
 #define BT_STREAM_ACCESS_READWRITE	2
@@ -34,10 +34,13 @@
 #include <fcntl.h>
 #include <unistd.h>
 #include <pthread.h>
+#include <sched.h>
 
 #include <netinet/in.h>
 #include <sys/poll.h>
 #include <sys/prctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 #include <bluetooth/bluetooth.h>
 #include <bluetooth/l2cap.h>
@@ -45,6 +48,7 @@
 #include "ipc.h"
 #include "sbc.h"
 #include "rtp.h"
+#include "pacing.h"
 #include "liba2dp.h"
 
 #define LOG_NDEBUG 0
@@ -88,9 +92,8 @@
 /* timeout in milliseconds to prevent poll() from hanging indefinitely */
 #define POLL_TIMEOUT			1000
 
-/* milliseconds of unsucessfull a2dp packets before we stop trying to catch up
- * on write()'s and fall-back to metered writes */
-#define CATCH_UP_TIMEOUT		200
+/* Number of packets we aim to keep queued in the stream socket */
+#define PACKET_QUEUE_TARGET		2
 
 /* timeout in milliseconds for a2dp_write */
 #define WRITE_TIMEOUT			1000
@@ -98,6 +101,19 @@
 /* timeout in seconds for command socket recv() */
 #define RECV_TIMEOUT            5
 
+/* size in bytes of the PCM ring between a2dp_write and the encoder thread,
+ * must be a power of two */
+#define PCM_RING_SIZE			16384
+
+/* largest possible SBC codesize: 16 blocks * 8 subbands * 2 channels */
+#define PCM_FRAME_SIZE			512
+
+/* interval in milliseconds to check a full shared ring for space */
+#define SHM_POLL_INTERVAL		5
+
+/* SCHED_FIFO priority requested for the encoder thread */
+#define ENCODER_PRIORITY		1
+
 
 typedef enum {
 	A2DP_STATE_NONE = 0,
@@ -136,8 +152,11 @@ struct bluetooth_data {
 	int	frame_duration;			/* length of an SBC frame in microseconds */
 	int codesize;				/* SBC codesize */
 	int samples;				/* Number of encoded samples */
-	uint8_t buffer[BUFFER_SIZE];		/* Codec transfer buffer */
+	uint8_t buffer[A2DP_MAX_BATCH][BUFFER_SIZE];	/* Codec transfer buffers */
 	int count;				/* Codec transfer buffer counter */
+	struct iovec tx[A2DP_MAX_BATCH];	/* Packets waiting to be sent */
+	int tx_count;
+	long tx_duration;			/* Play time of queued packets */
 
 	int nsamples;				/* Cumulative number of codec samples */
 	uint16_t seq_num;			/* Cumulative packet sequence */
@@ -146,9 +165,33 @@ struct bluetooth_data {
 	char	address[20];
 	int	rate;
 	int	channels;
+	int	config_cached;			/* sbc_capabilities were accepted
+						 * by address before */
 
 	/* used for pacing our writes to the output socket */
-	uint64_t	next_write;
+	struct a2dp_pacing pacing;
+	struct a2dp_bitpool bitpool;		/* Adapts bitpool to the link */
+
+	/* single producer (a2dp_write), single consumer (encoder thread) PCM
+	 * ring. The indices run freely and are only written by their owner,
+	 * ring_mutex is only used to sleep and wake up the other side */
+	uint8_t ring[PCM_RING_SIZE];
+	volatile unsigned int ring_head;	/* written by a2dp_write */
+	volatile unsigned int ring_tail;	/* written by encoder thread */
+	uint8_t frame[PCM_FRAME_SIZE];		/* wrapped frame scratch */
+	pthread_t encoder;
+	int encoder_started;
+	volatile int encoder_quit;
+	int link_error;				/* -errno of the last failed send,
+						 * protected by mutex */
+	pthread_mutex_t ring_mutex;
+	pthread_cond_t ring_wait;		/* data available */
+	pthread_cond_t ring_space;		/* space available */
+
+	/* bluetoothd's ring for BT_FLAG_SHARED_PCM streams, used instead of
+	 * the encoder thread when granted. Only (un)mapped with mutex held */
+	struct bt_pcm_ring *shm;
+	size_t shm_size;
 };
 
 static uint64_t get_microseconds()
@@ -168,13 +211,21 @@ static void print_time(const char* message, uint64_t then, uint64_t now)
 static int audioservice_send(struct bluetooth_data *data, const bt_audio_msg_header_t *msg);
 static int audioservice_expect(struct bluetooth_data *data, bt_audio_msg_header_t *outmsg,
 				int expected_type);
-static int bluetooth_a2dp_hw_params(struct bluetooth_data *data);
 static void set_state(struct bluetooth_data *data, a2dp_state_t state);
 
 
+static void bluetooth_shm_close(struct bluetooth_data *data)
+{
+	if (data->shm) {
+		munmap(data->shm, data->shm_size);
+		data->shm = NULL;
+	}
+}
+
 static void bluetooth_close(struct bluetooth_data *data)
 {
 	DBG("bluetooth_close");
+	bluetooth_shm_close(data);
 	if (data->server.fd >= 0) {
 		bt_audio_service_close(data->server.fd);
 		data->server.fd = -1;
@@ -213,6 +264,41 @@ static int l2cap_set_flushable(int fd, int flushable)
 	return 0;
 }
 
+/* Prepare a freshly received stream fd and reset the packet state */
+static void bluetooth_stream_setup(struct bluetooth_data *data)
+{
+	int bytes, frames;
+
+	l2cap_set_flushable(data->stream.fd, 1);
+	data->stream.events = POLLOUT;
+
+	/* set our socket buffer to the size of PACKET_BUFFER_COUNT packets */
+	bytes = data->link_mtu * PACKET_BUFFER_COUNT;
+	setsockopt(data->stream.fd, SOL_SOCKET, SO_SNDBUF, &bytes,
+			sizeof(bytes));
+
+	data->count = sizeof(struct rtp_header) + sizeof(struct rtp_payload);
+	data->frame_count = 0;
+	data->samples = 0;
+	data->nsamples = 0;
+	data->seq_num = 0;
+	data->tx_count = 0;
+	data->tx_duration = 0;
+	a2dp_pacing_start(&data->pacing, data->stream.fd,
+				data->link_mtu * PACKET_QUEUE_TARGET);
+
+	/* A packet taking more than half its own duration to go out means
+	 * the link can't keep up with the current bitpool */
+	data->sbc.bitpool = data->sbc_capabilities.max_bitpool;
+	frames = (data->link_mtu - sizeof(struct rtp_header) -
+			sizeof(struct rtp_payload)) /
+			sbc_get_frame_length(&data->sbc);
+	a2dp_bitpool_init(&data->bitpool, data->sbc_capabilities.min_bitpool,
+				data->sbc_capabilities.max_bitpool,
+				data->link_mtu * PACKET_QUEUE_TARGET,
+				MAX(frames, 1) * data->frame_duration / 2);
+}
+
 static int bluetooth_start(struct bluetooth_data *data)
 {
 	char c = 'w';
@@ -220,7 +306,7 @@ static int bluetooth_start(struct bluetooth_data *data)
 	struct bt_start_stream_req *start_req = (void*) buf;
 	struct bt_start_stream_rsp *start_rsp = (void*) buf;
 	struct bt_new_stream_ind *streamfd_ind = (void*) buf;
-	int opt_name, err, bytes;
+	int opt_name, err;
 
 	DBG("bluetooth_start");
 	data->state = A2DP_STATE_STARTING;
@@ -251,21 +337,8 @@ static int bluetooth_start(struct bluetooth_data *data)
 		err = -errno;
 		goto error;
 	}
-	l2cap_set_flushable(data->stream.fd, 1);
-	data->stream.events = POLLOUT;
 
-	/* set our socket buffer to the size of PACKET_BUFFER_COUNT packets */
-	bytes = data->link_mtu * PACKET_BUFFER_COUNT;
-	setsockopt(data->stream.fd, SOL_SOCKET, SO_SNDBUF, &bytes,
-			sizeof(bytes));
-
-	data->count = sizeof(struct rtp_header) + sizeof(struct rtp_payload);
-	data->frame_count = 0;
-	data->samples = 0;
-	data->nsamples = 0;
-	data->seq_num = 0;
-	data->frame_count = 0;
-	data->next_write = 0;
+	bluetooth_stream_setup(data);
 
 	set_state(data, A2DP_STATE_STARTED);
 	return 0;
@@ -282,10 +355,17 @@ static int bluetooth_stop(struct bluetooth_data *data)
 	char buf[BT_SUGGESTED_BUFFER_SIZE];
 	struct bt_stop_stream_req *stop_req = (void*) buf;
 	struct bt_stop_stream_rsp *stop_rsp = (void*) buf;
+	a2dp_state_t next_state = A2DP_STATE_CONFIGURED;
 	int err;
 
 	DBG("bluetooth_stop");
 
+	/* a shared stream is given up entirely, restarting it reopens */
+	if (data->shm) {
+		bluetooth_shm_close(data);
+		next_state = A2DP_STATE_INITIALIZED;
+	}
+
 	data->state = A2DP_STATE_STOPPING;
 	l2cap_set_flushable(data->stream.fd, 0);
 	if (data->stream.fd >= 0) {
@@ -310,7 +390,7 @@ static int bluetooth_stop(struct bluetooth_data *data)
 
 error:
 	if (data->state == A2DP_STATE_STOPPING)
-		set_state(data, A2DP_STATE_CONFIGURED);
+		set_state(data, next_state);
 	return err;
 }
 
@@ -493,49 +573,9 @@ static void bluetooth_a2dp_setup(struct bluetooth_data *data)
 	DBG("frame_duration: %d us", data->frame_duration);
 }
 
-static int bluetooth_a2dp_hw_params(struct bluetooth_data *data)
+static void bluetooth_print_configuration(struct bluetooth_data *data)
 {
-	char buf[BT_SUGGESTED_BUFFER_SIZE];
-	struct bt_open_req *open_req = (void *) buf;
-	struct bt_open_rsp *open_rsp = (void *) buf;
-	struct bt_set_configuration_req *setconf_req = (void*) buf;
-	struct bt_set_configuration_rsp *setconf_rsp = (void*) buf;
-	int err;
-
-	memset(open_req, 0, BT_SUGGESTED_BUFFER_SIZE);
-	open_req->h.type = BT_REQUEST;
-	open_req->h.name = BT_OPEN;
-	open_req->h.length = sizeof(*open_req);
-	strncpy(open_req->destination, data->address, 18);
-	open_req->seid = data->sbc_capabilities.capability.seid;
-	open_req->lock = BT_WRITE_LOCK;
-
-	err = audioservice_send(data, &open_req->h);
-	if (err < 0)
-		return err;
-
-	open_rsp->h.length = sizeof(*open_rsp);
-	err = audioservice_expect(data, &open_rsp->h, BT_OPEN);
-	if (err < 0)
-		return err;
-
-	err = bluetooth_a2dp_init(data);
-	if (err < 0)
-		return err;
-
-
-	memset(setconf_req, 0, BT_SUGGESTED_BUFFER_SIZE);
-	setconf_req->h.type = BT_REQUEST;
-	setconf_req->h.name = BT_SET_CONFIGURATION;
-	setconf_req->h.length = sizeof(*setconf_req);
-	memcpy(&setconf_req->codec, &data->sbc_capabilities,
-						sizeof(data->sbc_capabilities));
-
-	setconf_req->codec.transport = BT_CAPABILITIES_TRANSPORT_A2DP;
-	setconf_req->codec.length = sizeof(data->sbc_capabilities);
-	setconf_req->h.length += setconf_req->codec.length - sizeof(setconf_req->codec);
-
-	DBG("bluetooth_a2dp_hw_params sending configuration:\n");
+	DBG("bluetooth_open_stream sending configuration:\n");
 	switch (data->sbc_capabilities.channel_mode) {
 		case BT_A2DP_CHANNEL_MODE_MONO:
 			DBG("\tchannel_mode: MONO\n");
@@ -611,113 +651,135 @@ static int bluetooth_a2dp_hw_params(struct bluetooth_data *data)
 	}
 	DBG("\tmin_bitpool: %d\n", data->sbc_capabilities.min_bitpool);
 	DBG("\tmax_bitpool: %d\n", data->sbc_capabilities.max_bitpool);
+}
 
-	err = audioservice_send(data, &setconf_req->h);
-	if (err < 0)
-		return err;
+/* Close the packet being built and queue it for transmission */
+static void avdtp_queue(struct bluetooth_data *data)
+{
+	uint8_t *buffer = data->buffer[data->tx_count];
+	struct rtp_header *header;
+	struct rtp_payload *payload;
 
-	err = audioservice_expect(data, &setconf_rsp->h, BT_SET_CONFIGURATION);
-	if (err < 0)
-		return err;
+	header = (struct rtp_header *)buffer;
+	payload = (struct rtp_payload *)(buffer + sizeof(*header));
 
-	data->link_mtu = setconf_rsp->link_mtu;
-	DBG("MTU: %d", data->link_mtu);
+	memset(buffer, 0, sizeof(*header) + sizeof(*payload));
 
-	/* Setup SBC encoder now we agree on parameters */
-	bluetooth_a2dp_setup(data);
+	payload->frame_count = data->frame_count;
+	header->v = 2;
+	header->pt = 1;
+	header->sequence_number = htons(data->seq_num);
+	header->timestamp = htonl(data->nsamples);
+	header->ssrc = htonl(1);
 
-	DBG("\tallocation=%u\n\tsubbands=%u\n\tblocks=%u\n\tbitpool=%u\n",
-		data->sbc.allocation, data->sbc.subbands, data->sbc.blocks,
-		data->sbc.bitpool);
+	data->tx[data->tx_count].iov_base = buffer;
+	data->tx[data->tx_count].iov_len = data->count;
+	data->tx_count++;
+	data->tx_duration += data->frame_duration * data->frame_count;
 
-	return 0;
+	/* Reset buffer of data to send */
+	data->count = sizeof(struct rtp_header) + sizeof(struct rtp_payload);
+	data->frame_count = 0;
+	data->samples = 0;
+	data->seq_num++;
 }
 
+/* Send all queued packets once the first one is due. Called with
+ * data->mutex held, which is dropped while waiting for and writing to the
+ * socket so that the state machine isn't held up by a slow link */
 static int avdtp_write(struct bluetooth_data *data)
 {
-	int ret = 0;
-	struct rtp_header *header;
-	struct rtp_payload *payload;
-
-	uint64_t now;
-	long duration = data->frame_duration * data->frame_count;
+	struct pollfd stream;
+	int ret, err, count;
+	uint64_t poll_start, poll_end, send_start, send_end;
+	int queued, latency;
 #ifdef ENABLE_TIMING
 	uint64_t begin, end, begin2, end2;
 	begin = get_microseconds();
 #endif
 
-	header = (struct rtp_header *)data->buffer;
-	payload = (struct rtp_payload *)(data->buffer + sizeof(*header));
-
-	memset(data->buffer, 0, sizeof(*header) + sizeof(*payload));
+	stream.fd = data->stream.fd;
+	stream.events = data->stream.events;
+	stream.revents = 0;
+	count = data->tx_count;
 
-	payload->frame_count = data->frame_count;
-	header->v = 2;
-	header->pt = 1;
-	header->sequence_number = htons(data->seq_num);
-	header->timestamp = htonl(data->nsamples);
-	header->ssrc = htonl(1);
+	pthread_mutex_unlock(&data->mutex);
 
-	data->stream.revents = 0;
+	poll_start = get_microseconds();
 #ifdef ENABLE_TIMING
 	begin2 = get_microseconds();
 #endif
-	ret = poll(&data->stream, 1, POLL_TIMEOUT);
+	ret = poll(&stream, 1, POLL_TIMEOUT);
+	err = errno;
 #ifdef ENABLE_TIMING
 	end2 = get_microseconds();
 	print_time("poll", begin2, end2);
 #endif
-	if (ret == 1 && data->stream.revents == POLLOUT) {
-		long ahead = 0;
-		now = get_microseconds();
-
-		if (data->next_write) {
-			ahead = data->next_write - now;
-#ifdef ENABLE_TIMING
-			DBG("duration: %ld, ahead: %ld", duration, ahead);
-#endif
-			if (ahead > 0) {
-				/* too fast, need to throttle */
-				usleep(ahead);
-			}
-		} else {
-			data->next_write = now;
-		}
-		if (ahead <= -CATCH_UP_TIMEOUT * 1000) {
-			/* fallen too far behind, don't try to catch up */
-			VDBG("ahead < %d, reseting next_write timestamp", -CATCH_UP_TIMEOUT * 1000);
-			data->next_write = 0;
-		} else {
-			data->next_write += duration;
-		}
+	if (ret == 1 && stream.revents == POLLOUT) {
+		poll_end = get_microseconds();
+		a2dp_pacing_wait(&data->pacing);
+		send_start = get_microseconds();
 
 #ifdef ENABLE_TIMING
 		begin2 = get_microseconds();
 #endif
-		ret = send(data->stream.fd, data->buffer, data->count, MSG_NOSIGNAL);
+		ret = a2dp_send_packets(stream.fd, data->tx, count,
+							MSG_NOSIGNAL);
+		err = errno;
+		send_end = get_microseconds();
 #ifdef ENABLE_TIMING
-		end2 = get_microseconds();
-		print_time("send", begin2, end2);
+		print_time("send", begin2, send_end);
 #endif
-		if (ret < 0) {
-			/* can happen during normal remote disconnect */
-			VDBG("send() failed: %d (errno %s)", ret, strerror(errno));
-		}
-		if (ret == -EPIPE) {
-			bluetooth_close(data);
-		}
-	} else {
+	} else
+		ret = -1;
+
+	pthread_mutex_lock(&data->mutex);
+
+	/* Stopped or reopened meanwhile, the result is for a stale stream */
+	if (data->state != A2DP_STATE_STARTED || data->stream.fd != stream.fd)
+		goto done;
+
+	if (stream.revents != POLLOUT) {
 		/* can happen during normal remote disconnect */
-		VDBG("poll() failed: %d (revents = %d, errno %s)",
-				ret, data->stream.revents, strerror(errno));
-		data->next_write = 0;
+		VDBG("poll() failed: (revents = %d, errno %s)",
+				stream.revents, strerror(err));
+		a2dp_pacing_start(&data->pacing, data->stream.fd,
+					data->link_mtu * PACKET_QUEUE_TARGET);
+		goto done;
 	}
 
-	/* Reset buffer of data to send */
-	data->count = sizeof(struct rtp_header) + sizeof(struct rtp_payload);
-	data->frame_count = 0;
-	data->samples = 0;
-	data->seq_num++;
+	if (ret < 0) {
+		/* can happen during normal remote disconnect */
+		VDBG("send() failed: %d (errno %s)", ret, strerror(err));
+	} else if (ret < count) {
+		VDBG("only %d of %d packets sent", ret, count);
+	}
+
+	/* Hand link failures back to the next a2dp_write */
+	if (ret < 0 && err != EAGAIN && err != EINTR)
+		data->link_error = -err;
+
+	if (ret < 0 && err == EPIPE) {
+		bluetooth_close(data);
+		goto done;
+	}
+
+	/* time spent blocked on the socket, pacing excluded */
+	latency = poll_end - poll_start + send_end - send_start;
+
+	queued = a2dp_pacing_update(&data->pacing);
+	if (a2dp_bitpool_update(&data->bitpool, queued, latency)) {
+		data->sbc.bitpool = data->bitpool.bitpool;
+		VDBG("bitpool %u, queued %d, latency %d us",
+				data->sbc.bitpool, queued,
+				data->bitpool.latency);
+	}
+
+	a2dp_pacing_next(&data->pacing, data->tx_duration);
+
+done:
+	data->tx_count = 0;
+	data->tx_duration = 0;
 
 #ifdef ENABLE_TIMING
 	end = get_microseconds();
@@ -869,6 +931,99 @@ static int bluetooth_parse_capabilities(struct bluetooth_data *data,
 }
 
 
+/* Map the shared ring bluetoothd handed out in place of the transport */
+static int bluetooth_shm_open(struct bluetooth_data *data)
+{
+	struct stat st;
+	void *shm;
+	int err = 0;
+
+	if (fstat(data->stream.fd, &st) < 0) {
+		err = -errno;
+		goto done;
+	}
+
+	shm = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED,
+						data->stream.fd, 0);
+	if (shm == MAP_FAILED) {
+		err = -errno;
+		goto done;
+	}
+
+	data->shm = shm;
+	data->shm_size = st.st_size;
+	DBG("shared PCM ring of %u bytes", data->shm->size);
+
+done:
+	if (err < 0)
+		ERR("unable to map shared PCM ring: %s (%d)", strerror(-err),
+									-err);
+	close(data->stream.fd);
+	data->stream.fd = -1;
+	return err;
+}
+
+/* Open, configure and start the stream in a single request, using the
+ * configuration already chosen in sbc_capabilities */
+static int bluetooth_open_stream(struct bluetooth_data *data)
+{
+	char buf[BT_SUGGESTED_BUFFER_SIZE];
+	struct bt_open_stream_req *open_req = (void *) buf;
+	struct bt_open_stream_rsp *open_rsp = (void *) buf;
+	int err;
+
+	DBG("bluetooth_open_stream");
+
+	memset(open_req, 0, BT_SUGGESTED_BUFFER_SIZE);
+	open_req->h.type = BT_REQUEST;
+	open_req->h.name = BT_OPEN_STREAM;
+	strncpy(open_req->destination, data->address, 18);
+	open_req->flags = BT_FLAG_AUTOCONNECT | BT_FLAG_SHARED_PCM;
+	open_req->lock = BT_WRITE_LOCK;
+	memcpy(&open_req->codec, &data->sbc_capabilities,
+						sizeof(data->sbc_capabilities));
+	open_req->codec.transport = BT_CAPABILITIES_TRANSPORT_A2DP;
+	open_req->codec.length = sizeof(data->sbc_capabilities);
+	open_req->h.length = sizeof(*open_req) - sizeof(open_req->codec) +
+						open_req->codec.length;
+
+	bluetooth_print_configuration(data);
+
+	err = audioservice_send(data, &open_req->h);
+	if (err < 0)
+		return err;
+
+	/* read exactly the response, the stream fd follows it */
+	open_rsp->h.length = sizeof(*open_rsp) - sizeof(open_rsp->codec) +
+					sizeof(data->sbc_capabilities);
+	err = audioservice_expect(data, &open_rsp->h, BT_OPEN_STREAM);
+	if (err < 0)
+		return err;
+
+	data->link_mtu = open_rsp->link_mtu;
+	data->sbc_capabilities.capability.seid = open_rsp->codec.seid;
+	DBG("MTU: %d seid: %d", data->link_mtu, open_rsp->codec.seid);
+
+	data->stream.fd = bt_audio_service_get_data_fd(data->server.fd);
+	if (data->stream.fd < 0) {
+		ERR("bt_audio_service_get_data_fd failed, errno: %d", errno);
+		return -errno;
+	}
+
+	if (open_rsp->flags & BT_FLAG_SHARED_PCM)
+		return bluetooth_shm_open(data);
+
+	/* Setup SBC encoder now we agree on parameters */
+	bluetooth_a2dp_setup(data);
+	bluetooth_stream_setup(data);
+
+	DBG("\tallocation=%u\n\tsubbands=%u\n\tblocks=%u\n\tbitpool=%u\n",
+		data->sbc.allocation, data->sbc.subbands, data->sbc.blocks,
+		data->sbc.bitpool);
+
+	return 0;
+}
+
 static int bluetooth_configure(struct bluetooth_data *data)
 {
 	char buf[BT_SUGGESTED_BUFFER_SIZE];
@@ -879,6 +1034,21 @@ static int bluetooth_configure(struct bluetooth_data *data)
 	DBG("bluetooth_configure");
 
 	data->state = A2DP_STATE_CONFIGURING;
+
+	/* Same sink as last time: skip the capability exchange and replay
+	 * the configuration it accepted */
+	if (data->config_cached) {
+		err = bluetooth_open_stream(data);
+		if (err == 0) {
+			set_state(data, A2DP_STATE_STARTED);
+			return 0;
+		}
+
+		ERR("cached configuration rejected (%d), renegotiating", err);
+		data->config_cached = 0;
+		if (data->state != A2DP_STATE_CONFIGURING)
+			goto error;
+	}
 	memset(getcaps_req, 0, BT_SUGGESTED_BUFFER_SIZE);
 	getcaps_req->h.type = BT_REQUEST;
 	getcaps_req->h.name = BT_GET_CAPABILITIES;
@@ -903,13 +1073,18 @@ static int bluetooth_configure(struct bluetooth_data *data)
 	}
 
 	bluetooth_parse_capabilities(data, getcaps_rsp);
-	err = bluetooth_a2dp_hw_params(data);
+	err = bluetooth_a2dp_init(data);
+	if (err < 0)
+		goto error;
+
+	err = bluetooth_open_stream(data);
 	if (err < 0) {
-		ERR("bluetooth_a2dp_hw_params failed err: %d", err);
+		ERR("bluetooth_open_stream failed err: %d", err);
 		goto error;
 	}
 
-	set_state(data, A2DP_STATE_CONFIGURED);
+	data->config_cached = 1;
+	set_state(data, A2DP_STATE_STARTED);
 	return 0;
 
 error:
@@ -918,8 +1093,25 @@ error:
 	return err;
 }
 
+/* Fetch and clear the error of the last failed send */
+static int take_link_error(struct bluetooth_data *data)
+{
+	int err;
+
+	pthread_mutex_lock(&data->mutex);
+	err = data->link_error;
+	data->link_error = 0;
+	pthread_mutex_unlock(&data->mutex);
+
+	return err;
+}
+
 static void set_state(struct bluetooth_data *data, a2dp_state_t state)
 {
+	/* A restarted stream starts with a clean link */
+	if (state == A2DP_STATE_STARTED)
+		data->link_error = 0;
+
 	data->state = state;
 	pthread_cond_signal(&data->client_wait);
 }
@@ -1001,6 +1193,10 @@ again:
 
 static void a2dp_free(struct bluetooth_data *data)
 {
+	a2dp_pacing_close(&data->pacing);
+	pthread_cond_destroy(&data->ring_space);
+	pthread_cond_destroy(&data->ring_wait);
+	pthread_mutex_destroy(&data->ring_mutex);
 	pthread_cond_destroy(&data->client_wait);
 	pthread_cond_destroy(&data->thread_wait);
 	pthread_cond_destroy(&data->thread_start);
@@ -1009,6 +1205,210 @@ static void a2dp_free(struct bluetooth_data *data)
 	return;
 }
 
+static inline unsigned int ring_used(struct bluetooth_data *data)
+{
+	return data->ring_head - data->ring_tail;
+}
+
+static void ring_signal(struct bluetooth_data *data, pthread_cond_t *cond)
+{
+	pthread_mutex_lock(&data->ring_mutex);
+	pthread_cond_signal(cond);
+	pthread_mutex_unlock(&data->ring_mutex);
+}
+
+/* Called by the encoder thread only. Returns a pointer to the next len bytes
+ * of PCM, copying them to the frame scratch buffer if they wrap */
+static const uint8_t *ring_peek(struct bluetooth_data *data, unsigned int len)
+{
+	unsigned int offset = data->ring_tail & (PCM_RING_SIZE - 1);
+	unsigned int first = PCM_RING_SIZE - offset;
+
+	/* pairs with the barrier in ring_write() */
+	__sync_synchronize();
+
+	if (first >= len)
+		return data->ring + offset;
+
+	memcpy(data->frame, data->ring + offset, first);
+	memcpy(data->frame + first, data->ring, len - first);
+
+	return data->frame;
+}
+
+static void ring_consume(struct bluetooth_data *data, unsigned int len)
+{
+	/* finish reading the data before handing the space back */
+	__sync_synchronize();
+	data->ring_tail += len;
+}
+
+static void ring_flush(struct bluetooth_data *data)
+{
+	ring_consume(data, ring_used(data));
+}
+
+/* Called by a2dp_write only, returns number of bytes queued */
+static unsigned int ring_write(struct bluetooth_data *data,
+					const uint8_t *src, unsigned int len)
+{
+	unsigned int head = data->ring_head;
+	unsigned int offset = head & (PCM_RING_SIZE - 1);
+	unsigned int space = PCM_RING_SIZE - (head - data->ring_tail);
+	unsigned int first;
+
+	len = MIN(len, space);
+	if (len == 0)
+		return 0;
+
+	first = MIN(len, PCM_RING_SIZE - offset);
+	memcpy(data->ring + offset, src, first);
+	memcpy(data->ring, src + first, len - first);
+
+	/* publish the data before moving the head */
+	__sync_synchronize();
+	data->ring_head = head + len;
+
+	return len;
+}
+
+/* Wait at most timeout milliseconds for the encoder to free ring space */
+static int ring_wait_space(struct bluetooth_data *data, int timeout)
+{
+	struct timespec ts;
+	int err = 0;
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+	ts.tv_sec += timeout / 1000;
+	ts.tv_nsec += (timeout % 1000) * 1000000L;
+	if (ts.tv_nsec >= 1000000000L) {
+		ts.tv_sec++;
+		ts.tv_nsec -= 1000000000L;
+	}
+
+	pthread_mutex_lock(&data->ring_mutex);
+	while (ring_used(data) == PCM_RING_SIZE && !err)
+		err = pthread_cond_timedwait(&data->ring_space,
+						&data->ring_mutex, &ts);
+	pthread_mutex_unlock(&data->ring_mutex);
+
+	return -err;
+}
+
+/* Encode PCM from the ring until one batch of packets has been sent or the
+ * ring runs dry. Called with data->mutex held and the stream started, the
+ * lock is released while avdtp_write waits on the socket */
+static void a2dp_encode(struct bluetooth_data *data)
+{
+	unsigned int codesize = data->codesize;
+	size_t written;
+	const uint8_t *src;
+	int encoded, frames;
+
+	while (ring_used(data) >= codesize) {
+		src = ring_peek(data, codesize);
+
+		/* Enough data to encode (sbc wants 512 byte blocks) */
+		encoded = sbc_encode(&(data->sbc), src, codesize,
+					data->buffer[data->tx_count] + data->count,
+					BUFFER_SIZE - data->count,
+					&written);
+		if (encoded <= 0) {
+			ERR("Encoding error %d", encoded);
+			ring_consume(data, codesize);
+			continue;
+		}
+		VDBG("sbc_encode returned %d, codesize: %d, written: %d\n",
+			encoded, codesize, written);
+
+		ring_consume(data, encoded);
+		data->count += written;
+		data->frame_count++;
+		data->samples += encoded;
+		data->nsamples += encoded;
+
+		/* No space left for another frame then send */
+		if ((data->count + written >= data->link_mtu) ||
+				(data->count + written >= BUFFER_SIZE)) {
+			VDBG("sending packet %d, count %d, link_mtu %u",
+					data->seq_num, data->count,
+					data->link_mtu);
+			frames = data->frame_count;
+			avdtp_queue(data);
+
+			/* Batch the next packet too if it is already due */
+			if (data->tx_count < A2DP_MAX_BATCH &&
+					ring_used(data) >= codesize * frames &&
+					a2dp_pacing_due(&data->pacing,
+							data->tx_duration))
+				continue;
+
+			avdtp_write(data);
+			break;
+		}
+	}
+}
+
+static int encoder_ready(struct bluetooth_data *data)
+{
+	unsigned int used = ring_used(data);
+
+	return used > 0 && used >= (unsigned int) data->codesize;
+}
+
+static void* a2dp_encoder_thread(void *d)
+{
+	struct bluetooth_data* data = (struct bluetooth_data*)d;
+	struct sched_param param;
+
+	DBG("a2dp_encoder_thread started");
+	prctl(PR_SET_NAME, (int)"a2dp_encoder", 0, 0, 0);
+
+	memset(&param, 0, sizeof(param));
+	param.sched_priority = ENCODER_PRIORITY;
+	if (pthread_setschedparam(pthread_self(), SCHED_FIFO, &param) != 0)
+		DBG("unable to set real-time priority for encoder thread");
+
+	while (1) {
+		pthread_mutex_lock(&data->ring_mutex);
+		while (!data->encoder_quit && !encoder_ready(data))
+			pthread_cond_wait(&data->ring_wait, &data->ring_mutex);
+		pthread_mutex_unlock(&data->ring_mutex);
+
+		if (data->encoder_quit)
+			break;
+
+		/* serialize with the state machine, which owns the socket.
+		 * avdtp_write drops the lock while it blocks */
+		pthread_mutex_lock(&data->mutex);
+		if (data->state == A2DP_STATE_STARTED)
+			a2dp_encode(data);
+		else
+			ring_flush(data);
+		pthread_mutex_unlock(&data->mutex);
+
+		ring_signal(data, &data->ring_space);
+	}
+
+	DBG("a2dp_encoder_thread finished");
+	return NULL;
+}
+
+static void encoder_stop(struct bluetooth_data *data)
+{
+	if (!data->encoder_started)
+		return;
+
+	pthread_mutex_lock(&data->ring_mutex);
+	data->encoder_quit = 1;
+	pthread_cond_signal(&data->ring_wait);
+	pthread_cond_broadcast(&data->ring_space);
+	pthread_mutex_unlock(&data->ring_mutex);
+
+	pthread_join(data->encoder, NULL);
+	data->encoder_started = 0;
+}
+
 static void* a2dp_thread(void *d)
 {
 	struct bluetooth_data* data = (struct bluetooth_data*)d;
@@ -1060,6 +1460,11 @@ static void* a2dp_thread(void *d)
 				break;
 
 			case A2DP_CMD_QUIT:
+				/* the encoder takes data->mutex for every
+				 * packet, so release it while joining */
+				pthread_mutex_unlock(&data->mutex);
+				encoder_stop(data);
+				pthread_mutex_lock(&data->mutex);
 				bluetooth_close(data);
 				sbc_finish(&data->sbc);
 				a2dp_free(data);
@@ -1102,15 +1507,29 @@ int a2dp_init(int rate, int channels, a2dpData* dataPtr)
 
 	sbc_init(&data->sbc, 0);
 
+	if (a2dp_pacing_init(&data->pacing) < 0)
+		DBG("timerfd unavailable, pacing with clock_nanosleep");
+
 	pthread_mutex_init(&data->mutex, NULL);
 	pthread_cond_init(&data->thread_start, NULL);
 	pthread_cond_init(&data->thread_wait, NULL);
 	pthread_cond_init(&data->client_wait, NULL);
+	pthread_mutex_init(&data->ring_mutex, NULL);
+	pthread_cond_init(&data->ring_wait, NULL);
+	pthread_cond_init(&data->ring_space, NULL);
+
+	pthread_attr_init(&attr);
+
+	err = pthread_create(&data->encoder, &attr, a2dp_encoder_thread, data);
+	if (err) {
+		err = -err;
+		goto error;
+	}
+	data->encoder_started = 1;
 
 	pthread_mutex_lock(&data->mutex);
 	data->started = 0;
 
-	pthread_attr_init(&attr);
 	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
 
 	err = pthread_create(&data->thread, &attr, a2dp_thread, data);
@@ -1135,6 +1554,7 @@ int a2dp_init(int rate, int channels, a2dpData* dataPtr)
 	*dataPtr = data;
 	return 0;
 error:
+	encoder_stop(data);
 	bluetooth_close(data);
 	sbc_finish(&data->sbc);
 	pthread_attr_destroy(&attr);
@@ -1148,76 +1568,136 @@ void a2dp_set_sink(a2dpData d, const char* address)
 	struct bluetooth_data* data = (struct bluetooth_data*)d;
 	if (strncmp(data->address, address, 18)) {
 		strncpy(data->address, address, 18);
+		data->config_cached = 0;
 		set_command(data, A2DP_CMD_INIT);
 	}
 }
 
+/* Copy PCM into bluetoothd's shared ring, giving it up to timeout
+ * milliseconds to make room. Returns the number of bytes queued, or -1
+ * once bluetoothd has closed the ring */
+static int shm_write(struct bluetooth_data *data, const uint8_t *src,
+				unsigned int len, int timeout)
+{
+	struct bt_pcm_ring *shm;
+	unsigned int done = 0, space, offset, chunk, first;
+	uint32_t head;
+
+	while (done < len) {
+		pthread_mutex_lock(&data->mutex);
+
+		shm = data->shm;
+		if (!shm || (shm->flags & BT_PCM_RING_CLOSED)) {
+			pthread_mutex_unlock(&data->mutex);
+			return -1;
+		}
+
+		head = shm->head;
+		__sync_synchronize();
+		space = shm->size - (head - shm->tail);
+		chunk = MIN(space, len - done);
+
+		offset = head & (shm->size - 1);
+		first = MIN(chunk, shm->size - offset);
+		memcpy(shm->data + offset, src + done, first);
+		memcpy(shm->data, src + done + first, chunk - first);
+
+		__sync_synchronize();
+		shm->head = head + chunk;
+
+		pthread_mutex_unlock(&data->mutex);
+
+		done += chunk;
+		if (chunk > 0)
+			continue;
+
+		if (timeout <= 0) {
+			VDBG("shared PCM ring overrun, dropping %u bytes",
+								len - done);
+			break;
+		}
+
+		usleep(SHM_POLL_INTERVAL * 1000);
+		timeout -= SHM_POLL_INTERVAL;
+	}
+
+	return done;
+}
+
 int a2dp_write(a2dpData d, const void* buffer, int count)
 {
 	struct bluetooth_data* data = (struct bluetooth_data*)d;
-	uint8_t* src = (uint8_t *)buffer;
-	int codesize;
-	int err, ret = 0;
-	long frames_left = count;
-	int encoded;
-	unsigned int written;
-	const char *buff;
-	int did_configure = 0;
+	const uint8_t *src = buffer;
+	unsigned int left = count, queued;
+	int err, timeout, written;
+	a2dp_state_t state;
 #ifdef ENABLE_TIMING
 	uint64_t begin, end;
 	DBG("********** a2dp_write **********");
 	begin = get_microseconds();
 #endif
 
-	err = wait_for_start(data, WRITE_TIMEOUT);
-	if (err < 0)
-		return err;
+	pthread_mutex_lock(&data->mutex);
+	state = data->state;
+	pthread_mutex_unlock(&data->mutex);
 
-	codesize = data->codesize;
+	if (state != A2DP_STATE_STARTED) {
+		err = wait_for_start(data, WRITE_TIMEOUT);
+		if (err < 0)
+			return err;
+	}
 
-	while (frames_left >= codesize) {
-		/* Enough data to encode (sbc wants 512 byte blocks) */
-		encoded = sbc_encode(&(data->sbc), src, codesize,
-					data->buffer + data->count,
-					sizeof(data->buffer) - data->count,
-					&written);
-		if (encoded <= 0) {
-			ERR("Encoding error %d", encoded);
-			goto done;
+	if (data->shm) {
+		timeout = BT_PCM_RING_SIZE * 1000 /
+					(data->rate * data->channels * 2);
+
+		/* bluetoothd dropped the stream, reopen on the next write */
+		written = shm_write(data, src, count, timeout + 1);
+		if (written < 0) {
+			set_command(data, A2DP_CMD_STOP);
+			return -EPIPE;
 		}
-		VDBG("sbc_encode returned %d, codesize: %d, written: %d\n",
-			encoded, codesize, written);
 
-		src += encoded;
-		data->count += written;
-		data->frame_count++;
-		data->samples += encoded;
-		data->nsamples += encoded;
+		return written;
+	}
 
-		/* No space left for another frame then send */
-		if ((data->count + written >= data->link_mtu) ||
-				(data->count + written >= BUFFER_SIZE)) {
-			VDBG("sending packet %d, count %d, link_mtu %u",
-					data->seq_num, data->count,
-					data->link_mtu);
-			err = avdtp_write(data);
-			if (err < 0)
-				return err;
+	/* Report a failed send once, the caller decides whether to go on */
+	err = take_link_error(data);
+	if (err < 0)
+		return err;
+
+	/* Only block for as long as the ring takes to play out, a stalled
+	 * link must not hold up the caller beyond that */
+	timeout = PCM_RING_SIZE * 1000 / (data->rate * data->channels * 2);
+
+	while (left > 0) {
+		queued = ring_write(data, src, left);
+		if (queued > 0) {
+			ring_signal(data, &data->ring_wait);
+			src += queued;
+			left -= queued;
+			continue;
 		}
 
-		ret += encoded;
-		frames_left -= encoded;
+		if (ring_wait_space(data, timeout + 1) < 0 ||
+						data->encoder_quit) {
+			VDBG("PCM ring overrun, dropping %u bytes", left);
+			break;
+		}
 	}
 
-	if (frames_left > 0)
-		ERR("%ld bytes left at end of a2dp_write\n", frames_left);
-
-done:
 #ifdef ENABLE_TIMING
 	end = get_microseconds();
 	print_time("a2dp_write total", begin, end);
 #endif
-	return ret;
+	/* Nothing could be queued because the link went away */
+	if (left == (unsigned int) count) {
+		err = take_link_error(data);
+		if (err < 0)
+			return err;
+	}
+
+	return count - left;
 }
 
 int a2dp_stop(a2dpData d)
@@ -0,0 +1,339 @@
+/*
+ *
+ *  BlueZ - Bluetooth protocol stack for Linux
+ *
+ *  Copyright (C) 2004-2009  Marcel Holtmann <marcel@holtmann.org>
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <errno.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <sys/ioctl.h>
+#include <sys/poll.h>
+#include <sys/socket.h>
+#include <sys/timerfd.h>
+#include <linux/sockios.h>
+
+#include "pacing.h"
+
+/* Largest correction applied to packet durations, in ppm */
+#define PACING_MAX_DRIFT	10000
+
+/* Never fall behind the ideal schedule by more than this, in ns */
+#define PACING_MAX_LATE		200000000ULL
+
+/* While catching up packets go out at most this many times faster */
+#define PACING_CATCH_UP		2
+
+/* Samples above high water before backing off and below low water before
+ * stepping the bitpool up again */
+#define BITPOOL_CONGESTED	4
+#define BITPOOL_CLEAR		128
+
+#define BITPOOL_STEP		2
+
+static uint64_t pacing_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void pacing_timespec(uint64_t ns, struct timespec *ts)
+{
+	ts->tv_sec = ns / 1000000000ULL;
+	ts->tv_nsec = ns % 1000000000ULL;
+}
+
+static void pacing_arm(struct a2dp_pacing *p)
+{
+	struct itimerspec its;
+
+	if (p->fd < 0)
+		return;
+
+	memset(&its, 0, sizeof(its));
+	pacing_timespec(p->expiry, &its.it_value);
+
+	/* a zero it_value would disarm the timer */
+	if (its.it_value.tv_sec == 0 && its.it_value.tv_nsec == 0)
+		its.it_value.tv_nsec = 1;
+
+	timerfd_settime(p->fd, TFD_TIMER_ABSTIME, &its, NULL);
+}
+
+int a2dp_pacing_init(struct a2dp_pacing *p)
+{
+	memset(p, 0, sizeof(*p));
+	p->sk = -1;
+
+	/* fall back to clock_nanosleep on kernels without timerfd */
+	p->fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	if (p->fd < 0)
+		return -errno;
+
+	return 0;
+}
+
+void a2dp_pacing_close(struct a2dp_pacing *p)
+{
+	if (p->fd >= 0) {
+		close(p->fd);
+		p->fd = -1;
+	}
+}
+
+void a2dp_pacing_start(struct a2dp_pacing *p, int sk, int target)
+{
+	socklen_t len = sizeof(p->sndbuf);
+
+	p->sk = sk;
+	p->target = target > 0 ? target : 1;
+
+	if (sk < 0 || getsockopt(sk, SOL_SOCKET, SO_SNDBUF, &p->sndbuf,
+								&len) < 0)
+		p->sndbuf = 0;
+
+	p->deadline = pacing_now();
+	p->expiry = p->deadline;
+	p->queued = 0;
+	p->drift = 0;
+
+	pacing_arm(p);
+}
+
+void a2dp_pacing_next(struct a2dp_pacing *p, unsigned int duration)
+{
+	uint64_t now = pacing_now();
+	int64_t period;
+
+	period = (int64_t) duration * 1000;
+	period += period * p->drift / 1000000;
+
+	p->deadline += period;
+
+	/* After a stall keep a bounded debt instead of bursting it all out */
+	if (p->deadline + PACING_MAX_LATE < now)
+		p->deadline = now - PACING_MAX_LATE;
+
+	p->expiry = p->deadline;
+	if (p->expiry < now + period / PACING_CATCH_UP)
+		p->expiry = now + period / PACING_CATCH_UP;
+
+	pacing_arm(p);
+}
+
+void a2dp_pacing_wait(struct a2dp_pacing *p)
+{
+	struct pollfd pfd;
+	struct timespec ts;
+
+	if (p->fd < 0) {
+		pacing_timespec(p->expiry, &ts);
+		while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts,
+							NULL) == EINTR);
+		return;
+	}
+
+	pfd.fd = p->fd;
+	pfd.events = POLLIN;
+
+	while (!a2dp_pacing_expired(p)) {
+		if (poll(&pfd, 1, -1) < 0 && errno != EINTR)
+			break;
+	}
+}
+
+int a2dp_pacing_expired(struct a2dp_pacing *p)
+{
+	uint64_t ticks;
+
+	if (p->fd >= 0 && read(p->fd, &ticks, sizeof(ticks)) > 0)
+		return 1;
+
+	return pacing_now() >= p->expiry;
+}
+
+int a2dp_pacing_timeout(struct a2dp_pacing *p)
+{
+	uint64_t now = pacing_now();
+
+	if (now >= p->expiry)
+		return 0;
+
+	return (p->expiry - now + 999999) / 1000000;
+}
+
+int a2dp_pacing_due(struct a2dp_pacing *p, unsigned int offset)
+{
+	int64_t delay = (int64_t) offset * 1000;
+
+	delay += delay * p->drift / 1000000;
+
+	return p->deadline + delay <= pacing_now();
+}
+
+#ifdef __NR_sendmmsg
+/* Same layout as the kernel's struct mmsghdr, which not every libc has */
+struct pacing_mmsghdr {
+	struct msghdr msg_hdr;
+	unsigned int msg_len;
+};
+
+static int pacing_sendmmsg(int sk, const struct iovec *iov, int count,
+								int flags)
+{
+	struct pacing_mmsghdr msgs[A2DP_MAX_BATCH];
+	int i;
+
+	memset(msgs, 0, count * sizeof(msgs[0]));
+
+	for (i = 0; i < count; i++) {
+		msgs[i].msg_hdr.msg_iov = (struct iovec *) &iov[i];
+		msgs[i].msg_hdr.msg_iovlen = 1;
+	}
+
+	return syscall(__NR_sendmmsg, sk, msgs, count, flags);
+}
+#endif
+
+int a2dp_send_packets(int sk, const struct iovec *iov, int count, int flags)
+{
+	int i;
+
+	if (count > A2DP_MAX_BATCH)
+		count = A2DP_MAX_BATCH;
+
+#ifdef __NR_sendmmsg
+	if (count > 1) {
+		static int unsupported = 0;
+		int ret;
+
+		if (!unsupported) {
+			ret = pacing_sendmmsg(sk, iov, count, flags);
+			if (ret >= 0 || errno != ENOSYS)
+				return ret;
+
+			unsupported = 1;
+		}
+	}
+#endif
+
+	for (i = 0; i < count; i++) {
+		if (send(sk, iov[i].iov_base, iov[i].iov_len, flags) < 0)
+			return i > 0 ? i : -1;
+	}
+
+	return count;
+}
+
+int a2dp_queue_level(int sk, int sndbuf)
+{
+	int space;
+
+	if (sk < 0 || sndbuf <= 0)
+		return 0;
+
+	/* Bluetooth sockets report the free space of the send buffer */
+	if (ioctl(sk, SIOCOUTQ, &space) < 0)
+		return 0;
+
+	if (space > sndbuf)
+		return 0;
+
+	return sndbuf - space;
+}
+
+int a2dp_pacing_update(struct a2dp_pacing *p)
+{
+	int err;
+
+	p->queued = (p->queued * 7 + a2dp_queue_level(p->sk, p->sndbuf)) / 8;
+
+	/* Proportional correction: stretch packets while the sink lags */
+	err = p->queued - p->target;
+	p->drift = err * PACING_MAX_DRIFT / (3 * p->target);
+	if (p->drift > PACING_MAX_DRIFT)
+		p->drift = PACING_MAX_DRIFT;
+	else if (p->drift < -PACING_MAX_DRIFT)
+		p->drift = -PACING_MAX_DRIFT;
+
+	return p->queued;
+}
+
+void a2dp_bitpool_init(struct a2dp_bitpool *b, uint8_t min_bitpool,
+			uint8_t max_bitpool, int target, int max_latency)
+{
+	memset(b, 0, sizeof(*b));
+
+	b->min = min_bitpool;
+	b->max = max_bitpool > min_bitpool ? max_bitpool : min_bitpool;
+	b->bitpool = b->max;
+	b->high = 4 * target;
+	b->low = target;
+	b->max_latency = max_latency;
+}
+
+int a2dp_bitpool_update(struct a2dp_bitpool *b, int queued, int latency)
+{
+	uint8_t bitpool = b->bitpool;
+	int step;
+
+	b->latency = (b->latency * 7 + latency) / 8;
+
+	if (queued > b->high || b->latency > b->max_latency) {
+		b->clear = 0;
+		if (++b->congested < BITPOOL_CONGESTED)
+			return 0;
+
+		/* back off by a quarter of the headroom, at least one step */
+		step = (bitpool - b->min) / 4;
+		if (step < BITPOOL_STEP)
+			step = BITPOOL_STEP;
+
+		bitpool = bitpool > b->min + step ? bitpool - step : b->min;
+		b->congested = 0;
+	} else if (queued <= b->low && b->latency <= b->max_latency / 2) {
+		b->congested = 0;
+		if (++b->clear < BITPOOL_CLEAR)
+			return 0;
+
+		bitpool = bitpool + BITPOOL_STEP < b->max ?
+					bitpool + BITPOOL_STEP : b->max;
+		b->clear = 0;
+	} else {
+		b->congested = 0;
+		b->clear = 0;
+	}
+
+	if (bitpool == b->bitpool)
+		return 0;
+
+	b->bitpool = bitpool;
+
+	return 1;
+}
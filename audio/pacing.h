@@ -0,0 +1,111 @@
+/*
+ *
+ *  BlueZ - Bluetooth protocol stack for Linux
+ *
+ *  Copyright (C) 2004-2009  Marcel Holtmann <marcel@holtmann.org>
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#ifndef BT_PACING_H
+#define BT_PACING_H
+
+#include <stdint.h>
+#include <sys/uio.h>
+
+/* Isochronous packet pacing for A2DP streams.
+ *
+ * Deadlines are absolute CLOCK_MONOTONIC times advanced by the duration of
+ * each packet, so that scheduling jitter does not accumulate. The socket
+ * send queue is sampled after every packet: if the sink consumes slower than
+ * our sample clock the queue grows and packet durations are stretched, and
+ * shrunk when it drains. */
+
+struct a2dp_pacing {
+	int fd;			/* timerfd, -1 to use clock_nanosleep */
+	int sk;			/* stream socket */
+	int sndbuf;		/* stream socket send buffer size */
+	int target;		/* send queue level we aim for in bytes */
+	uint64_t deadline;	/* ideal time of the next packet in ns */
+	uint64_t expiry;	/* time the next packet is allowed out in ns */
+	int queued;		/* smoothed send queue level in bytes */
+	int drift;		/* correction applied to durations in ppm */
+};
+
+int a2dp_pacing_init(struct a2dp_pacing *p);
+void a2dp_pacing_close(struct a2dp_pacing *p);
+
+/* Restart the schedule from now, target is the queue level in bytes */
+void a2dp_pacing_start(struct a2dp_pacing *p, int sk, int target);
+
+/* Schedule the packet after one lasting duration microseconds */
+void a2dp_pacing_next(struct a2dp_pacing *p, unsigned int duration);
+
+/* Block until the next packet is due */
+void a2dp_pacing_wait(struct a2dp_pacing *p);
+
+/* Non-blocking check for a due packet, for callers polling on p->fd */
+int a2dp_pacing_expired(struct a2dp_pacing *p);
+
+/* Milliseconds until the next packet is due */
+int a2dp_pacing_timeout(struct a2dp_pacing *p);
+
+/* Whether a packet offset microseconds after the next one is already due,
+ * so that it can go out in the same batch */
+int a2dp_pacing_due(struct a2dp_pacing *p, unsigned int offset);
+
+/* Sample the send queue and update the drift estimate, returns the
+ * smoothed queue level in bytes */
+int a2dp_pacing_update(struct a2dp_pacing *p);
+
+/* Bytes waiting in the send queue of sk, sndbuf being its SO_SNDBUF */
+int a2dp_queue_level(int sk, int sndbuf);
+
+/* Largest number of packets handed to the kernel at once */
+#define A2DP_MAX_BATCH 8
+
+/* Send each iovec as one packet with a single sendmmsg() where available.
+ * Returns the number of packets sent or -1 with errno set if the first one
+ * failed */
+int a2dp_send_packets(int sk, const struct iovec *iov, int count, int flags);
+
+/* Adaptive bitpool controller.
+ *
+ * The link is considered congested while the send queue stays above high
+ * water or sending a packet takes longer than max_latency. The bitpool then
+ * backs off quickly, and creeps back up one step at a time once the link
+ * has been clear for a while, always within the negotiated range. */
+
+struct a2dp_bitpool {
+	uint8_t min;		/* negotiated min_bitpool */
+	uint8_t max;		/* negotiated max_bitpool */
+	uint8_t bitpool;	/* current bitpool */
+	int high;		/* queue level considered congested */
+	int low;		/* queue level considered clear */
+	int max_latency;	/* send latency considered congested in us */
+	int latency;		/* smoothed send latency in us */
+	int congested;		/* consecutive congested samples */
+	int clear;		/* consecutive clear samples */
+};
+
+void a2dp_bitpool_init(struct a2dp_bitpool *b, uint8_t min_bitpool,
+			uint8_t max_bitpool, int target, int max_latency);
+
+/* Feed one sample of queue level in bytes and send latency in us, returns
+ * non-zero if b->bitpool changed */
+int a2dp_bitpool_update(struct a2dp_bitpool *b, int queued, int latency);
+
+#endif /* BT_PACING_H */
@@ -43,14 +43,17 @@
 #include "ipc.h"
 #include "sbc.h"
 #include "rtp.h"
+#include "pacing.h"
 
 //#define ENABLE_DEBUG
 
-#define UINT_SECS_MAX (UINT_MAX / 1000000 - 1)
-
 #define MIN_PERIOD_TIME 1
 
+/* Number of packets we aim to keep queued in the stream socket */
+#define PACKET_QUEUE_TARGET 2
+
 #define BUFFER_SIZE 2048
+#define CARRY_SIZE 512		/* Largest SBC codesize: 16 blocks, 8 subbands, stereo */
 
 #ifdef ENABLE_DEBUG
 #define DBG(fmt, arg...)  printf("DEBUG: %s: " fmt "\n" , __FUNCTION__ , ## arg)
@@ -81,29 +84,24 @@
 #define MAX_BITPOOL 64
 #define MIN_BITPOOL 2
 
-/* adapted from glibc sys/time.h timersub() macro */
-#define priv_timespecsub(a, b, result)					\
-	do {								\
-		(result)->tv_sec = (a)->tv_sec - (b)->tv_sec;		\
-		(result)->tv_nsec = (a)->tv_nsec - (b)->tv_nsec;	\
-		if ((result)->tv_nsec < 0) {				\
-			--(result)->tv_sec;				\
-			(result)->tv_nsec += 1000000000;		\
-		}							\
-	} while (0)
-
 struct bluetooth_a2dp {
 	sbc_capabilities_t sbc_capabilities;
 	sbc_t sbc;				/* Codec data */
 	int sbc_initialized;			/* Keep track if the encoder is initialized */
 	unsigned int codesize;			/* SBC codesize */
 	int samples;				/* Number of encoded samples */
-	uint8_t buffer[BUFFER_SIZE];		/* Codec transfer buffer */
+	uint8_t buffer[A2DP_MAX_BATCH][BUFFER_SIZE];	/* Codec transfer buffers */
 	unsigned int count;			/* Codec transfer buffer counter */
+	uint8_t carry[CARRY_SIZE];		/* PCM short of a full codesize */
+	unsigned int carry_count;
+	struct iovec tx[A2DP_MAX_BATCH];	/* Packets waiting to be sent */
+	int tx_count;
 
 	int nsamples;				/* Cumulative number of codec samples */
 	uint16_t seq_num;			/* Cumulative packet sequence */
 	int frame_count;			/* Current frames in buffer*/
+	struct a2dp_bitpool bitpool;		/* Adapts bitpool to the link */
+	int bitpool_changed;			/* Apply on the next packet */
 };
 
 struct bluetooth_alsa_config {
@@ -139,6 +137,7 @@ struct bluetooth_data {
 	struct bluetooth_a2dp a2dp;			/* A2DP data */
 
 	pthread_t hw_thread;				/* Makes virtual hw pointer move */
+	struct a2dp_pacing pacing;			/* Period timer of hw thread */
 	int pipefd[2];					/* Inter thread communication */
 	int stopped;
 	sig_atomic_t reset;				/* Request XRUN handling */
@@ -165,52 +164,57 @@ static int bluetooth_stop(snd_pcm_ioplug_t *io)
 static void *playback_hw_thread(void *param)
 {
 	struct bluetooth_data *data = param;
-	unsigned int prev_periods;
-	double period_time;
-	struct timespec start;
-	struct pollfd fds[2];
-	int poll_timeout;
+	struct a2dp_pacing *pacing = &data->pacing;
+	unsigned int period_time;
+	struct pollfd fds[3];
+	int poll_timeout, nfds, stopped = 1;
 
 	data->server.events = POLLIN;
 	/* note: only errors for data->stream.events */
 
 	fds[0] = data->server;
 	fds[1] = data->stream;
+	fds[2].fd = pacing->fd;
+	fds[2].events = POLLIN;
+	nfds = pacing->fd >= 0 ? 3 : 2;
 
-	prev_periods = 0;
-	period_time = 1000000.0 * data->io.period_size / data->io.rate;
-	if (period_time > (int) (MIN_PERIOD_TIME * 1000))
-		poll_timeout = (int) (period_time / 1000.0f);
+	period_time = 1000000ULL * data->io.period_size / data->io.rate;
+	if (period_time > MIN_PERIOD_TIME * 1000)
+		poll_timeout = period_time / 1000;
 	else
 		poll_timeout = MIN_PERIOD_TIME;
 
-	clock_gettime(CLOCK_MONOTONIC, &start);
-
 	while (1) {
-		unsigned int dtime, periods;
-		struct timespec cur, delta;
-		int ret;
+		int ret, frags = 0;
 
-		if (data->stopped)
+		if (data->stopped) {
+			stopped = 1;
 			goto iter_sleep;
+		}
 
-		if (data->reset) {
+		if (data->reset || stopped) {
 			DBG("Handle XRUN in hw-thread.");
 			data->reset = 0;
-			clock_gettime(CLOCK_MONOTONIC, &start);
-			prev_periods = 0;
+			stopped = 0;
+			a2dp_pacing_start(pacing, data->stream.fd,
+					data->link_mtu * PACKET_QUEUE_TARGET);
+			a2dp_pacing_next(pacing, period_time);
 		}
 
-		clock_gettime(CLOCK_MONOTONIC, &cur);
+		/* Deadlines are absolute, so a late wakeup is made up for by
+		 * the next period instead of accumulating */
+		while (a2dp_pacing_expired(pacing)) {
+			frags++;
 
-		priv_timespecsub(&cur, &start, &delta);
+			if (data->transport == BT_CAPABILITIES_TRANSPORT_A2DP)
+				a2dp_pacing_update(pacing);
 
-		dtime = delta.tv_sec * 1000000 + delta.tv_nsec / 1000;
-		periods = 1.0 * dtime / period_time;
+			a2dp_pacing_next(pacing, period_time);
+		}
 
-		if (periods > prev_periods) {
+		if (frags > 0) {
 			char c = 'w';
-			int frags = periods - prev_periods, n;
+			int n;
 
 			data->hw_ptr += frags *	data->io.period_size;
 			data->hw_ptr %= data->io.buffer_size;
@@ -221,20 +225,17 @@ static void *playback_hw_thread(void *param)
 				if (write(data->pipefd[1], &c, 1) < 0)
 					pthread_testcancel();
 			}
-
-			/* Reset point of reference to avoid too big values
-			 * that wont fit an unsigned int */
-			if ((unsigned int) delta.tv_sec < UINT_SECS_MAX)
-				prev_periods = periods;
-			else {
-				prev_periods = 0;
-				clock_gettime(CLOCK_MONOTONIC, &start);
-			}
 		}
 
 iter_sleep:
-		/* sleep up to one period interval */
-		ret = poll(fds, 2, poll_timeout);
+		/* sleep until the next period is due, the timer is left
+		 * alone while stopped */
+		if (stopped)
+			ret = poll(fds, 2, poll_timeout);
+		else if (pacing->fd < 0)
+			ret = poll(fds, 2, a2dp_pacing_timeout(pacing));
+		else
+			ret = poll(fds, nfds, poll_timeout);
 
 		if (ret < 0) {
 			SNDERR("poll error: %s (%d)", strerror(errno), errno);
@@ -242,7 +243,11 @@ iter_sleep:
 				break;
 		} else if (ret > 0) {
 			ret = (fds[0].revents) ? 0 : 1;
-			SNDERR("poll fd %d revents %d", ret, fds[ret].revents);
+			if (ret == 1 && !fds[1].revents)
+				ret = 2;
+			if (ret < 2)
+				SNDERR("poll fd %d revents %d", ret,
+							fds[ret].revents);
 			if (fds[ret].revents & (POLLERR | POLLHUP | POLLNVAL))
 				break;
 		}
@@ -308,6 +313,8 @@ static void bluetooth_exit(struct bluetooth_data *data)
 	if (a2dp->sbc_initialized)
 		sbc_finish(&a2dp->sbc);
 
+	a2dp_pacing_close(&data->pacing);
+
 	if (data->pipefd[0] > 0)
 		close(data->pipefd[0]);
 
@@ -393,6 +400,23 @@ static int bluetooth_prepare(snd_pcm_ioplug_t *io)
 	}
 
 	if (data->transport == BT_CAPABILITIES_TRANSPORT_A2DP) {
+		struct bluetooth_a2dp *a2dp = &data->a2dp;
+		int frames;
+
+		/* Restart from the best quality the sink accepts */
+		a2dp->sbc.bitpool = a2dp->sbc_capabilities.max_bitpool;
+		a2dp->bitpool_changed = 0;
+		a2dp->carry_count = 0;
+		frames = (data->link_mtu - sizeof(struct rtp_header) -
+				sizeof(struct rtp_payload)) /
+				sbc_get_frame_length(&a2dp->sbc);
+		a2dp_bitpool_init(&a2dp->bitpool,
+				a2dp->sbc_capabilities.min_bitpool,
+				a2dp->sbc_capabilities.max_bitpool,
+				data->link_mtu * PACKET_QUEUE_TARGET,
+				MAX(frames, 1) *
+				sbc_get_frame_duration(&a2dp->sbc) / 2);
+
 		opt_name = (io->stream == SND_PCM_STREAM_PLAYBACK) ?
 						SO_SNDTIMEO : SO_RCVTIMEO;
 
@@ -681,7 +705,9 @@ static void bluetooth_a2dp_setup(struct bluetooth_a2dp *a2dp)
 
 	a2dp->sbc.bitpool = active_capabilities.max_bitpool;
 	a2dp->codesize = sbc_get_codesize(&a2dp->sbc);
-	a2dp->count = sizeof(struct rtp_header) + sizeof(struct rtp_payload);
+	a2dp->count = 0;
+	a2dp->carry_count = 0;
+	a2dp->tx_count = 0;
 }
 
 static int bluetooth_a2dp_hw_params(snd_pcm_ioplug_t *io,
@@ -964,38 +990,121 @@ static snd_pcm_sframes_t bluetooth_a2dp_read(snd_pcm_ioplug_t *io,
 	return ret;
 }
 
-static int avdtp_write(struct bluetooth_data *data)
+/* Send all packets queued by avdtp_write in a single batch */
+static int avdtp_flush(struct bluetooth_data *data)
 {
-	int ret = 0;
-	struct rtp_header *header;
-	struct rtp_payload *payload;
 	struct bluetooth_a2dp *a2dp = &data->a2dp;
+	int ret;
+
+	if (a2dp->tx_count == 0)
+		return 0;
+
+	ret = a2dp_send_packets(data->stream.fd, a2dp->tx, a2dp->tx_count,
+								MSG_DONTWAIT);
+	if (ret < 0) {
+		DBG("send returned %d errno %s.", ret, strerror(errno));
+		ret = -errno;
+	} else if (ret < a2dp->tx_count) {
+		DBG("only %d of %d packets sent", ret, a2dp->tx_count);
+		ret = -EAGAIN;
+	}
 
-	header = (void *) a2dp->buffer;
-	payload = (void *) (a2dp->buffer + sizeof(*header));
+	/* The socket is non-blocking, so a full send queue shows up as
+	 * EAGAIN rather than as send latency */
+	if (a2dp_bitpool_update(&a2dp->bitpool, data->pacing.queued,
+				ret == -EAGAIN ? 2 * a2dp->bitpool.max_latency : 0))
+		a2dp->bitpool_changed = 1;
 
-	memset(a2dp->buffer, 0, sizeof(*header) + sizeof(*payload));
+	a2dp->tx_count = 0;
+
+	return ret;
+}
+
+/* Open a packet in the next free slot. The RTP and payload headers are
+ * filled in up front so frames can be encoded straight behind them */
+static void avdtp_packet_begin(struct bluetooth_a2dp *a2dp)
+{
+	uint8_t *buffer = a2dp->buffer[a2dp->tx_count];
+	struct rtp_header *header = (void *) buffer;
+
+	memset(buffer, 0, sizeof(struct rtp_header) + sizeof(struct rtp_payload));
 
-	payload->frame_count = a2dp->frame_count;
 	header->v = 2;
 	header->pt = 1;
 	header->sequence_number = htons(a2dp->seq_num);
 	header->timestamp = htonl(a2dp->nsamples);
 	header->ssrc = htonl(1);
 
-	ret = send(data->stream.fd, a2dp->buffer, a2dp->count, MSG_DONTWAIT);
-	if (ret < 0) {
-		DBG("send returned %d errno %s.", ret, strerror(errno));
-		ret = -errno;
+	a2dp->count = sizeof(struct rtp_header) + sizeof(struct rtp_payload);
+
+	/* Frames of one packet must share a size, or the room check in
+	 * avdtp_encode can let a larger frame overflow the MTU */
+	if (a2dp->bitpool_changed) {
+		a2dp->sbc.bitpool = a2dp->bitpool.bitpool;
+		a2dp->bitpool_changed = 0;
+		DBG("bitpool %u", a2dp->sbc.bitpool);
 	}
+}
+
+/* Close the open packet and queue it for avdtp_flush */
+static int avdtp_write(struct bluetooth_data *data)
+{
+	struct bluetooth_a2dp *a2dp = &data->a2dp;
+	uint8_t *buffer = a2dp->buffer[a2dp->tx_count];
+	struct rtp_payload *payload;
+
+	payload = (void *) (buffer + sizeof(struct rtp_header));
+	payload->frame_count = a2dp->frame_count;
+
+	a2dp->tx[a2dp->tx_count].iov_base = buffer;
+	a2dp->tx[a2dp->tx_count].iov_len = a2dp->count;
+	a2dp->tx_count++;
 
 	/* Reset buffer of data to send */
-	a2dp->count = sizeof(struct rtp_header) + sizeof(struct rtp_payload);
+	a2dp->count = 0;
 	a2dp->frame_count = 0;
 	a2dp->samples = 0;
 	a2dp->seq_num++;
 
-	return ret;
+	if (a2dp->tx_count == A2DP_MAX_BATCH)
+		return avdtp_flush(data);
+
+	return 0;
+}
+
+/* Encode one codesize block of PCM into the open packet */
+static int avdtp_encode(struct bluetooth_data *data, const uint8_t *pcm,
+							int frame_size)
+{
+	struct bluetooth_a2dp *a2dp = &data->a2dp;
+	size_t written;
+	int encoded;
+
+	if (a2dp->count == 0)
+		avdtp_packet_begin(a2dp);
+
+	encoded = sbc_encode(&a2dp->sbc, pcm, a2dp->codesize,
+				a2dp->buffer[a2dp->tx_count] + a2dp->count,
+				BUFFER_SIZE - a2dp->count, &written);
+	if (encoded <= 0) {
+		DBG("Encoding error %d", encoded);
+		return encoded;
+	}
+
+	/* Increment a2dp buffers */
+	a2dp->count += written;
+	a2dp->frame_count++;
+	a2dp->samples += encoded / frame_size;
+	a2dp->nsamples += encoded / frame_size;
+
+	/* No space left for another frame then send */
+	if (a2dp->count + written >= data->link_mtu) {
+		DBG("sending packet %d, count %d, link_mtu %u",
+				a2dp->seq_num, a2dp->count, data->link_mtu);
+		avdtp_write(data);
+	}
+
+	return encoded;
 }
 
 static snd_pcm_sframes_t bluetooth_a2dp_write(snd_pcm_ioplug_t *io,
@@ -1006,8 +1115,7 @@ static snd_pcm_sframes_t bluetooth_a2dp_write(snd_pcm_ioplug_t *io,
 	struct bluetooth_a2dp *a2dp = &data->a2dp;
 	snd_pcm_sframes_t ret = 0;
 	unsigned int bytes_left;
-	int frame_size, encoded;
-	size_t written;
+	int frame_size;
 	uint8_t *buff;
 
 	DBG("areas->step=%u areas->first=%u offset=%lu size=%lu",
@@ -1049,87 +1157,45 @@ static snd_pcm_sframes_t bluetooth_a2dp_write(snd_pcm_ioplug_t *io,
 		snd_pcm_sw_params_free(swparams);
 	}
 
-	/* Check if we have any left over data from the last write */
-	if (data->count > 0 && (bytes_left - data->count) >= a2dp->codesize) {
-		int additional_bytes_needed = a2dp->codesize - data->count;
+	/* Complete the PCM left over from the last write first */
+	if (a2dp->carry_count > 0) {
+		unsigned int needed = a2dp->codesize - a2dp->carry_count;
 
-		memcpy(data->buffer + data->count, buff,
-						additional_bytes_needed);
+		if (needed > bytes_left)
+			needed = bytes_left;
 
-		/* Enough data to encode (sbc wants 1k blocks) */
-		encoded = sbc_encode(&a2dp->sbc, data->buffer, a2dp->codesize,
-					a2dp->buffer + a2dp->count,
-					sizeof(a2dp->buffer) - a2dp->count,
-								&written);
-		if (encoded <= 0) {
-			DBG("Encoding error %d", encoded);
-			goto done;
-		}
-
-		/* Increment a2dp buffers */
-		a2dp->count += written;
-		a2dp->frame_count++;
-		a2dp->samples += encoded / frame_size;
-		a2dp->nsamples += encoded / frame_size;
-
-		/* No space left for another frame then send */
-		if (a2dp->count + written >= data->link_mtu) {
-			avdtp_write(data);
-			DBG("sending packet %d, count %d, link_mtu %u",
-					a2dp->seq_num, a2dp->count,
-							data->link_mtu);
-		}
+		memcpy(a2dp->carry + a2dp->carry_count, buff, needed);
+		a2dp->carry_count += needed;
+		buff += needed;
+		bytes_left -= needed;
 
-		/* Increment up buff pointer to take into account
-		 * the data processed */
-		buff += additional_bytes_needed;
-		bytes_left -= additional_bytes_needed;
+		if (a2dp->carry_count < a2dp->codesize)
+			goto done;
 
-		/* Since data has been process mark it as zero */
-		data->count = 0;
+		a2dp->carry_count = 0;
+		if (avdtp_encode(data, a2dp->carry, frame_size) <= 0)
+			goto done;
 	}
 
-
 	/* Process this buffer in full chunks */
 	while (bytes_left >= a2dp->codesize) {
-		/* Enough data to encode (sbc wants 1k blocks) */
-		encoded = sbc_encode(&a2dp->sbc, buff, a2dp->codesize,
-					a2dp->buffer + a2dp->count,
-					sizeof(a2dp->buffer) - a2dp->count,
-								&written);
-		if (encoded <= 0) {
-			DBG("Encoding error %d", encoded);
+		if (avdtp_encode(data, buff, frame_size) <= 0)
 			goto done;
-		}
 
-		/* Increment up buff pointer to take into account
-		 * the data processed */
 		buff += a2dp->codesize;
 		bytes_left -= a2dp->codesize;
-
-		/* Increment a2dp buffers */
-		a2dp->count += written;
-		a2dp->frame_count++;
-		a2dp->samples += encoded / frame_size;
-		a2dp->nsamples += encoded / frame_size;
-
-		/* No space left for another frame then send */
-		if (a2dp->count + written >= data->link_mtu) {
-			avdtp_write(data);
-			DBG("sending packet %d, count %d, link_mtu %u",
-						a2dp->seq_num, a2dp->count,
-							data->link_mtu);
-		}
 	}
 
-	/* Copy the extra to our temp buffer for the next write */
+	/* Keep the tail for the next write */
 	if (bytes_left > 0) {
-		memcpy(data->buffer + data->count, buff, bytes_left);
-		data->count += bytes_left;
+		memcpy(a2dp->carry, buff, bytes_left);
+		a2dp->carry_count = bytes_left;
 		bytes_left = 0;
 	}
 
 done:
+	avdtp_flush(data);
+
 	DBG("returning %ld", size - bytes_left / frame_size);
 
 	return size - bytes_left / frame_size;
@@ -1651,6 +1717,8 @@ static int bluetooth_init(struct bluetooth_data *data,
 
 	memset(data, 0, sizeof(struct bluetooth_data));
 
+	a2dp_pacing_init(&data->pacing);
+
 	err = bluetooth_parse_config(conf, alsa_conf);
 	if (err < 0)
 		return err;
@@ -33,6 +33,7 @@
 #include <errno.h>
 #include <unistd.h>
 #include <stdint.h>
+#include <time.h>
 
 #include <bluetooth/bluetooth.h>
 #include <bluetooth/sdp.h>
@@ -49,6 +50,7 @@
 #include "sink.h"
 #include "gateway.h"
 #include "unix.h"
+#include "encoder.h"
 #include "glib-helper.h"
 
 #define check_nul(str) (str[sizeof(str) - 1] == '\0')
@@ -88,6 +90,10 @@ struct unix_client {
 	int data_fd; /* To be deleted once two phase configuration is fully implemented */
 	unsigned int req_id;
 	unsigned int cb_id;
+	struct timespec resume_start;	/* When the pending BT_START_STREAM or
+					 * BT_OPEN_STREAM arrived */
+	gboolean shared;	/* BT_FLAG_SHARED_PCM granted */
+	unsigned int ring_id;	/* Ring in the sink's a2dp_encoder */
 	gboolean (*cancel) (struct audio_device *dev, unsigned int id);
 };
 
@@ -484,20 +490,20 @@ static void print_sbc(struct sbc_codec_cap *sbc)
 		sbc->min_bitpool, sbc->max_bitpool);
 }
 
-static int a2dp_append_codec(struct bt_get_capabilities_rsp *rsp,
+static int a2dp_append_codec(bt_audio_msg_header_t *msg,
 				struct avdtp_service_capability *cap,
 				uint8_t seid,
 				uint8_t configured,
 				uint8_t lock)
 {
 	struct avdtp_media_codec_capability *codec_cap = (void *) cap->data;
-	codec_capabilities_t *codec = (void *) rsp + rsp->h.length;
+	codec_capabilities_t *codec = (void *) msg + msg->length;
 	size_t space_left;
 
-	if (rsp->h.length > BT_SUGGESTED_BUFFER_SIZE)
+	if (msg->length > BT_SUGGESTED_BUFFER_SIZE)
 		return -ENOMEM;
 
-	space_left = BT_SUGGESTED_BUFFER_SIZE - rsp->h.length;
+	space_left = BT_SUGGESTED_BUFFER_SIZE - msg->length;
 
 	/* endianess prevent direct cast */
 	if (codec_cap->media_codec_type == A2DP_CODEC_SBC) {
@@ -559,11 +565,11 @@ static int a2dp_append_codec(struct bt_get_capabilities_rsp *rsp,
 	codec->seid = seid;
 	codec->configured = configured;
 	codec->lock = lock;
-	rsp->h.length += codec->length;
+	msg->length += codec->length;
 
 	debug("Append %s seid %d - length %d - total %d",
 		configured ? "configured" : "", seid, codec->length,
-		rsp->h.length);
+		msg->length);
 
 	return 0;
 }
@@ -641,7 +647,7 @@ static void a2dp_discovery_complete(struct avdtp *session, GSList *seps,
 		if (sep && a2dp_sep_get_lock(sep))
 			lock = BT_WRITE_LOCK;
 
-		a2dp_append_codec(rsp, cap, seid, configured, lock);
+		a2dp_append_codec(&rsp->h, cap, seid, configured, lock);
 	}
 
 	unix_ipc_sendmsg(client, &rsp->h);
@@ -723,6 +729,17 @@ failed:
 	a2dp->sep = NULL;
 }
 
+/* Milliseconds since the pending stream request arrived */
+static long resume_elapsed(struct unix_client *client)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	return (now.tv_sec - client->resume_start.tv_sec) * 1000 +
+		(now.tv_nsec - client->resume_start.tv_nsec) / 1000000;
+}
+
 static void a2dp_resume_complete(struct avdtp *session,
 				struct avdtp_error *err, void *user_data)
 {
@@ -735,6 +752,8 @@ static void a2dp_resume_complete(struct avdtp *session,
 	if (err)
 		goto failed;
 
+	debug("A2DP resume took %ld ms", resume_elapsed(client));
+
 	memset(buf, 0, sizeof(buf));
 	rsp->h.type = BT_RESPONSE;
 	rsp->h.name = BT_START_STREAM;
@@ -812,6 +831,297 @@ failed:
 	a2dp->stream = NULL;
 }
 
+static void open_stream_failed(struct unix_client *client)
+{
+	struct a2dp_data *a2dp = &client->d.a2dp;
+
+	unix_ipc_error(client, BT_OPEN_STREAM, EIO);
+
+	if (client->cb_id > 0) {
+		avdtp_stream_remove_cb(a2dp->session, a2dp->stream,
+					client->cb_id);
+		client->cb_id = 0;
+	}
+
+	if (a2dp->sep) {
+		a2dp_sep_unlock(a2dp->sep, a2dp->session);
+		a2dp->sep = NULL;
+	}
+
+	avdtp_unref(a2dp->session);
+	a2dp->session = NULL;
+	a2dp->stream = NULL;
+}
+
+static int open_stream_reply(struct unix_client *client,
+				struct avdtp_stream *stream, uint16_t link_mtu,
+				int fd, uint8_t flags)
+{
+	char buf[BT_SUGGESTED_BUFFER_SIZE];
+	struct bt_open_stream_rsp *rsp = (void *) buf;
+	struct avdtp_service_capability *cap;
+
+	debug("A2DP open stream took %ld ms", resume_elapsed(client));
+
+	memset(buf, 0, sizeof(buf));
+	rsp->h.type = BT_RESPONSE;
+	rsp->h.name = BT_OPEN_STREAM;
+	rsp->h.length = sizeof(*rsp) - sizeof(rsp->codec);
+	rsp->link_mtu = link_mtu;
+	rsp->flags = flags;
+
+	cap = avdtp_stream_get_codec(stream);
+	if (a2dp_append_codec(&rsp->h, cap, client->seid, 1,
+							client->lock) < 0)
+		return -ENOMEM;
+
+	unix_ipc_sendmsg(client, &rsp->h);
+
+	if (unix_sendmsg_fd(client->sock, fd) < 0) {
+		error("unix_sendmsg_fd: %s(%d)", strerror(errno), errno);
+		return -errno;
+	}
+
+	return 0;
+}
+
+/* Whether the PCM the client will write fits the stream's configuration */
+static gboolean open_stream_compatible(struct unix_client *client,
+					struct avdtp_stream *stream)
+{
+	struct avdtp_service_capability *cap;
+	struct sbc_codec_cap *req, *cfg;
+
+	cap = g_slist_last(client->caps)->data;
+	req = (void *) cap->data;
+	cap = avdtp_stream_get_codec(stream);
+	cfg = (void *) cap->data;
+
+	if (req->cap.media_codec_type != A2DP_CODEC_SBC ||
+			cfg->cap.media_codec_type != A2DP_CODEC_SBC)
+		return FALSE;
+
+	if (!(req->frequency & cfg->frequency))
+		return FALSE;
+
+	return (req->channel_mode == SBC_CHANNEL_MODE_MONO) ==
+			(cfg->channel_mode == SBC_CHANNEL_MODE_MONO);
+}
+
+/* Hand the client a ring of the sink's in-daemon encoder */
+static void open_stream_join(struct unix_client *client,
+				struct a2dp_encoder *enc)
+{
+	struct avdtp_stream *stream = a2dp_encoder_get_stream(enc);
+	int fd;
+
+	if (!open_stream_compatible(client, stream)) {
+		error("open stream: PCM format differs from the shared stream");
+		unix_ipc_error(client, BT_OPEN_STREAM, EINVAL);
+		return;
+	}
+
+	client->ring_id = a2dp_encoder_attach(enc, &fd);
+	if (client->ring_id == 0) {
+		unix_ipc_error(client, BT_OPEN_STREAM, EIO);
+		return;
+	}
+
+	if (open_stream_reply(client, stream, 0, fd,
+					BT_FLAG_SHARED_PCM) < 0) {
+		a2dp_encoder_detach(client->ring_id);
+		client->ring_id = 0;
+	}
+
+	close(fd);
+}
+
+static void open_stream_started(struct avdtp *session,
+				struct avdtp_error *err, void *user_data)
+{
+	struct unix_client *client = user_data;
+	struct a2dp_data *a2dp = &client->d.a2dp;
+	struct a2dp_encoder *enc;
+	uint16_t imtu, omtu;
+	GSList *caps;
+
+	client->req_id = 0;
+
+	if (err)
+		goto failed;
+
+	if (client->shared) {
+		enc = a2dp_encoder_new(session, a2dp->sep, a2dp->stream);
+		if (enc) {
+			/* The encoder holds the lock from now on */
+			avdtp_stream_remove_cb(session, a2dp->stream,
+							client->cb_id);
+			client->cb_id = 0;
+			a2dp->sep = NULL;
+			a2dp->stream = NULL;
+
+			open_stream_join(client, enc);
+			return;
+		}
+
+		client->shared = FALSE;
+	}
+
+	if (!avdtp_stream_get_transport(a2dp->stream, &client->data_fd,
+						&imtu, &omtu, &caps)) {
+		error("Unable to get stream transport");
+		goto failed;
+	}
+
+	/* FIXME: Use imtu when fd_opt is CFG_FD_OPT_READ */
+	if (open_stream_reply(client, a2dp->stream, omtu, client->data_fd,
+								0) < 0)
+		goto failed;
+
+	return;
+
+failed:
+	error("open stream: resume failed");
+	open_stream_failed(client);
+}
+
+static void open_stream_configured(struct avdtp *session, struct a2dp_sep *sep,
+					struct avdtp_stream *stream,
+					struct avdtp_error *err,
+					void *user_data)
+{
+	struct unix_client *client = user_data;
+	struct a2dp_data *a2dp = &client->d.a2dp;
+	unsigned int id;
+
+	client->req_id = 0;
+
+	if (err || !stream)
+		goto failed;
+
+	if (client->cb_id > 0)
+		avdtp_stream_remove_cb(a2dp->session, a2dp->stream,
+								client->cb_id);
+
+	a2dp->sep = sep;
+	a2dp->stream = stream;
+
+	client->cb_id = avdtp_stream_add_cb(session, stream,
+						stream_state_changed, client);
+
+	id = a2dp_resume(session, sep, open_stream_started, client);
+	if (id == 0)
+		goto failed;
+
+	client->req_id = id;
+
+	return;
+
+failed:
+	error("open stream: config failed");
+	open_stream_failed(client);
+}
+
+/* Pick the remote sink to open: the one the client asked for, or the first
+ * unlocked one using the requested codec */
+static struct avdtp_remote_sep *open_stream_select(struct unix_client *client,
+							GSList *seps)
+{
+	struct avdtp_service_capability *media_codec;
+	struct avdtp_media_codec_capability *codec;
+	GSList *l;
+
+	if (client->seid != 0)
+		return avdtp_get_remote_sep(client->d.a2dp.session,
+							client->seid);
+
+	media_codec = g_slist_last(client->caps)->data;
+	codec = (void *) media_codec->data;
+
+	for (l = seps; l; l = g_slist_next(l)) {
+		struct avdtp_remote_sep *rsep = l->data;
+		struct avdtp_service_capability *cap;
+		struct avdtp_media_codec_capability *rcodec;
+		struct a2dp_sep *sep;
+
+		if (avdtp_get_type(rsep) != AVDTP_SEP_TYPE_SINK)
+			continue;
+
+		cap = avdtp_get_codec(rsep);
+		if (cap->category != AVDTP_MEDIA_CODEC)
+			continue;
+
+		rcodec = (void *) cap->data;
+		if (rcodec->media_codec_type != codec->media_codec_type)
+			continue;
+
+		sep = a2dp_get_sep(client->d.a2dp.session,
+						avdtp_get_stream(rsep));
+		if (sep && a2dp_sep_get_lock(sep))
+			continue;
+
+		return rsep;
+	}
+
+	return NULL;
+}
+
+static void open_stream_discovered(struct avdtp *session, GSList *seps,
+					struct avdtp_error *err,
+					void *user_data)
+{
+	struct unix_client *client = user_data;
+	struct a2dp_data *a2dp = &client->d.a2dp;
+	struct avdtp_remote_sep *rsep;
+	unsigned int id;
+
+	if (!g_slist_find(clients, client)) {
+		debug("Client disconnected during discovery");
+		return;
+	}
+
+	client->req_id = 0;
+
+	if (err)
+		goto failed;
+
+	rsep = open_stream_select(client, seps);
+	if (!rsep) {
+		error("No matching seid %d", client->seid);
+		goto failed;
+	}
+
+	client->seid = avdtp_get_seid(rsep);
+
+	a2dp->sep = a2dp_get(session, rsep);
+	if (!a2dp->sep) {
+		error("seid %d not available or locked", client->seid);
+		goto failed;
+	}
+
+	if (!a2dp_sep_lock(a2dp->sep, session)) {
+		error("Unable to open seid %d", client->seid);
+		a2dp->sep = NULL;
+		goto failed;
+	}
+
+	/* a2dp_config skips the reconfiguration when the stream already
+	 * matches, which is what a client replaying a cached one gets */
+	id = a2dp_config(session, a2dp->sep, open_stream_configured,
+						client->caps, client);
+	if (id == 0)
+		goto failed;
+
+	client->cancel = a2dp_cancel;
+	client->req_id = id;
+
+	return;
+
+failed:
+	error("open stream: discovery failed");
+	open_stream_failed(client);
+}
+
 static void start_discovery(struct audio_device *dev, struct unix_client *client)
 {
 	struct a2dp_data *a2dp;
@@ -1056,6 +1366,8 @@ static void start_resume(struct audio_device *dev, struct unix_client *client)
 			goto failed;
 		}
 
+		clock_gettime(CLOCK_MONOTONIC, &client->resume_start);
+
 		id = a2dp_resume(a2dp->session, a2dp->sep, a2dp_resume_complete,
 					client);
 		client->cancel = a2dp_cancel;
@@ -1127,6 +1439,16 @@ static void start_suspend(struct audio_device *dev, struct unix_client *client)
 			goto failed;
 		}
 
+		/* A shared stream is only suspended by the encoder, once its
+		 * last ring is gone */
+		if (client->ring_id) {
+			a2dp_encoder_detach(client->ring_id);
+			client->ring_id = 0;
+			a2dp_suspend_complete(a2dp->session, NULL, client);
+			id = 1;
+			break;
+		}
+
 		if (!a2dp->sep) {
 			error("Unable to get a sep");
 			goto failed;
@@ -1218,6 +1540,10 @@ static void start_close(struct audio_device *dev, struct unix_client *client,
 	case TYPE_SINK:
 		a2dp = &client->d.a2dp;
 
+		if (client->ring_id) {
+			a2dp_encoder_detach(client->ring_id);
+			client->ring_id = 0;
+		}
 		if (client->cb_id > 0)
 			avdtp_stream_remove_cb(a2dp->session, a2dp->stream,
 								client->cb_id);
@@ -1417,7 +1743,7 @@ static int handle_sco_transport(struct unix_client *client,
 }
 
 static int handle_a2dp_transport(struct unix_client *client,
-				struct bt_set_configuration_req *req)
+					codec_capabilities_t *codec)
 {
 	struct avdtp_service_capability *media_transport, *media_codec;
 	struct sbc_codec_cap sbc_cap;
@@ -1439,8 +1765,8 @@ static int handle_a2dp_transport(struct unix_client *client,
 
 	client->caps = g_slist_append(client->caps, media_transport);
 
-	if (req->codec.type == BT_A2DP_MPEG12_SINK) {
-		mpeg_capabilities_t *mpeg = (void *) &req->codec;
+	if (codec->type == BT_A2DP_MPEG12_SINK) {
+		mpeg_capabilities_t *mpeg = (void *) codec;
 
 		memset(&mpeg_cap, 0, sizeof(mpeg_cap));
 
@@ -1457,8 +1783,8 @@ static int handle_a2dp_transport(struct unix_client *client,
 							sizeof(mpeg_cap));
 
 		print_mpeg12(&mpeg_cap);
-	} else if (req->codec.type == BT_A2DP_SBC_SINK) {
-		sbc_capabilities_t *sbc = (void *) &req->codec;
+	} else if (codec->type == BT_A2DP_SBC_SINK) {
+		sbc_capabilities_t *sbc = (void *) codec;
 
 		memset(&sbc_cap, 0, sizeof(sbc_cap));
 
@@ -1505,7 +1831,7 @@ static void handle_setconfiguration_req(struct unix_client *client,
 			goto failed;
 		}
 	} else if (req->codec.transport == BT_CAPABILITIES_TRANSPORT_A2DP) {
-		err = handle_a2dp_transport(client, req);
+		err = handle_a2dp_transport(client, &req->codec);
 		if (err < 0) {
 			err = -err;
 			goto failed;
@@ -1577,6 +1903,116 @@ static void handle_control_req(struct unix_client *client,
 	unix_ipc_sendmsg(client, &rsp->h);
 }
 
+static void handle_openstream_req(struct unix_client *client,
+					struct bt_open_stream_req *req)
+{
+	struct audio_device *dev;
+	struct a2dp_data *a2dp = &client->d.a2dp;
+	struct a2dp_encoder *enc;
+	bdaddr_t src, dst;
+	int err = EIO;
+
+	if (!check_nul(req->source) || !check_nul(req->destination) ||
+			!check_nul(req->object)) {
+		err = EINVAL;
+		goto failed;
+	}
+
+	if (req->codec.transport != BT_CAPABILITIES_TRANSPORT_A2DP) {
+		err = EINVAL;
+		goto failed;
+	}
+
+	str2ba(req->source, &src);
+	str2ba(req->destination, &dst);
+
+	if (!client->interface)
+		client->interface = g_strdup(AUDIO_SINK_INTERFACE);
+	else if (!g_str_equal(client->interface, AUDIO_SINK_INTERFACE))
+		goto failed;
+
+	if (a2dp->sep) {
+		error("Client already has an opened session");
+		goto failed;
+	}
+
+	/* A closed ring is gone already, detaching it is harmless */
+	if (client->ring_id) {
+		a2dp_encoder_detach(client->ring_id);
+		client->ring_id = 0;
+	}
+
+	debug("open stream - object=%s source=%s destination=%s seid=%d",
+			strcmp(req->object, "") ? req->object : "ANY",
+			strcmp(req->source, "") ? req->source : "ANY",
+			strcmp(req->destination, "") ? req->destination : "ANY",
+			req->codec.seid);
+
+	if (!manager_find_device(req->object, &src, &dst, NULL, FALSE))
+		goto failed;
+
+	dev = manager_find_device(req->object, &src, &dst, client->interface,
+				TRUE);
+	if (!dev && (req->flags & BT_FLAG_AUTOCONNECT))
+		dev = manager_find_device(req->object, &src, &dst,
+					client->interface, FALSE);
+
+	if (!dev) {
+		error("Unable to find a matching device");
+		goto failed;
+	}
+
+	client->type = select_service(dev, client->interface);
+	if (client->type != TYPE_SINK) {
+		error("No matching service found");
+		goto failed;
+	}
+
+	err = handle_a2dp_transport(client, &req->codec);
+	if (err < 0) {
+		err = -err;
+		goto failed;
+	}
+
+	client->dev = dev;
+	client->seid = req->codec.seid;
+	client->lock = req->lock;
+
+	if (!a2dp->session)
+		a2dp->session = avdtp_get(&dev->src, &dev->dst);
+
+	if (!a2dp->session) {
+		error("Unable to get a session");
+		err = EIO;
+		goto failed;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &client->resume_start);
+
+	client->shared = (req->flags & BT_FLAG_SHARED_PCM) &&
+						a2dp_encoder_enabled();
+	if (client->shared) {
+		enc = a2dp_encoder_find(a2dp->session);
+		if (enc) {
+			open_stream_join(client, enc);
+			return;
+		}
+	}
+
+	err = avdtp_discover(a2dp->session, open_stream_discovered, client);
+	if (err < 0) {
+		avdtp_unref(a2dp->session);
+		a2dp->session = NULL;
+		err = -err;
+		goto failed;
+	}
+
+	return;
+
+failed:
+	unix_ipc_error(client, BT_OPEN_STREAM, err ? : EIO);
+}
+
 static gboolean client_cb(GIOChannel *chan, GIOCondition cond, gpointer data)
 {
 	char buf[BT_SUGGESTED_BUFFER_SIZE];
@@ -1641,6 +2077,10 @@ static gboolean client_cb(GIOChannel *chan, GIOCondition cond, gpointer data)
 		handle_control_req(client,
 				(struct bt_control_req *) msghdr);
 		break;
+	case BT_OPEN_STREAM:
+		handle_openstream_req(client,
+				(struct bt_open_stream_req *) msghdr);
+		break;
 	default:
 		error("Audio API: received unexpected message name %d",
 				msghdr->name);
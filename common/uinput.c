@@ -0,0 +1,152 @@
+/*
+ *
+ *  BlueZ - Bluetooth protocol stack for Linux
+ *
+ *  Copyright (C) 2004-2009  Marcel Holtmann <marcel@holtmann.org>
+ *
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "uinput.h"
+
+int uinput_create(const char *name, uint16_t vendor, uint16_t product,
+			unsigned long evbits, const unsigned int *keys,
+			int count)
+{
+	struct uinput_dev dev;
+	int fd, err, i;
+
+	fd = open("/dev/uinput", O_RDWR);
+	if (fd < 0) {
+		fd = open("/dev/input/uinput", O_RDWR);
+		if (fd < 0) {
+			fd = open("/dev/misc/uinput", O_RDWR);
+			if (fd < 0)
+				return -errno;
+		}
+	}
+
+	memset(&dev, 0, sizeof(dev));
+	if (name)
+		strncpy(dev.name, name, UINPUT_MAX_NAME_SIZE - 1);
+
+	dev.id.bustype = BUS_BLUETOOTH;
+	dev.id.vendor  = vendor;
+	dev.id.product = product;
+	dev.id.version = 0x0000;
+
+	if (write(fd, &dev, sizeof(dev)) < 0)
+		goto failed;
+
+	for (i = 0; i < EV_MAX; i++) {
+		if (!(evbits & (1UL << i)))
+			continue;
+
+		if (ioctl(fd, UI_SET_EVBIT, i) < 0)
+			goto failed;
+	}
+
+	for (i = 0; i < count; i++) {
+		if (keys[i] == KEY_RESERVED)
+			continue;
+
+		if (ioctl(fd, UI_SET_KEYBIT, keys[i]) < 0)
+			goto failed;
+	}
+
+	if (ioctl(fd, UI_DEV_CREATE, NULL) < 0)
+		goto failed;
+
+	return fd;
+
+failed:
+	err = errno;
+	close(fd);
+	errno = err;
+	return -err;
+}
+
+void uinput_batch_init(struct uinput_batch *batch, int fd)
+{
+	batch->fd = fd;
+	batch->count = 0;
+	gettimeofday(&batch->time, NULL);
+}
+
+int uinput_batch_flush(struct uinput_batch *batch)
+{
+	size_t len = batch->count * sizeof(struct uinput_event);
+	ssize_t ret;
+
+	if (batch->count == 0)
+		return 0;
+
+	batch->count = 0;
+
+	do {
+		ret = write(batch->fd, batch->events, len);
+	} while (ret < 0 && errno == EINTR);
+
+	if (ret < 0)
+		return -errno;
+
+	/* uinput takes whole events only, a short write means a bad fd */
+	if ((size_t) ret != len)
+		return -EIO;
+
+	return 0;
+}
+
+int uinput_batch_add(struct uinput_batch *batch, uint16_t type,
+				uint16_t code, int32_t value)
+{
+	struct uinput_event *event;
+
+	if (batch->count == UINPUT_BATCH_MAX) {
+		int err = uinput_batch_flush(batch);
+		if (err < 0)
+			return err;
+	}
+
+	event = &batch->events[batch->count++];
+	event->time = batch->time;
+	event->type = type;
+	event->code = code;
+	event->value = value;
+
+	return 0;
+}
+
+int uinput_batch_key(struct uinput_batch *batch, uint16_t key, int32_t value)
+{
+	int err;
+
+	err = uinput_batch_add(batch, EV_KEY, key, value);
+	if (err < 0)
+		return err;
+
+	return uinput_batch_add(batch, EV_SYN, SYN_REPORT, 0);
+}
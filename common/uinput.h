@@ -718,6 +718,32 @@ struct uinput_event {
 	int32_t value;
 };
 
+/* Helpers implemented in uinput.c, returning negative errno on failure */
+
+/* Open and register a Bluetooth uinput device. evbits is a mask of
+ * (1 << EV_*) bits, KEY_RESERVED entries of keys are skipped */
+int uinput_create(const char *name, uint16_t vendor, uint16_t product,
+			unsigned long evbits, const unsigned int *keys,
+			int count);
+
+#define UINPUT_BATCH_MAX	8
+
+/* Events written to the device with a single write(), all stamped with
+ * the time the batch was started */
+struct uinput_batch {
+	int fd;
+	int count;
+	struct timeval time;
+	struct uinput_event events[UINPUT_BATCH_MAX];
+};
+
+void uinput_batch_init(struct uinput_batch *batch, int fd);
+int uinput_batch_add(struct uinput_batch *batch, uint16_t type,
+				uint16_t code, int32_t value);
+/* Key event followed by its SYN_REPORT */
+int uinput_batch_key(struct uinput_batch *batch, uint16_t key, int32_t value);
+int uinput_batch_flush(struct uinput_batch *batch);
+
 #ifdef __cplusplus
 }
 #endif
@@ -30,6 +30,9 @@
 #include <unistd.h>
 #include <string.h>
 #include <signal.h>
+#include <time.h>
+#include <sys/poll.h>
+#include <sys/param.h>
 #include <sys/socket.h>
 
 #include <bluetooth/bluetooth.h>
@@ -50,6 +53,12 @@
 #define HCRP_STATUS_CREDIT_SYNC_ERROR	0x0002
 #define HCRP_STATUS_GENERIC_FAILURE	0xffff
 
+#define HCRP_SPOOL_SIZE			65536	/* spool file read size */
+#define HCRP_CREDIT_LOW			4	/* MTUs left when asking for more */
+#define HCRP_CREDIT_MIN_BACKOFF		20	/* ms */
+#define HCRP_CREDIT_MAX_BACKOFF		1000	/* ms */
+#define HCRP_CREDIT_TIMEOUT		300000UL	/* ms without credit */
+
 struct hcrp_pdu_hdr {
 	uint16_t pid;
 	uint16_t tid;
@@ -107,23 +116,46 @@ static int hcrp_credit_grant(int sk, uint16_t tid, uint32_t credit)
 	return 0;
 }
 
-static int hcrp_credit_request(int sk, uint16_t tid, uint32_t *credit)
+static int hcrp_credit_request_send(int sk, uint16_t tid)
 {
 	struct hcrp_pdu_hdr hdr;
-	struct hcrp_credit_request_rp rp;
-	unsigned char buf[128];
-	int len;
 
 	hdr.pid = htons(HCRP_PDU_CREDIT_REQUEST);
 	hdr.tid = htons(tid);
 	hdr.plen = htons(0);
-	memcpy(buf, &hdr, HCRP_PDU_HDR_SIZE);
-	len = write(sk, buf, HCRP_PDU_HDR_SIZE);
+
+	if (write(sk, &hdr, HCRP_PDU_HDR_SIZE) < 0)
+		return -1;
+
+	return 0;
+}
+
+/* Fails with EAGAIN for a reply to some other transaction */
+static int hcrp_credit_request_recv(int sk, uint16_t tid, uint32_t *credit)
+{
+	struct hcrp_pdu_hdr hdr;
+	struct hcrp_credit_request_rp rp;
+	unsigned char buf[128];
+	int len;
 
 	len = read(sk, buf, sizeof(buf));
+	if (len < 0)
+		return -1;
+
+	if (len < HCRP_PDU_HDR_SIZE + HCRP_CREDIT_REQUEST_RP_SIZE) {
+		errno = EIO;
+		return -1;
+	}
+
 	memcpy(&hdr, buf, HCRP_PDU_HDR_SIZE);
 	memcpy(&rp, buf + HCRP_PDU_HDR_SIZE, HCRP_CREDIT_REQUEST_RP_SIZE);
 
+	if (ntohs(hdr.pid) != HCRP_PDU_CREDIT_REQUEST ||
+						ntohs(hdr.tid) != tid) {
+		errno = EAGAIN;
+		return -1;
+	}
+
 	if (ntohs(rp.status) != HCRP_STATUS_SUCCESS) {
 		errno = EIO;
 		return -1;
@@ -171,17 +203,171 @@ static inline int hcrp_get_next_tid(int tid)
 		return tid + 1;
 }
 
+/* Print job state carried across copies, so that a credit request still
+ * in flight at the end of one copy is answered during the next */
+struct hcrp_sender {
+	int ctrl_sk;
+	int data_sk;
+	unsigned int mtu;
+	uint16_t tid;
+	uint32_t credit;
+	int pending;		/* credit request waiting for its reply */
+	int refused;		/* last request granted nothing */
+	int backoff;		/* current retry delay in ms */
+	int delayed;		/* waiting backoff out before asking again */
+	unsigned long starved;	/* when credit ran out in ms, 0 if it didn't */
+};
+
+static unsigned char spool[HCRP_SPOOL_SIZE];
+
+static unsigned long monotonic_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	/* Never 0, that means not starved */
+	return (ts.tv_sec * 1000 + ts.tv_nsec / 1000000) | 1;
+}
+
+static int hcrp_credit_reply(struct hcrp_sender *s)
+{
+	uint32_t credit;
+
+	if (hcrp_credit_request_recv(s->ctrl_sk, s->tid, &credit) < 0) {
+		if (errno == EAGAIN)
+			return 0;	/* Stale reply, keep waiting */
+		if (errno != EIO)
+			return -1;
+		credit = 0;
+	}
+
+	s->pending = 0;
+
+	if (credit > 0) {
+		s->credit += credit;
+		s->refused = 0;
+		s->backoff = 0;
+		s->starved = 0;
+		return 0;
+	}
+
+	s->refused = 1;
+
+	if (s->credit > 0)
+		return 0;
+
+	/* Nothing left to send with, retry with exponential backoff */
+	s->backoff = s->backoff ? MIN(s->backoff * 2, HCRP_CREDIT_MAX_BACKOFF) :
+						HCRP_CREDIT_MIN_BACKOFF;
+	s->delayed = 1;
+
+	if (!s->starved)
+		s->starved = monotonic_ms();
+
+	return 0;
+}
+
+/* Send the whole file, asking for credit before it runs out so that
+ * the grant arrives while data is still being written */
+static int hcrp_send_file(struct hcrp_sender *s, int fd)
+{
+	size_t start = 0, len = 0;
+	int eof = 0;
+
+	while (!eof || len > 0) {
+		struct pollfd p[2];
+		int n, timeout;
+
+		if (len == 0) {
+			ssize_t r = read(fd, spool, sizeof(spool));
+			if (r < 0 && errno == EINTR)
+				continue;
+			if (r <= 0) {
+				eof = 1;
+				continue;
+			}
+
+			start = 0;
+			len = r;
+		}
+
+		if (!s->pending && !s->delayed &&
+				s->credit < HCRP_CREDIT_LOW * s->mtu &&
+				(s->credit == 0 || !s->refused)) {
+			s->tid = hcrp_get_next_tid(s->tid);
+			if (hcrp_credit_request_send(s->ctrl_sk, s->tid) < 0)
+				return -errno;
+			s->pending = 1;
+		}
+
+		memset(p, 0, sizeof(p));
+		p[0].fd = s->ctrl_sk;
+		p[0].events = POLLIN;
+		n = 1;
+
+		if (s->credit > 0) {
+			p[1].fd = s->data_sk;
+			p[1].events = POLLOUT;
+			n = 2;
+		}
+
+		timeout = (!s->pending && s->delayed) ? s->backoff : -1;
+
+		if (poll(p, n, timeout) < 0) {
+			if (errno == EINTR)
+				continue;
+			return -errno;
+		}
+
+		if (timeout >= 0 && !p[0].revents && !p[1].revents) {
+			s->delayed = 0;
+
+			if (monotonic_ms() - s->starved >= HCRP_CREDIT_TIMEOUT)
+				return -ETIMEDOUT;
+
+			continue;
+		}
+
+		if ((p[0].revents | p[1].revents) & (POLLERR | POLLHUP))
+			return -ECONNRESET;
+
+		if (p[0].revents & POLLIN && hcrp_credit_reply(s) < 0)
+			return -errno;
+
+		if (p[1].revents & POLLOUT && s->credit > 0) {
+			size_t count = MIN(len, MIN(s->mtu, s->credit));
+			ssize_t w;
+
+			w = write(s->data_sk, spool + start, count);
+			if (w < 0) {
+				if (errno == EINTR || errno == EAGAIN)
+					continue;
+				return -errno;
+			}
+
+			if ((size_t) w != count)
+				fprintf(stderr, "ERROR: Can't send complete data\n");
+
+			start += w;
+			len -= w;
+			s->credit -= w;
+		}
+	}
+
+	return 0;
+}
+
 int hcrp_print(bdaddr_t *src, bdaddr_t *dst, unsigned short ctrl_psm, unsigned short data_psm, int fd, int copies, const char *cups_class)
 {
 	struct sockaddr_l2 addr;
 	struct l2cap_options opts;
 	socklen_t size;
-	unsigned char buf[2048];
-	int i, ctrl_sk, data_sk, count, len, timeout = 0;
+	struct hcrp_sender sender;
+	int i, err, ctrl_sk, data_sk;
 	unsigned int mtu;
 	uint8_t status;
 	uint16_t tid = 0;
-	uint32_t tmp, credit = 0;
 
 	if ((ctrl_sk = socket(PF_BLUETOOTH, SOCK_SEQPACKET, BTPROTO_L2CAP)) < 0) {
 		perror("ERROR: Can't create socket");
@@ -298,6 +484,12 @@ int hcrp_print(bdaddr_t *src, bdaddr_t *dst, unsigned short ctrl_psm, unsigned s
 			return CUPS_BACKEND_RETRY;
 	}
 
+	memset(&sender, 0, sizeof(sender));
+	sender.ctrl_sk = ctrl_sk;
+	sender.data_sk = data_sk;
+	sender.mtu = mtu;
+	sender.tid = tid;
+
 	for (i = 0; i < copies; i++) {
 
 		if (fd != 0) {
@@ -305,43 +497,21 @@ int hcrp_print(bdaddr_t *src, bdaddr_t *dst, unsigned short ctrl_psm, unsigned s
 			lseek(fd, 0, SEEK_SET);
 		}
 
-		while (1) {
-			if (credit < mtu) {
-				tid = hcrp_get_next_tid(tid);
-				if (!hcrp_credit_request(ctrl_sk, tid, &tmp)) {
-					credit += tmp;
-					timeout = 0;
-				}
-			}
-
-			if (!credit) {
-				if (timeout++ > 300) {
-					tid = hcrp_get_next_tid(tid);
-					if (!hcrp_get_lpt_status(ctrl_sk, tid, &status))
-						fprintf(stderr, "ERROR: LPT status 0x%02x\n", status);
-					break;
-				}
-
-				sleep(1);
-				continue;
-			}
-
-			count = read(fd, buf, (credit > mtu) ? mtu : credit);
-			if (count <= 0)
-				break;
-
-			len = write(data_sk, buf, count);
-			if (len < 0) {
-				perror("ERROR: Error writing to device");
-				close(data_sk);
-				close(ctrl_sk);
-				return CUPS_BACKEND_FAILED;
-			}
-
-			if (len != count)
-				fprintf(stderr, "ERROR: Can't send complete data\n");
-
-			credit -= len;
+		err = hcrp_send_file(&sender, fd);
+		if (err == -ETIMEDOUT) {
+			/* Only the reply to our own request can be pending */
+			tid = hcrp_get_next_tid(sender.tid);
+			if (!hcrp_get_lpt_status(ctrl_sk, tid, &status))
+				fprintf(stderr, "ERROR: LPT status 0x%02x\n", status);
+			sender.tid = tid;
+			sender.starved = 0;
+			sender.backoff = 0;
+		} else if (err < 0) {
+			errno = -err;
+			perror("ERROR: Error writing to device");
+			close(data_sk);
+			close(ctrl_sk);
+			return CUPS_BACKEND_FAILED;
 		}
 
 	}
@@ -38,11 +38,31 @@
 
 #include "cups.h"
 
+#define SPP_SPOOL_SIZE	65536	/* spool file read size */
+
+static unsigned char spool[SPP_SPOOL_SIZE];
+
+static int spp_write(int sk, const unsigned char *buf, size_t len)
+{
+	while (len > 0) {
+		ssize_t err = write(sk, buf, len);
+		if (err < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+
+		buf += err;
+		len -= err;
+	}
+
+	return 0;
+}
+
 int spp_print(bdaddr_t *src, bdaddr_t *dst, uint8_t channel, int fd, int copies, const char *cups_class)
 {
 	struct sockaddr_rc addr;
-	unsigned char buf[2048];
-	int i, sk, err, len;
+	int i, sk, len;
 
 	if ((sk = socket(PF_BLUETOOTH, SOCK_STREAM, BTPROTO_RFCOMM)) < 0) {
 		perror("ERROR: Can't create socket");
@@ -101,9 +121,8 @@ int spp_print(bdaddr_t *src, bdaddr_t *dst, uint8_t channel, int fd, int copies,
 			lseek(fd, 0, SEEK_SET);
 		}
 
-		while ((len = read(fd, buf, sizeof(buf))) > 0) {
-			err = write(sk, buf, len);
-			if (err < 0) {
+		while ((len = read(fd, spool, sizeof(spool))) > 0) {
+			if (spp_write(sk, spool, len) < 0) {
 				perror("ERROR: Error writing to device");
 				close(sk);
 				return CUPS_BACKEND_FAILED;
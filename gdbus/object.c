@@ -40,6 +40,7 @@
 struct generic_data {
 	unsigned int refcount;
 	GSList *interfaces;
+	GHashTable *interface_table;	/* name -> struct interface_data */
 	char *introspect;
 };
 
@@ -50,6 +51,8 @@ struct interface_data {
 	GDBusPropertyTable *properties;
 	void *user_data;
 	GDBusDestroyFunction destroy;
+	GHashTable *method_table;	/* member -> GSList of methods */
+	GHashTable *signal_table;	/* member -> GDBusSignalTable */
 };
 
 static void print_arguments(GString *gstr, const char *sig,
@@ -215,33 +218,84 @@ static void generic_unregister(DBusConnection *connection, void *user_data)
 {
 	struct generic_data *data = user_data;
 
+	g_hash_table_destroy(data->interface_table);
 	g_free(data->introspect);
 	g_free(data);
 }
 
-static struct interface_data *find_interface(GSList *interfaces,
+static struct interface_data *find_interface(struct generic_data *data,
 						const char *name)
+{
+	if (!name)
+		return NULL;
+
+	return g_hash_table_lookup(data->interface_table, name);
+}
+
+/* Methods sharing a member name are kept in table order, the first one
+ * with a matching signature wins */
+static GDBusMethodTable *find_method(struct interface_data *iface,
+					const char *member,
+					const char *signature)
 {
 	GSList *list;
 
-	if (!name)
+	if (!member || !signature)
 		return NULL;
 
-	for (list = interfaces; list; list = list->next) {
-		struct interface_data *iface = list->data;
-		if (!strcmp(name, iface->name))
-			return iface;
+	list = g_hash_table_lookup(iface->method_table, member);
+
+	for (; list; list = list->next) {
+		GDBusMethodTable *method = list->data;
+
+		if (!strcmp(method->signature, signature))
+			return method;
 	}
 
 	return NULL;
 }
 
+static void build_dispatch_tables(struct interface_data *iface)
+{
+	GDBusMethodTable *method;
+	GDBusSignalTable *signal;
+
+	iface->method_table = g_hash_table_new_full(g_str_hash, g_str_equal,
+					NULL, (GDestroyNotify) g_slist_free);
+	iface->signal_table = g_hash_table_new(g_str_hash, g_str_equal);
+
+	for (method = iface->methods; method &&
+			method->name && method->function; method++) {
+		GSList *list;
+
+		list = g_hash_table_lookup(iface->method_table, method->name);
+		if (list) {
+			/* Appending never moves the head */
+			g_slist_append(list, method);
+			continue;
+		}
+
+		g_hash_table_insert(iface->method_table, (char *) method->name,
+						g_slist_append(NULL, method));
+	}
+
+	for (signal = iface->signals; signal && signal->name; signal++) {
+		/* Keep the first entry, like the lookup by walking did */
+		if (g_hash_table_lookup(iface->signal_table, signal->name))
+			continue;
+
+		g_hash_table_insert(iface->signal_table, (char *) signal->name,
+								signal);
+	}
+}
+
 static DBusHandlerResult generic_message(DBusConnection *connection,
 					DBusMessage *message, void *user_data)
 {
 	struct generic_data *data = user_data;
 	struct interface_data *iface;
 	GDBusMethodTable *method;
+	DBusMessage *reply;
 	const char *interface;
 
 	if (dbus_message_is_method_call(message,
@@ -249,47 +303,40 @@ static DBusHandlerResult generic_message(DBusConnection *connection,
 								"Introspect"))
 		return introspect(connection, message, data);
 
+	if (dbus_message_get_type(message) != DBUS_MESSAGE_TYPE_METHOD_CALL)
+		return DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
+
 	interface = dbus_message_get_interface(message);
 
-	iface = find_interface(data->interfaces, interface);
+	iface = find_interface(data, interface);
 	if (!iface)
 		return DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
 
-	for (method = iface->methods; method &&
-			method->name && method->function; method++) {
-		DBusMessage *reply;
-
-		if (dbus_message_is_method_call(message, iface->name,
-							method->name) == FALSE)
-			continue;
-
-		if (dbus_message_has_signature(message,
-						method->signature) == FALSE)
-			continue;
-
-		reply = method->function(connection, message, iface->user_data);
+	method = find_method(iface, dbus_message_get_member(message),
+					dbus_message_get_signature(message));
+	if (!method)
+		return DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
 
-		if (method->flags & G_DBUS_METHOD_FLAG_NOREPLY) {
-			if (reply != NULL)
-				dbus_message_unref(reply);
-			return DBUS_HANDLER_RESULT_HANDLED;
-		}
+	reply = method->function(connection, message, iface->user_data);
 
-		if (method->flags & G_DBUS_METHOD_FLAG_ASYNC) {
-			if (reply == NULL)
-				return DBUS_HANDLER_RESULT_HANDLED;
-		}
+	if (method->flags & G_DBUS_METHOD_FLAG_NOREPLY) {
+		if (reply != NULL)
+			dbus_message_unref(reply);
+		return DBUS_HANDLER_RESULT_HANDLED;
+	}
 
+	if (method->flags & G_DBUS_METHOD_FLAG_ASYNC) {
 		if (reply == NULL)
-			return DBUS_HANDLER_RESULT_NEED_MEMORY;
+			return DBUS_HANDLER_RESULT_HANDLED;
+	}
 
-		dbus_connection_send(connection, reply, NULL);
-		dbus_message_unref(reply);
+	if (reply == NULL)
+		return DBUS_HANDLER_RESULT_NEED_MEMORY;
 
-		return DBUS_HANDLER_RESULT_HANDLED;
-	}
+	dbus_connection_send(connection, reply, NULL);
+	dbus_message_unref(reply);
 
-	return DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
+	return DBUS_HANDLER_RESULT_HANDLED;
 }
 
 static DBusObjectPathVTable generic_table = {
@@ -344,12 +391,15 @@ static struct generic_data *object_path_ref(DBusConnection *connection,
 
 	data = g_new0(struct generic_data, 1);
 
+	data->interface_table = g_hash_table_new(g_str_hash, g_str_equal);
+
 	data->introspect = g_strdup(DBUS_INTROSPECT_1_0_XML_DOCTYPE_DECL_NODE "<node></node>");
 
 	data->refcount = 1;
 
 	if (!dbus_connection_register_object_path(connection, path,
 						&generic_table, data)) {
+		g_hash_table_destroy(data->interface_table);
 		g_free(data->introspect);
 		g_free(data);
 		return NULL;
@@ -397,19 +447,16 @@ static gboolean check_signal(DBusConnection *conn, const char *path,
 		return FALSE;
 	}
 
-	iface = find_interface(data->interfaces, interface);
+	iface = find_interface(data, interface);
 	if (!iface) {
 		error("dbus_connection_emit_signal: %s does not implement %s",
 				path, interface);
 		return FALSE;
 	}
 
-	for (signal = iface->signals; signal && signal->name; signal++) {
-		if (!strcmp(signal->name, name)) {
-			*args = signal->signature;
-			break;
-		}
-	}
+	signal = g_hash_table_lookup(iface->signal_table, name);
+	if (signal)
+		*args = signal->signature;
 
 	if (!*args) {
 		error("No signal named %s on interface %s", name, interface);
@@ -474,7 +521,7 @@ gboolean g_dbus_register_interface(DBusConnection *connection,
 	if (data == NULL)
 		return FALSE;
 
-	if (find_interface(data->interfaces, name))
+	if (find_interface(data, name))
 		return FALSE;
 
 	iface = g_new0(struct interface_data, 1);
@@ -486,7 +533,10 @@ gboolean g_dbus_register_interface(DBusConnection *connection,
 	iface->user_data = user_data;
 	iface->destroy = destroy;
 
+	build_dispatch_tables(iface);
+
 	data->interfaces = g_slist_append(data->interfaces, iface);
+	g_hash_table_insert(data->interface_table, iface->name, iface);
 
 	g_free(data->introspect);
 	data->introspect = NULL;
@@ -510,15 +560,18 @@ gboolean g_dbus_unregister_interface(DBusConnection *connection,
 	if (data == NULL)
 		return FALSE;
 
-	iface = find_interface(data->interfaces, name);
+	iface = find_interface(data, name);
 	if (!iface)
 		return FALSE;
 
 	data->interfaces = g_slist_remove(data->interfaces, iface);
+	g_hash_table_remove(data->interface_table, iface->name);
 
 	if (iface->destroy)
 		iface->destroy(iface->user_data);
 
+	g_hash_table_destroy(iface->method_table);
+	g_hash_table_destroy(iface->signal_table);
 	g_free(iface->name);
 	g_free(iface);
 
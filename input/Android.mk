@@ -9,7 +9,8 @@ LOCAL_SRC_FILES:= \
 	fakehid.c \
 	main.c \
 	manager.c \
-	server.c
+	server.c \
+	../common/uinput.c
 
 LOCAL_CFLAGS:= \
 	-DVERSION=\"4.47\" \
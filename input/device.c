@@ -163,63 +163,10 @@ static void input_device_free(struct input_device *idev)
 	g_free(idev);
 }
 
-static int uinput_create(char *name)
-{
-	struct uinput_dev dev;
-	int fd, err;
-
-	fd = open("/dev/uinput", O_RDWR);
-	if (fd < 0) {
-		fd = open("/dev/input/uinput", O_RDWR);
-		if (fd < 0) {
-			fd = open("/dev/misc/uinput", O_RDWR);
-			if (fd < 0) {
-				err = errno;
-				error("Can't open input device: %s (%d)",
-							strerror(err), err);
-				return -err;
-			}
-		}
-	}
-
-	memset(&dev, 0, sizeof(dev));
-	if (name)
-		strncpy(dev.name, name, UINPUT_MAX_NAME_SIZE - 1);
-
-	dev.id.bustype = BUS_BLUETOOTH;
-	dev.id.vendor  = 0x0000;
-	dev.id.product = 0x0000;
-	dev.id.version = 0x0000;
-
-	if (write(fd, &dev, sizeof(dev)) < 0) {
-		err = errno;
-		error("Can't write device information: %s (%d)",
-						strerror(err), err);
-		close(fd);
-		errno = err;
-		return -err;
-	}
-
-	ioctl(fd, UI_SET_EVBIT, EV_KEY);
-	ioctl(fd, UI_SET_EVBIT, EV_REL);
-	ioctl(fd, UI_SET_EVBIT, EV_REP);
-
-	ioctl(fd, UI_SET_KEYBIT, KEY_UP);
-	ioctl(fd, UI_SET_KEYBIT, KEY_PAGEUP);
-	ioctl(fd, UI_SET_KEYBIT, KEY_DOWN);
-	ioctl(fd, UI_SET_KEYBIT, KEY_PAGEDOWN);
-
-	if (ioctl(fd, UI_DEV_CREATE, NULL) < 0) {
-		err = errno;
-		error("Can't create uinput device: %s (%d)",
-						strerror(err), err);
-		close(fd);
-		errno = err;
-		return -err;
-	}
-
-	return fd;
-}
+/* Gain changes are mapped to these, see decode_key() */
+static const unsigned int headset_keys[] = {
+	KEY_UP, KEY_PAGEUP, KEY_DOWN, KEY_PAGEDOWN
+};
 
 static int decode_key(const char *str)
 {
@@ -252,27 +199,15 @@ static int decode_key(const char *str)
 	return key;
 }
 
-static void send_event(int fd, uint16_t type, uint16_t code, int32_t value)
-{
-	struct uinput_event event;
-	int err;
-
-	memset(&event, 0, sizeof(event));
-	event.type	= type;
-	event.code	= code;
-	event.value	= value;
-
-	err = write(fd, &event, sizeof(event));
-}
-
 static void send_key(int fd, uint16_t key)
 {
-	/* Key press */
-	send_event(fd, EV_KEY, key, 1);
-	send_event(fd, EV_SYN, SYN_REPORT, 0);
-	/* Key release */
-	send_event(fd, EV_KEY, key, 0);
-	send_event(fd, EV_SYN, SYN_REPORT, 0);
+	struct uinput_batch batch;
+
+	/* Key press and release in one write */
+	uinput_batch_init(&batch, fd);
+	uinput_batch_key(&batch, key, 1);
+	uinput_batch_key(&batch, key, 0);
+	uinput_batch_flush(&batch);
 }
 
 static gboolean rfcomm_io_cb(GIOChannel *chan, GIOCondition cond, gpointer data)
@@ -365,11 +300,15 @@ static void rfcomm_connect_cb(GIOChannel *chan, GError *err, gpointer user_data)
 	 * FIXME: Some headsets required a sco connection
 	 * first to report volume gain key events
 	 */
-	fake->uinput = uinput_create(idev->name);
+	fake->uinput = uinput_create(idev->name, 0x0000, 0x0000,
+				(1 << EV_KEY) | (1 << EV_REL) | (1 << EV_REP),
+				headset_keys, G_N_ELEMENTS(headset_keys));
 	if (fake->uinput < 0) {
+		error("Can't create uinput device: %s (%d)",
+				strerror(-fake->uinput), -fake->uinput);
 		g_io_channel_shutdown(chan, TRUE, NULL);
 		reply = connection_attempt_failed(iconn->pending_connect,
-							strerror(errno));
+						strerror(-fake->uinput));
 		goto failed;
 	}
 
@@ -30,6 +30,7 @@
 #include <fcntl.h>
 #include <unistd.h>
 #include <stdlib.h>
+#include <string.h>
 #include <sys/types.h>
 
 #include <bluetooth/bluetooth.h>
@@ -213,8 +214,9 @@ static gboolean ps3remote_event(GIOChannel *chan, GIOCondition cond,
 				gpointer data)
 {
 	struct fake_input *fake = data;
-	struct uinput_event event;
+	struct uinput_batch batch;
 	unsigned int key, value = 0;
+	int err;
 	gsize size;
 	char buff[50];
 
@@ -241,22 +243,13 @@ static gboolean ps3remote_event(GIOChannel *chan, GIOCondition cond,
 	} else if (key == KEY_MAX)
 		return TRUE;
 
-	memset(&event, 0, sizeof(event));
-	gettimeofday(&event.time, NULL);
-	event.type = EV_KEY;
-	event.code = key;
-	event.value = value;
-	if (write(fake->uinput, &event, sizeof(event)) != sizeof(event)) {
-		error("Error writing to uinput device");
-		goto failed;
-	}
+	uinput_batch_init(&batch, fake->uinput);
+	uinput_batch_key(&batch, key, value);
 
-	memset(&event, 0, sizeof(event));
-	gettimeofday(&event.time, NULL);
-	event.type = EV_SYN;
-	event.code = SYN_REPORT;
-	if (write(fake->uinput, &event, sizeof(event)) != sizeof(event)) {
-		error("Error writing to uinput device");
+	err = uinput_batch_flush(&batch);
+	if (err < 0) {
+		error("Error writing to uinput device: %s (%d)",
+						strerror(-err), -err);
 		goto failed;
 	}
 
@@ -274,59 +267,17 @@ failed:
 static int ps3remote_setup_uinput(struct fake_input *fake,
 				  struct fake_hid *fake_hid)
 {
-	struct uinput_dev dev;
-	int i;
-
-	fake->uinput = open("/dev/input/uinput", O_RDWR);
+	fake->uinput = uinput_create("PS3 Remote Controller",
+					fake_hid->vendor, fake_hid->product,
+					1 << EV_KEY, ps3remote_keymap,
+					G_N_ELEMENTS(ps3remote_keymap));
 	if (fake->uinput < 0) {
-		fake->uinput = open("/dev/uinput", O_RDWR);
-		if (fake->uinput < 0) {
-			fake->uinput = open("/dev/misc/uinput", O_RDWR);
-			if (fake->uinput < 0) {
-				error("Error opening uinput device file");
-				return 1;
-			}
-		}
-	}
-
-	memset(&dev, 0, sizeof(dev));
-	snprintf(dev.name, sizeof(dev.name), "%s", "PS3 Remote Controller");
-	dev.id.bustype = BUS_BLUETOOTH;
-	dev.id.vendor = fake_hid->vendor;
-	dev.id.product = fake_hid->product;
-
-	if (write(fake->uinput, &dev, sizeof(dev)) != sizeof(dev)) {
-		error("Error creating uinput device");
-		goto err;
-	}
-
-	/* enabling key events */
-	if (ioctl(fake->uinput, UI_SET_EVBIT, EV_KEY) < 0) {
-		error("Error enabling uinput device key events");
-		goto err;
-	}
-
-	/* enabling keys */
-	for (i = 0; i < 256; i++)
-		if (ps3remote_keymap[i] != KEY_RESERVED)
-			if (ioctl(fake->uinput, UI_SET_KEYBIT,
-						ps3remote_keymap[i]) < 0) {
-				error("Error enabling uinput key %i",
-							ps3remote_keymap[i]);
-				goto err;
-			}
-
-	/* creating the device */
-	if (ioctl(fake->uinput, UI_DEV_CREATE) < 0) {
-		error("Error creating uinput device");
-		goto err;
+		error("Error creating uinput device: %s (%d)",
+				strerror(-fake->uinput), -fake->uinput);
+		return 1;
 	}
 
 	return 0;
-
-err:
-	close(fake->uinput);
-	return 1;
 }
 
 static gboolean fake_hid_common_connect(struct fake_input *fake, GError **err)
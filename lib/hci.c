@@ -1118,6 +1118,222 @@ done:
 	return 0;
 }
 
+/* Outstanding state of a request inside hci_send_req_batch() */
+#define BATCH_QUEUED	0
+#define BATCH_SENT	1
+#define BATCH_DONE	2
+#define BATCH_FAILED	3
+
+static int batch_find_sent(struct hci_request *r, uint8_t *state, int num,
+					uint16_t opcode, int event, void *ptr)
+{
+	int i;
+
+	for (i = 0; i < num; i++) {
+		if (state[i] != BATCH_SENT)
+			continue;
+
+		if (opcode && htobs(cmd_opcode_pack(r[i].ogf, r[i].ocf)) != opcode)
+			continue;
+
+		if (event && r[i].event != event)
+			continue;
+
+		if (event == EVT_REMOTE_NAME_REQ_COMPLETE) {
+			evt_remote_name_req_complete *rn = ptr;
+			remote_name_req_cp *cp = r[i].cparam;
+
+			if (bacmp(&rn->bdaddr, &cp->bdaddr))
+				continue;
+		}
+
+		return i;
+	}
+
+	return -1;
+}
+
+static void batch_complete(struct hci_request *r, void *ptr, int len)
+{
+	r->rlen = MIN(len, r->rlen);
+	memcpy(r->rparam, ptr, r->rlen);
+}
+
+/*
+ * Send several HCI commands and collect all of their completions in a
+ * single read loop. As many commands as the controller has announced
+ * through Num_HCI_Command_Packets are kept outstanding at any time, and
+ * the event filter is only changed once for the whole batch.
+ *
+ * Returns 0 when every command completed. Otherwise -1 is returned with
+ * errno set, and requests that failed or never completed have their
+ * rlen reset to zero.
+ */
+int hci_send_req_batch(int dd, struct hci_request *r, int num, int to)
+{
+	unsigned char buf[HCI_MAX_EVENT_SIZE], *ptr;
+	struct hci_filter nf, of;
+	socklen_t olen;
+	hci_event_hdr *hdr;
+	uint8_t *state;
+	int i, err, try, credits, sent, outstanding, completed, failed;
+
+	if (num <= 0)
+		return 0;
+
+	state = calloc(num, sizeof(uint8_t));
+	if (!state)
+		return -1;
+
+	olen = sizeof(of);
+	if (getsockopt(dd, SOL_HCI, HCI_FILTER, &of, &olen) < 0) {
+		free(state);
+		return -1;
+	}
+
+	hci_filter_clear(&nf);
+	hci_filter_set_ptype(HCI_EVENT_PKT,  &nf);
+	hci_filter_set_event(EVT_CMD_STATUS, &nf);
+	hci_filter_set_event(EVT_CMD_COMPLETE, &nf);
+	for (i = 0; i < num; i++)
+		if (r[i].event)
+			hci_filter_set_event(r[i].event, &nf);
+	if (setsockopt(dd, SOL_HCI, HCI_FILTER, &nf, sizeof(nf)) < 0) {
+		free(state);
+		return -1;
+	}
+
+	credits = 1;
+	sent = outstanding = completed = failed = 0;
+	try = 10 * num;
+
+	while (completed < num) {
+		evt_cmd_complete *cc;
+		evt_cmd_status *cs;
+		int len, n;
+
+		/* Never stall when nothing is left to return credits */
+		if (outstanding == 0 && credits == 0)
+			credits = 1;
+
+		while (sent < num && credits > 0) {
+			if (hci_send_cmd(dd, r[sent].ogf, r[sent].ocf,
+						r[sent].clen, r[sent].cparam) < 0)
+				goto failed;
+
+			state[sent++] = BATCH_SENT;
+			outstanding++;
+			credits--;
+		}
+
+		if (try-- <= 0) {
+			errno = ETIMEDOUT;
+			goto failed;
+		}
+
+		if (to) {
+			struct pollfd p;
+
+			p.fd = dd; p.events = POLLIN;
+			while ((n = poll(&p, 1, to)) < 0) {
+				if (errno == EAGAIN || errno == EINTR)
+					continue;
+				goto failed;
+			}
+
+			if (!n) {
+				errno = ETIMEDOUT;
+				goto failed;
+			}
+
+			to -= 10;
+			if (to < 0) to = 0;
+		}
+
+		while ((len = read(dd, buf, sizeof(buf))) < 0) {
+			if (errno == EAGAIN || errno == EINTR)
+				continue;
+			goto failed;
+		}
+
+		hdr = (void *) (buf + 1);
+		ptr = buf + (1 + HCI_EVENT_HDR_SIZE);
+		len -= (1 + HCI_EVENT_HDR_SIZE);
+
+		switch (hdr->evt) {
+		case EVT_CMD_STATUS:
+			cs = (void *) ptr;
+			credits = cs->ncmd;
+
+			i = batch_find_sent(r, state, num, cs->opcode, 0, NULL);
+			if (i < 0)
+				continue;
+
+			if (r[i].event != EVT_CMD_STATUS) {
+				if (cs->status) {
+					state[i] = BATCH_FAILED;
+					r[i].rlen = 0;
+					outstanding--;
+					completed++;
+					failed++;
+				}
+				continue;
+			}
+
+			batch_complete(&r[i], ptr, len);
+			break;
+
+		case EVT_CMD_COMPLETE:
+			cc = (void *) ptr;
+			credits = cc->ncmd;
+
+			i = batch_find_sent(r, state, num, cc->opcode, 0, NULL);
+			if (i < 0)
+				continue;
+
+			ptr += EVT_CMD_COMPLETE_SIZE;
+			len -= EVT_CMD_COMPLETE_SIZE;
+
+			batch_complete(&r[i], ptr, len);
+			break;
+
+		default:
+			i = batch_find_sent(r, state, num, 0, hdr->evt, ptr);
+			if (i < 0)
+				continue;
+
+			batch_complete(&r[i], ptr, len);
+			break;
+		}
+
+		if (state[i] == BATCH_SENT) {
+			state[i] = BATCH_DONE;
+			outstanding--;
+			completed++;
+		}
+	}
+
+	setsockopt(dd, SOL_HCI, HCI_FILTER, &of, sizeof(of));
+	free(state);
+
+	if (failed) {
+		errno = EIO;
+		return -1;
+	}
+
+	return 0;
+
+failed:
+	err = errno;
+	for (i = 0; i < num; i++)
+		if (state[i] != BATCH_DONE)
+			r[i].rlen = 0;
+	setsockopt(dd, SOL_HCI, HCI_FILTER, &of, sizeof(of));
+	free(state);
+	errno = err;
+	return -1;
+}
+
 int hci_create_connection(int dd, const bdaddr_t *bdaddr, uint16_t ptype, uint16_t clkoffset, uint8_t rswitch, uint16_t *handle, int to)
 {
 	evt_conn_complete rp;
@@ -87,8 +87,12 @@ static void at_child_exit(void)
 static void configure_device(int index)
 {
 	struct hci_dev_info di;
+	struct hci_request rq[4];
+	change_local_name_cp name_cp;
+	write_class_of_dev_cp class_cp;
+	write_page_timeout_cp pageto_cp;
 	uint16_t policy;
-	int dd;
+	int dd, i, num = 0;
 
 	if (hci_devinfo(index, &di) < 0)
 		return;
@@ -103,52 +107,75 @@ static void configure_device(int index)
 		return;
 	}
 
+	memset(rq, 0, sizeof(rq));
+
 	/* Set device name */
 	if ((main_opts.flags & (1 << HCID_SET_NAME)) && main_opts.name) {
-		change_local_name_cp cp;
-
-		memset(cp.name, 0, sizeof(cp.name));
-		expand_name((char *) cp.name, sizeof(cp.name),
+		memset(name_cp.name, 0, sizeof(name_cp.name));
+		expand_name((char *) name_cp.name, sizeof(name_cp.name),
 						main_opts.name, index);
 
-		hci_send_cmd(dd, OGF_HOST_CTL, OCF_CHANGE_LOCAL_NAME,
-					CHANGE_LOCAL_NAME_CP_SIZE, &cp);
+		rq[num].ogf    = OGF_HOST_CTL;
+		rq[num].ocf    = OCF_CHANGE_LOCAL_NAME;
+		rq[num].cparam = &name_cp;
+		rq[num].clen   = CHANGE_LOCAL_NAME_CP_SIZE;
+		num++;
 	}
 
 	/* Set device class */
 	if ((main_opts.flags & (1 << HCID_SET_CLASS))) {
-		write_class_of_dev_cp cp;
 		uint32_t class;
 		uint8_t cls[3];
 
 		if (read_local_class(&di.bdaddr, cls) < 0) {
 			class = htobl(main_opts.class);
 			cls[2] = get_service_classes(&di.bdaddr);
-			memcpy(cp.dev_class, &class, 3);
+			memcpy(class_cp.dev_class, &class, 3);
 		} else {
 			if (!(main_opts.scan & SCAN_INQUIRY))
 				cls[1] &= 0xdf; /* Clear discoverable bit */
 			cls[2] = get_service_classes(&di.bdaddr);
-			memcpy(cp.dev_class, cls, 3);
+			memcpy(class_cp.dev_class, cls, 3);
 		}
 
-		hci_send_cmd(dd, OGF_HOST_CTL, OCF_WRITE_CLASS_OF_DEV,
-					WRITE_CLASS_OF_DEV_CP_SIZE, &cp);
+		rq[num].ogf    = OGF_HOST_CTL;
+		rq[num].ocf    = OCF_WRITE_CLASS_OF_DEV;
+		rq[num].cparam = &class_cp;
+		rq[num].clen   = WRITE_CLASS_OF_DEV_CP_SIZE;
+		num++;
 	}
 
 	/* Set page timeout */
 	if ((main_opts.flags & (1 << HCID_SET_PAGETO))) {
-		write_page_timeout_cp cp;
+		pageto_cp.timeout = htobs(main_opts.pageto);
 
-		cp.timeout = htobs(main_opts.pageto);
-		hci_send_cmd(dd, OGF_HOST_CTL, OCF_WRITE_PAGE_TIMEOUT,
-					WRITE_PAGE_TIMEOUT_CP_SIZE, &cp);
+		rq[num].ogf    = OGF_HOST_CTL;
+		rq[num].ocf    = OCF_WRITE_PAGE_TIMEOUT;
+		rq[num].cparam = &pageto_cp;
+		rq[num].clen   = WRITE_PAGE_TIMEOUT_CP_SIZE;
+		num++;
 	}
 
 	/* Set default link policy */
 	policy = htobs(main_opts.link_policy);
-	hci_send_cmd(dd, OGF_LINK_POLICY,
-				OCF_WRITE_DEFAULT_LINK_POLICY, 2, &policy);
+
+	rq[num].ogf    = OGF_LINK_POLICY;
+	rq[num].ocf    = OCF_WRITE_DEFAULT_LINK_POLICY;
+	rq[num].cparam = &policy;
+	rq[num].clen   = 2;
+	num++;
+
+	/* This runs in the main loop and nothing looks at the command
+	 * status, so queue the whole batch without waiting for it. The
+	 * kernel paces the commands to the controller */
+	for (i = 0; i < num; i++) {
+		if (hci_send_cmd(dd, rq[i].ogf, rq[i].ocf, rq[i].clen,
+							rq[i].cparam) < 0) {
+			error("Can't configure device hci%d: %s (%d)",
+						index, strerror(errno), errno);
+			break;
+		}
+	}
 
 	hci_close_dev(dd);
 }
@@ -273,6 +300,11 @@ static void device_event(int event, int index)
 		manager_stop_adapter(index);
 		stop_security_manager(index);
 		break;
+
+	default:
+		/* Keep the security manager's device info snapshot fresh */
+		update_security_manager(index);
+		break;
 	}
 }
 
@@ -659,7 +691,8 @@ static int hciops_stop_discovery(int index)
 	return err;
 }
 
-static int hciops_resolve_name(int index, bdaddr_t *bdaddr)
+static int hciops_resolve_name(int index, bdaddr_t *bdaddr,
+				uint8_t pscan_rep_mode, uint16_t clock_offset)
 {
 	remote_name_req_cp cp;
 	int dd, err = 0;
@@ -670,7 +703,8 @@ static int hciops_resolve_name(int index, bdaddr_t *bdaddr)
 
 	memset(&cp, 0, sizeof(cp));
 	bacpy(&cp.bdaddr, bdaddr);
-	cp.pscan_rep_mode = 0x02;
+	cp.pscan_rep_mode = pscan_rep_mode;
+	cp.clock_offset = htobs(clock_offset);
 
 	err = hci_send_cmd(dd, OGF_LINK_CTL, OCF_REMOTE_NAME_REQ,
 					REMOTE_NAME_REQ_CP_SIZE, &cp);
@@ -1054,6 +1054,27 @@ ssize_t sbc_decode(sbc_t *sbc, const void *input, size_t input_len,
 	return framelen;
 }
 
+static size_t sbc_calc_frame_length(sbc_t *sbc)
+{
+	int ret;
+	uint8_t subbands, channels, blocks, joint, bitpool;
+
+	subbands = sbc->subbands ? 8 : 4;
+	blocks = 4 + (sbc->blocks * 4);
+	channels = sbc->mode == SBC_MODE_MONO ? 1 : 2;
+	joint = sbc->mode == SBC_MODE_JOINT_STEREO ? 1 : 0;
+	bitpool = sbc->bitpool;
+
+	ret = 4 + (4 * subbands * channels) / 8;
+	/* This term is not always evenly divide so we round it up */
+	if (channels == 1)
+		ret += ((blocks * channels * bitpool) + 7) / 8;
+	else
+		ret += (((joint ? subbands : 0) + blocks * bitpool) + 7) / 8;
+
+	return ret;
+}
+
 ssize_t sbc_encode(sbc_t *sbc, const void *input, size_t input_len,
 			void *output, size_t output_len, size_t *written)
 {
@@ -1086,6 +1107,11 @@ ssize_t sbc_encode(sbc_t *sbc, const void *input, size_t input_len,
 
 		sbc_encoder_init(&priv->enc_state, &priv->frame);
 		priv->init = 1;
+	} else if (priv->frame.bitpool != sbc->bitpool) {
+		/* bitpool may change between frames without resetting the
+		 * encoder state, e.g. to follow the link quality */
+		priv->frame.bitpool = sbc->bitpool;
+		priv->frame.length = sbc_calc_frame_length(sbc);
 	}
 
 	/* input must be large enough to encode a complete frame */
@@ -1145,28 +1171,13 @@ void sbc_finish(sbc_t *sbc)
 
 size_t sbc_get_frame_length(sbc_t *sbc)
 {
-	int ret;
-	uint8_t subbands, channels, blocks, joint, bitpool;
 	struct sbc_priv *priv;
 
 	priv = sbc->priv;
-	if (priv->init)
+	if (priv->init && priv->frame.bitpool == sbc->bitpool)
 		return priv->frame.length;
 
-	subbands = sbc->subbands ? 8 : 4;
-	blocks = 4 + (sbc->blocks * 4);
-	channels = sbc->mode == SBC_MODE_MONO ? 1 : 2;
-	joint = sbc->mode == SBC_MODE_JOINT_STEREO ? 1 : 0;
-	bitpool = sbc->bitpool;
-
-	ret = 4 + (4 * subbands * channels) / 8;
-	/* This term is not always evenly divide so we round it up */
-	if (channels == 1)
-		ret += ((blocks * channels * bitpool) + 7) / 8;
-	else
-		ret += (((joint ? subbands : 0) + blocks * bitpool) + 7) / 8;
-
-	return ret;
+	return sbc_calc_frame_length(sbc);
 }
 
 unsigned sbc_get_frame_duration(sbc_t *sbc)
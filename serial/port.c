@@ -33,6 +33,7 @@
 #include <termios.h>
 #include <unistd.h>
 #include <sys/ioctl.h>
+#include <sys/inotify.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
@@ -62,6 +63,7 @@
 
 #define MAX_OPEN_TRIES		5
 #define OPEN_WAIT		300	/* ms. udev node creation retry wait */
+#define DEV_DIR			"/dev"
 
 struct serial_device {
 	DBusConnection	*conn;		/* for name listener handling */
@@ -79,6 +81,10 @@ struct serial_port {
 	char		*dev;		/* RFCOMM device name */
 	int		fd;		/* Opened file descriptor */
 	GIOChannel	*io;		/* BtIO channel */
+	GIOChannel	*notify_io;	/* inotify on DEV_DIR while opening */
+	guint		notify_watch;
+	guint		open_timer;	/* fallback open retries */
+	int		open_tries;
 	guint		listener_id;
 	struct serial_device *device;
 };
@@ -137,6 +143,24 @@ static struct serial_port *find_port(GSList *ports, const char *pattern)
 	return NULL;
 }
 
+static void port_open_cancel(struct serial_port *port)
+{
+	if (port->notify_watch) {
+		g_source_remove(port->notify_watch);
+		port->notify_watch = 0;
+	}
+
+	if (port->notify_io) {
+		g_io_channel_unref(port->notify_io);
+		port->notify_io = NULL;
+	}
+
+	if (port->open_timer) {
+		g_source_remove(port->open_timer);
+		port->open_timer = 0;
+	}
+}
+
 static int port_release(struct serial_port *port)
 {
 	struct rfcomm_dev_req req;
@@ -157,6 +181,8 @@ static int port_release(struct serial_port *port)
 
 	debug("Serial port %s released", port->dev);
 
+	port_open_cancel(port);
+
 	rfcomm_ctl = socket(AF_BLUETOOTH, SOCK_RAW, BTPROTO_RFCOMM);
 	if (rfcomm_ctl < 0)
 		return -errno;
@@ -276,32 +302,119 @@ static void open_notify(int fd, int err, struct serial_port *port)
 	g_dbus_send_message(device->conn, reply);
 }
 
+/* Returns TRUE once the open is over, successful or not */
+static gboolean port_try_open(struct serial_port *port, gboolean last)
+{
+	int fd, err;
+
+	fd = open(port->dev, O_RDONLY | O_NOCTTY);
+	if (fd >= 0) {
+		port_open_cancel(port);
+		open_notify(fd, 0, port);
+		return TRUE;
+	}
+
+	err = errno;
+
+	/* Node not there yet or its permissions not set up yet */
+	if (!last && (err == ENOENT || err == ENXIO || err == EACCES))
+		return FALSE;
+
+	error("Could not open %s: %s (%d)", port->dev, strerror(err), err);
+
+	port_open_cancel(port);
+	open_notify(fd, err, port);
+
+	return TRUE;
+}
+
 static gboolean open_continue(gpointer user_data)
 {
 	struct serial_port *port = user_data;
-	int fd;
-	static int ntries = MAX_OPEN_TRIES;
 
-	if (!port->listener_id)
-		return FALSE; /* Owner exited */
+	if (!port->listener_id) {
+		/* Owner exited */
+		port->open_timer = 0;
+		port_open_cancel(port);
+		return FALSE;
+	}
 
-	fd = open(port->dev, O_RDONLY | O_NOCTTY);
-	if (fd < 0) {
-		int err = errno;
-		error("Could not open %s: %s (%d)",
-				port->dev, strerror(err), err);
-		if (!--ntries) {
-			/* Reporting error */
-			open_notify(fd, err, port);
-			ntries = MAX_OPEN_TRIES;
-			return FALSE;
-		}
+	if (port_try_open(port, --port->open_tries == 0))
+		return FALSE;
+
+	return TRUE;
+}
+
+static gboolean dev_notify_cb(GIOChannel *chan, GIOCondition cond,
+							gpointer user_data)
+{
+	struct serial_port *port = user_data;
+	/* inotify events are read in place */
+	char buf[1024]
+		__attribute__((aligned(__alignof__(struct inotify_event))));
+	const char *name;
+	gboolean found = FALSE;
+	ssize_t len, off;
+
+	if (cond & (G_IO_ERR | G_IO_HUP | G_IO_NVAL)) {
+		/* Keep on with the retry timer alone */
+		port->notify_watch = 0;
+		g_io_channel_unref(port->notify_io);
+		port->notify_io = NULL;
+		return FALSE;
+	}
+
+	len = read(g_io_channel_unix_get_fd(chan), buf, sizeof(buf));
+	if (len <= 0)
+		return TRUE;
+
+	name = port->dev + sizeof(DEV_DIR);
+
+	for (off = 0; off + (ssize_t) sizeof(struct inotify_event) <= len;) {
+		struct inotify_event *ev = (void *) &buf[off];
+
+		if (ev->len > 0 && !strcmp(ev->name, name))
+			found = TRUE;
+
+		off += sizeof(struct inotify_event) + ev->len;
+	}
+
+	if (!found || !port->listener_id)
 		return TRUE;
+
+	if (port_try_open(port, FALSE)) {
+		/* port_open_cancel() already removed this watch */
+		return FALSE;
 	}
 
-	/* Connection succeeded */
-	open_notify(fd, 0, port);
-	return FALSE;
+	return TRUE;
+}
+
+/* Wake up as soon as udev creates the node or fixes its permissions,
+ * instead of waiting for the next retry */
+static void port_watch_dev(struct serial_port *port)
+{
+	int fd;
+
+	fd = inotify_init();
+	if (fd < 0) {
+		error("inotify_init: %s (%d)", strerror(errno), errno);
+		return;
+	}
+
+	if (inotify_add_watch(fd, DEV_DIR, IN_CREATE | IN_ATTRIB |
+							IN_MOVED_TO) < 0) {
+		error("inotify_add_watch(%s): %s (%d)", DEV_DIR,
+						strerror(errno), errno);
+		close(fd);
+		return;
+	}
+
+	port->notify_io = g_io_channel_unix_new(fd);
+	g_io_channel_set_close_on_unref(port->notify_io, TRUE);
+	port->notify_watch = g_io_add_watch(port->notify_io,
+				G_IO_IN | G_IO_ERR | G_IO_HUP | G_IO_NVAL,
+				dev_notify_cb, port);
 }
 
 static int port_open(struct serial_port *port)
@@ -309,12 +422,22 @@ static int port_open(struct serial_port *port)
 	int fd;
 
 	fd = open(port->dev, O_RDONLY | O_NOCTTY);
-	if (fd < 0) {
-		g_timeout_add(OPEN_WAIT, open_continue, port);
-		return -EINPROGRESS;
+	if (fd >= 0)
+		return fd;
+
+	port_watch_dev(port);
+
+	/* The node may have shown up before the watch was added */
+	fd = open(port->dev, O_RDONLY | O_NOCTTY);
+	if (fd >= 0) {
+		port_open_cancel(port);
+		return fd;
 	}
 
-	return fd;
+	port->open_tries = MAX_OPEN_TRIES;
+	port->open_timer = g_timeout_add(OPEN_WAIT, open_continue, port);
+
+	return -EINPROGRESS;
 }
 
 static void rfcomm_connect_cb(GIOChannel *chan, GError *conn_err,
@@ -25,6 +25,7 @@
 #include <config.h>
 #endif
 
+#define _GNU_SOURCE
 #include <ctype.h>
 #include <dirent.h>
 #include <errno.h>
@@ -71,7 +72,10 @@
 
 #define SERIAL_PROXY_INTERFACE	"org.bluez.SerialProxy"
 #define SERIAL_MANAGER_INTERFACE "org.bluez.SerialProxyManager"
-#define BUF_SIZE		1024
+
+/* Bytes moved per read, doubled while the source fills it up */
+#define FORWARD_MIN_CHUNK	4096
+#define FORWARD_MAX_CHUNK	65536
 
 typedef enum {
 	TTY_PROXY,
@@ -86,6 +90,24 @@ struct serial_adapter {
 	GSList			*proxies;	/* Proxies list */
 };
 
+struct serial_proxy;
+
+/* One direction of a proxy connection. Data goes through a pipe with
+ * splice() when the kernel supports it, through a buffer otherwise */
+struct forward {
+	struct serial_proxy *prx;
+	GIOChannel	*src;
+	GIOChannel	*dst;
+	guint		src_watch;
+	guint		dst_watch;
+	int		pipe[2];
+	char		*buf;
+	size_t		buf_size;
+	size_t		start;		/* Unwritten data offset in buf */
+	size_t		queued;		/* Bytes read but not yet written */
+	size_t		chunk;		/* Current read size */
+};
+
 struct serial_proxy {
 	bdaddr_t	src;		/* Local address */
 	bdaddr_t	dst;		/* Remote address */
@@ -103,25 +125,18 @@ struct serial_proxy {
 	GIOChannel	*io;		/* Server listen */
 	GIOChannel	*rfcomm;	/* Remote RFCOMM channel*/
 	GIOChannel	*local;		/* Local channel: TTY or Unix socket */
+	struct forward	fwd[2];		/* RFCOMM to local and back */
 	struct serial_adapter *adapter;	/* Adapter pointer */
 };
 
 static GSList *adapters = NULL;
 static int sk_counter = 0;
 
+static void proxy_disconnect(struct serial_proxy *prx);
+
 static void disable_proxy(struct serial_proxy *prx)
 {
-	if (prx->rfcomm) {
-		g_io_channel_shutdown(prx->rfcomm, TRUE, NULL);
-		g_io_channel_unref(prx->rfcomm);
-		prx->rfcomm = NULL;
-	}
-
-	if (prx->local) {
-		g_io_channel_shutdown(prx->local, TRUE, NULL);
-		g_io_channel_unref(prx->local);
-		prx->local = NULL;
-	}
+	proxy_disconnect(prx);
 
 	remove_record_from_server(prx->record_id);
 	prx->record_id = 0;
@@ -228,72 +243,261 @@ static sdp_record_t *proxy_record_new(const char *uuid128, uint8_t channel)
 	return record;
 }
 
-static GIOError channel_write(GIOChannel *chan, char *buf, size_t size)
+static void forward_stop(struct forward *fwd)
 {
-	GIOError err = G_IO_ERROR_NONE;
-	gsize wbytes, written;
+	/* Never started */
+	if (!fwd->prx)
+		return;
 
-	wbytes = written = 0;
-	while (wbytes < size) {
-		err = g_io_channel_write(chan,
-				buf + wbytes,
-				size - wbytes,
-				&written);
+	if (fwd->src_watch) {
+		g_source_remove(fwd->src_watch);
+		fwd->src_watch = 0;
+	}
 
-		if (err != G_IO_ERROR_NONE)
-			return err;
+	if (fwd->dst_watch) {
+		g_source_remove(fwd->dst_watch);
+		fwd->dst_watch = 0;
+	}
 
-		wbytes += written;
+	if (fwd->pipe[0] >= 0) {
+		close(fwd->pipe[0]);
+		close(fwd->pipe[1]);
+		fwd->pipe[0] = fwd->pipe[1] = -1;
 	}
 
-	return err;
+	g_free(fwd->buf);
+	memset(fwd, 0, sizeof(*fwd));
 }
 
-static gboolean forward_data(GIOChannel *chan, GIOCondition cond, gpointer data)
+static void proxy_disconnect(struct serial_proxy *prx)
 {
-	char buf[BUF_SIZE];
-	struct serial_proxy *prx = data;
-	GIOChannel *dest;
-	GIOError err;
-	size_t rbytes;
-
-	if (cond & G_IO_NVAL)
-		return FALSE;
-
-	dest = (chan == prx->rfcomm) ? prx->local : prx->rfcomm;
-
-	if (cond & (G_IO_HUP | G_IO_ERR)) {
-		/* Try forward remaining data */
-		do {
-			rbytes = 0;
-			err = g_io_channel_read(chan, buf, sizeof(buf), &rbytes);
-			if (err != G_IO_ERROR_NONE || rbytes == 0)
-				break;
-
-			err = channel_write(dest, buf, rbytes);
-		} while (err == G_IO_ERROR_NONE);
+	forward_stop(&prx->fwd[0]);
+	forward_stop(&prx->fwd[1]);
 
+	if (prx->local) {
 		g_io_channel_shutdown(prx->local, TRUE, NULL);
 		g_io_channel_unref(prx->local);
 		prx->local = NULL;
+	}
 
+	if (prx->rfcomm) {
 		g_io_channel_shutdown(prx->rfcomm, TRUE, NULL);
 		g_io_channel_unref(prx->rfcomm);
 		prx->rfcomm = NULL;
+	}
+}
+
+static void forward_grow(struct forward *fwd, size_t size)
+{
+	if (fwd->buf_size >= size)
+		return;
+
+	fwd->buf = g_realloc(fwd->buf, size);
+	fwd->buf_size = size;
+}
 
+/* Not every kernel can splice from or to every kind of descriptor.
+ * Move whatever is in the pipe to the buffer and stop using it */
+static int forward_drop_pipe(struct forward *fwd)
+{
+	size_t len = 0;
+	ssize_t n;
+
+	forward_grow(fwd, MAX(fwd->queued, fwd->chunk));
+
+	while (len < fwd->queued) {
+		n = read(fwd->pipe[0], fwd->buf + len, fwd->queued - len);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return -EIO;
+
+		len += n;
+	}
+
+	close(fwd->pipe[0]);
+	close(fwd->pipe[1]);
+	fwd->pipe[0] = fwd->pipe[1] = -1;
+	fwd->start = 0;
+
+	return 0;
+}
+
+/* Returns 0 once everything queued is written, -EAGAIN when the
+ * destination is full and -errno on failure */
+static int forward_flush(struct forward *fwd)
+{
+	int fd = g_io_channel_unix_get_fd(fwd->dst);
+	ssize_t n;
+
+	while (fwd->queued > 0) {
+#ifdef SPLICE_F_NONBLOCK
+		if (fwd->pipe[0] >= 0) {
+			n = splice(fwd->pipe[0], NULL, fd, NULL, fwd->queued,
+					SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+			if (n < 0 && errno == EINVAL) {
+				if (forward_drop_pipe(fwd) < 0)
+					return -EIO;
+				continue;
+			}
+		} else
+#endif
+			n = write(fd, fwd->buf + fwd->start, fwd->queued);
+
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			return -errno;
+		}
+
+		fwd->queued -= n;
+		if (fwd->pipe[0] < 0)
+			fwd->start += n;
+	}
+
+	fwd->start = 0;
+
+	return 0;
+}
+
+/* Returns the number of bytes queued, 0 on end of file or -errno */
+static ssize_t forward_fill(struct forward *fwd)
+{
+	int fd = g_io_channel_unix_get_fd(fwd->src);
+	ssize_t n;
+
+#ifdef SPLICE_F_NONBLOCK
+	if (fwd->pipe[0] >= 0) {
+		n = splice(fd, NULL, fwd->pipe[1], NULL, fwd->chunk,
+					SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+		if (n >= 0 || (errno != EINVAL && errno != ENOSYS))
+			goto done;
+
+		/* The pipe is empty, nothing to move over */
+		forward_drop_pipe(fwd);
+	}
+#endif
+
+	forward_grow(fwd, fwd->chunk);
+	n = read(fd, fwd->buf, fwd->chunk);
+
+#ifdef SPLICE_F_NONBLOCK
+done:
+#endif
+	if (n < 0)
+		return -errno;
+
+	/* Full reads mean the source keeps up, read more at once */
+	if ((size_t) n == fwd->chunk && fwd->chunk < FORWARD_MAX_CHUNK)
+		fwd->chunk *= 2;
+
+	fwd->queued = n;
+
+	return n;
+}
+
+static gboolean forward_src_cb(GIOChannel *chan, GIOCondition cond,
+							gpointer data);
+
+static gboolean forward_dst_cb(GIOChannel *chan, GIOCondition cond,
+							gpointer data)
+{
+	struct forward *fwd = data;
+	int err;
+
+	if (cond & G_IO_NVAL)
+		return FALSE;
+
+	if (cond & (G_IO_HUP | G_IO_ERR)) {
+		fwd->dst_watch = 0;
+		proxy_disconnect(fwd->prx);
+		return FALSE;
+	}
+
+	err = forward_flush(fwd);
+	if (err == -EAGAIN)
+		return TRUE;
+
+	fwd->dst_watch = 0;
+
+	if (err < 0) {
+		error("Serial proxy: write failed: %s (%d)",
+						strerror(-err), -err);
+		proxy_disconnect(fwd->prx);
 		return FALSE;
 	}
 
-	rbytes = 0;
-	err = g_io_channel_read(chan, buf, sizeof(buf), &rbytes);
-	if (err != G_IO_ERROR_NONE)
+	/* Drained, listen to the source again */
+	fwd->src_watch = g_io_add_watch(fwd->src,
+				G_IO_IN | G_IO_HUP | G_IO_ERR | G_IO_NVAL,
+				forward_src_cb, fwd);
+
+	return FALSE;
+}
+
+static gboolean forward_src_cb(GIOChannel *chan, GIOCondition cond,
+							gpointer data)
+{
+	struct forward *fwd = data;
+	ssize_t n;
+	int err;
+
+	if (cond & G_IO_NVAL)
 		return FALSE;
 
-	err = channel_write(dest, buf, rbytes);
-	if (err != G_IO_ERROR_NONE)
+	/* On hang up keep forwarding until the source runs dry */
+	n = forward_fill(fwd);
+	if (n == -EAGAIN && !(cond & (G_IO_HUP | G_IO_ERR)))
+		return TRUE;
+
+	if (n <= 0) {
+		fwd->src_watch = 0;
+		proxy_disconnect(fwd->prx);
 		return FALSE;
+	}
+
+	err = forward_flush(fwd);
+	if (err == 0)
+		return TRUE;
 
-	return TRUE;
+	fwd->src_watch = 0;
+
+	if (err != -EAGAIN) {
+		error("Serial proxy: write failed: %s (%d)",
+						strerror(-err), -err);
+		proxy_disconnect(fwd->prx);
+		return FALSE;
+	}
+
+	/* The destination is full, stop reading until it drains */
+	fwd->dst_watch = g_io_add_watch(fwd->dst,
+				G_IO_OUT | G_IO_HUP | G_IO_ERR | G_IO_NVAL,
+				forward_dst_cb, fwd);
+
+	return FALSE;
+}
+
+static void forward_start(struct serial_proxy *prx, struct forward *fwd,
+					GIOChannel *src, GIOChannel *dst)
+{
+	memset(fwd, 0, sizeof(*fwd));
+
+	fwd->prx = prx;
+	fwd->src = src;
+	fwd->dst = dst;
+	fwd->chunk = FORWARD_MIN_CHUNK;
+	fwd->pipe[0] = fwd->pipe[1] = -1;
+
+#ifdef SPLICE_F_NONBLOCK
+	if (pipe(fwd->pipe) < 0) {
+		error("Serial proxy: pipe: %s (%d)", strerror(errno), errno);
+		fwd->pipe[0] = fwd->pipe[1] = -1;
+	}
+#endif
+
+	fwd->src_watch = g_io_add_watch(src,
+				G_IO_IN | G_IO_HUP | G_IO_ERR | G_IO_NVAL,
+				forward_src_cb, fwd);
 }
 
 static inline int unix_socket_connect(const char *address)
@@ -427,15 +631,16 @@ static void connect_event_cb(GIOChannel *chan, GError *conn_err, gpointer data)
 	if (sk < 0)
 		goto drop;
 
-	prx->local = g_io_channel_unix_new(sk);
+	/* A slow side must not block the main loop */
+	fcntl(sk, F_SETFL, fcntl(sk, F_GETFL) | O_NONBLOCK);
+	fcntl(g_io_channel_unix_get_fd(prx->rfcomm), F_SETFL,
+		fcntl(g_io_channel_unix_get_fd(prx->rfcomm), F_GETFL) |
+								O_NONBLOCK);
 
-	g_io_add_watch(prx->rfcomm,
-			G_IO_IN | G_IO_HUP | G_IO_ERR | G_IO_NVAL,
-			forward_data, prx);
+	prx->local = g_io_channel_unix_new(sk);
 
-	g_io_add_watch(prx->local,
-			G_IO_IN | G_IO_HUP | G_IO_ERR | G_IO_NVAL,
-			forward_data, prx);
+	forward_start(prx, &prx->fwd[0], prx->rfcomm, prx->local);
+	forward_start(prx, &prx->fwd[1], prx->local, prx->rfcomm);
 
 	return;
 
@@ -32,6 +32,7 @@
 #include <fcntl.h>
 #include <unistd.h>
 #include <stdlib.h>
+#include <time.h>
 #include <sys/ioctl.h>
 
 #include <bluetooth/bluetooth.h>
@@ -213,14 +214,44 @@ static void dev_info_free(struct remote_dev_info *dev)
 {
 	g_free(dev->name);
 	g_free(dev->alias);
+	g_free(dev->eir);
 	g_free(dev);
 }
 
+static void dev_info_store(struct btd_adapter *adapter,
+				struct remote_dev_info *dev)
+{
+	if (dev->store & STORE_CLASS)
+		write_remote_class(&adapter->bdaddr, &dev->bdaddr, dev->class);
+
+	if ((dev->store & STORE_EIR) && dev->eir)
+		write_remote_eir(&adapter->bdaddr, &dev->bdaddr, dev->eir);
+
+	if ((dev->store & STORE_NAME) && dev->name)
+		write_device_name(&adapter->bdaddr, &dev->bdaddr, dev->name);
+
+	if (dev->store & STORE_LASTSEEN)
+		write_lastseen_info(&adapter->bdaddr, &dev->bdaddr,
+						gmtime(&dev->lastseen));
+
+	dev->store = 0;
+}
+
 void clear_found_devices_list(struct btd_adapter *adapter)
 {
+	GSList *l;
+
 	if (!adapter->found_devices)
 		return;
 
+	/* Discovery is over, throttled DeviceFound signals are dropped */
+	for (l = adapter->found_devices; l; l = l->next) {
+		struct remote_dev_info *dev = l->data;
+
+		if (dev->store)
+			dev_info_store(adapter, dev);
+	}
+
 	g_slist_foreach(adapter->found_devices, (GFunc) dev_info_free, NULL);
 	g_slist_free(adapter->found_devices);
 	adapter->found_devices = NULL;
@@ -315,16 +346,42 @@ int pending_remote_name_cancel(struct btd_adapter *adapter)
 	return err;
 }
 
+static int dev_rssi_cmp(struct remote_dev_info *d1, struct remote_dev_info *d2);
+
+/* Peers the user already knows go first, then the strongest signal */
+static int name_request_cmp(struct remote_dev_info *d1,
+				struct remote_dev_info *d2)
+{
+	if (d1->recent != d2->recent)
+		return d1->recent ? -1 : 1;
+
+	return dev_rssi_cmp(d1, d2);
+}
+
+static struct remote_dev_info *next_name_request(struct btd_adapter *adapter)
+{
+	struct remote_dev_info *best = NULL;
+	GSList *l;
+
+	for (l = adapter->found_devices; l; l = l->next) {
+		struct remote_dev_info *dev = l->data;
+
+		if (dev->name_status != NAME_REQUIRED)
+			continue;
+
+		if (!best || name_request_cmp(dev, best) < 0)
+			best = dev;
+	}
+
+	return best;
+}
+
 int adapter_resolve_names(struct btd_adapter *adapter)
 {
-	struct remote_dev_info *dev, match;
+	struct remote_dev_info *dev;
 	int err;
 
-	memset(&match, 0, sizeof(struct remote_dev_info));
-	bacpy(&match.bdaddr, BDADDR_ANY);
-	match.name_status = NAME_REQUIRED;
-
-	dev = adapter_search_found_devices(adapter, &match);
+	dev = next_name_request(adapter);
 	if (!dev)
 		return -ENODATA;
 
@@ -333,7 +390,9 @@ int adapter_resolve_names(struct btd_adapter *adapter)
 		/* flag to indicate the current remote name requested */
 		dev->name_status = NAME_REQUESTED;
 
-		err = adapter_ops->resolve_name(adapter->dev_id, &dev->bdaddr);
+		err = adapter_ops->resolve_name(adapter->dev_id, &dev->bdaddr,
+						dev->pscan_rep_mode,
+						dev->clock_offset);
 
 		if (!err)
 			break;
@@ -346,12 +405,38 @@ int adapter_resolve_names(struct btd_adapter *adapter)
 		adapter_remove_found_device(adapter, &dev->bdaddr);
 
 		/* get the next element */
-		dev = adapter_search_found_devices(adapter, &match);
+		dev = next_name_request(adapter);
 	} while (dev);
 
 	return err;
 }
 
+int adapter_cancel_resolve_name(struct btd_adapter *adapter, bdaddr_t *bdaddr)
+{
+	struct remote_dev_info *dev, match;
+
+	memset(&match, 0, sizeof(struct remote_dev_info));
+	bacpy(&match.bdaddr, bdaddr);
+	match.name_status = NAME_ANY;
+
+	dev = adapter_search_found_devices(adapter, &match);
+	if (!dev)
+		return -ENODATA;
+
+	switch (dev->name_status) {
+	case NAME_REQUIRED:
+		/* Not sent yet, just drop it from the schedule */
+		dev->name_status = NAME_NOT_REQUIRED;
+		return 0;
+	case NAME_REQUESTED:
+		/* The remote name complete event resumes the schedule */
+		return adapter_ops->cancel_resolve_name(adapter->dev_id,
+								bdaddr);
+	default:
+		return -ENODATA;
+	}
+}
+
 static const char *mode2str(uint8_t mode)
 {
 	switch(mode) {
@@ -1439,6 +1524,7 @@ static DBusMessage *create_device(DBusConnection *conn,
 	struct btd_adapter *adapter = data;
 	struct btd_device *device;
 	const gchar *address;
+	bdaddr_t bdaddr;
 
 	if (dbus_message_get_args(msg, NULL, DBUS_TYPE_STRING, &address,
 						DBUS_TYPE_INVALID) == FALSE)
@@ -1458,6 +1544,10 @@ static DBusMessage *create_device(DBusConnection *conn,
 	if (!device)
 		return NULL;
 
+	/* The connection is going to fetch the name anyway */
+	device_get_address(device, &bdaddr);
+	adapter_cancel_resolve_name(adapter, &bdaddr);
+
 	device_browse(device, conn, msg, NULL, FALSE);
 
 	return NULL;
@@ -1484,6 +1574,7 @@ static DBusMessage *create_paired_device(DBusConnection *conn,
 	struct btd_adapter *adapter = data;
 	struct btd_device *device;
 	const gchar *address, *agent_path, *capability, *sender;
+	bdaddr_t bdaddr;
 	uint8_t cap;
 
 	if (dbus_message_get_args(msg, NULL, DBUS_TYPE_STRING, &address,
@@ -1512,6 +1603,9 @@ static DBusMessage *create_paired_device(DBusConnection *conn,
 				ERROR_INTERFACE ".Failed",
 				"Unable to create a new device object");
 
+	device_get_address(device, &bdaddr);
+	adapter_cancel_resolve_name(adapter, &bdaddr);
+
 	return device_create_bonding(device, conn, msg, agent_path, cap);
 }
 
@@ -1857,8 +1951,11 @@ static int adapter_setup(struct btd_adapter *adapter)
 {
 	struct hci_dev *dev = &adapter->dev;
 	uint8_t events[8] = { 0xff, 0xff, 0xff, 0xff, 0xff, 0x1f, 0x00, 0x00 };
-	uint8_t inqmode;
-	int err , dd;
+	struct hci_request rq[2], *inq_rq = NULL;
+	write_inquiry_mode_cp inq_cp;
+	write_inquiry_mode_rp inq_rp;
+	uint8_t inqmode, mask_status;
+	int err, dd, num = 0;
 	char name[MAX_NAME_LENGTH + 1];
 
 	dd = hci_open_dev(adapter->dev_id);
@@ -1869,6 +1966,8 @@ static int adapter_setup(struct btd_adapter *adapter)
 		return err;
 	}
 
+	memset(rq, 0, sizeof(rq));
+
 	if (dev->lmp_ver > 1) {
 		if (dev->features[5] & LMP_SNIFF_SUBR)
 			events[5] |= 0x20;
@@ -1898,21 +1997,41 @@ static int adapter_setup(struct btd_adapter *adapter)
 						 * Features Notification */
 		}
 
-		hci_send_cmd(dd, OGF_HOST_CTL, OCF_SET_EVENT_MASK,
-						sizeof(events), events);
+		rq[num].ogf    = OGF_HOST_CTL;
+		rq[num].ocf    = OCF_SET_EVENT_MASK;
+		rq[num].cparam = events;
+		rq[num].clen   = sizeof(events);
+		rq[num].rparam = &mask_status;
+		rq[num].rlen   = sizeof(mask_status);
+		num++;
 	}
 
 	if (read_local_name(&adapter->bdaddr, name) == 0)
 		adapter_ops->set_name(adapter->dev_id, name);
 
 	inqmode = get_inquiry_mode(dev);
-	if (inqmode < 1)
+	if (inqmode > 0) {
+		inq_cp.mode = inqmode;
+		rq[num].ogf    = OGF_HOST_CTL;
+		rq[num].ocf    = OCF_WRITE_INQUIRY_MODE;
+		rq[num].cparam = &inq_cp;
+		rq[num].clen   = WRITE_INQUIRY_MODE_CP_SIZE;
+		rq[num].rparam = &inq_rp;
+		rq[num].rlen   = WRITE_INQUIRY_MODE_RP_SIZE;
+		inq_rq = &rq[num];
+		num++;
+	}
+
+	if (num == 0)
 		goto done;
 
-	if (hci_write_inquiry_mode(dd, inqmode, HCI_REQ_TIMEOUT) < 0) {
-		err = -errno;
+	err = hci_send_req_batch(dd, rq, num, HCI_REQ_TIMEOUT) < 0 ? -errno : 0;
+
+	if (inq_rq && (inq_rq->rlen == 0 || inq_rp.status)) {
+		if (!err)
+			err = -EIO;
 		error("Can't write inquiry mode for %s: %s (%d)",
-					adapter->path, strerror(errno), errno);
+					adapter->path, strerror(-err), -err);
 		hci_close_dev(dd);
 		return err;
 	}
@@ -2167,9 +2286,15 @@ int adapter_start(struct btd_adapter *adapter)
 {
 	struct hci_dev *dev = &adapter->dev;
 	struct hci_dev_info di;
-	struct hci_version ver;
+	struct hci_request rq[3];
+	read_local_version_rp ver;
+	read_local_features_rp feat;
+	read_class_of_dev_rp cls;
+	write_simple_pairing_mode_cp ssp_cp;
+	write_simple_pairing_mode_rp ssp_wrp;
+	read_simple_pairing_mode_rp ssp_rp;
 	uint8_t features[8];
-	int dd, err;
+	int dd, err, num;
 
 	if (hci_devinfo(adapter->dev_id, &di) < 0)
 		return -errno;
@@ -2200,53 +2325,87 @@ int adapter_start(struct btd_adapter *adapter)
 		return err;
 	}
 
-	if (hci_read_local_version(dd, &ver, HCI_REQ_TIMEOUT) < 0) {
+	/* Version, features and class are independent of each other, so
+	 * let the controller work on them back to back */
+	memset(rq, 0, sizeof(rq));
+	rq[0].ogf    = OGF_INFO_PARAM;
+	rq[0].ocf    = OCF_READ_LOCAL_VERSION;
+	rq[0].rparam = &ver;
+	rq[0].rlen   = READ_LOCAL_VERSION_RP_SIZE;
+	rq[1].ogf    = OGF_INFO_PARAM;
+	rq[1].ocf    = OCF_READ_LOCAL_FEATURES;
+	rq[1].rparam = &feat;
+	rq[1].rlen   = READ_LOCAL_FEATURES_RP_SIZE;
+	rq[2].ogf    = OGF_HOST_CTL;
+	rq[2].ocf    = OCF_READ_CLASS_OF_DEV;
+	rq[2].rparam = &cls;
+	rq[2].rlen   = READ_CLASS_OF_DEV_RP_SIZE;
+
+	if (hci_send_req_batch(dd, rq, 3, HCI_REQ_TIMEOUT) < 0) {
 		err = -errno;
-		error("Can't read version info for %s: %s (%d)",
+		error("Can't read local info for %s: %s (%d)",
 					adapter->path, strerror(errno), errno);
 		hci_close_dev(dd);
 		return err;
 	}
 
-	dev->hci_rev = ver.hci_rev;
-	dev->lmp_ver = ver.lmp_ver;
-	dev->lmp_subver = ver.lmp_subver;
-	dev->manufacturer = ver.manufacturer;
-
-	if (hci_read_local_features(dd, features, HCI_REQ_TIMEOUT) < 0) {
-		err = -errno;
-		error("Can't read features for %s: %s (%d)",
-					adapter->path, strerror(errno), errno);
+	if (ver.status || feat.status || cls.status) {
+		error("Can't read local info for %s: status 0x%02x 0x%02x 0x%02x",
+				adapter->path, ver.status, feat.status,
+				cls.status);
 		hci_close_dev(dd);
-		return err;
+		return -EIO;
 	}
 
+	dev->hci_rev = btohs(ver.hci_rev);
+	dev->lmp_ver = ver.lmp_ver;
+	dev->lmp_subver = btohs(ver.lmp_subver);
+	dev->manufacturer = btohs(ver.manufacturer);
+
+	memcpy(features, feat.features, 8);
 	memcpy(dev->features, features, 8);
 
-	if (hci_read_class_of_dev(dd, dev->class, HCI_REQ_TIMEOUT) < 0) {
-		err = -errno;
-		error("Can't read class of adapter on %s: %s (%d)",
-					adapter->path, strerror(errno), errno);
-		hci_close_dev(dd);
-		return err;
-	}
+	memcpy(dev->class, cls.dev_class, 3);
 
 	adapter_ops->read_name(adapter->dev_id);
 
 	if (!(features[6] & LMP_SIMPLE_PAIR))
 		goto setup;
 
-	if (ioctl(dd, HCIGETAUTHINFO, NULL) < 0 && errno != EINVAL)
-		hci_write_simple_pairing_mode(dd, 0x01, HCI_REQ_TIMEOUT);
+	memset(rq, 0, sizeof(rq));
+	num = 0;
+
+	if (ioctl(dd, HCIGETAUTHINFO, NULL) < 0 && errno != EINVAL) {
+		ssp_cp.mode = 0x01;
+		rq[num].ogf    = OGF_HOST_CTL;
+		rq[num].ocf    = OCF_WRITE_SIMPLE_PAIRING_MODE;
+		rq[num].cparam = &ssp_cp;
+		rq[num].clen   = WRITE_SIMPLE_PAIRING_MODE_CP_SIZE;
+		rq[num].rparam = &ssp_wrp;
+		rq[num].rlen   = WRITE_SIMPLE_PAIRING_MODE_RP_SIZE;
+		num++;
+	}
+
+	rq[num].ogf    = OGF_HOST_CTL;
+	rq[num].ocf    = OCF_READ_SIMPLE_PAIRING_MODE;
+	rq[num].rparam = &ssp_rp;
+	rq[num].rlen   = READ_SIMPLE_PAIRING_MODE_RP_SIZE;
+	num++;
 
-	if (hci_read_simple_pairing_mode(dd, &dev->ssp_mode,
-						HCI_REQ_TIMEOUT) < 0) {
+	if (hci_send_req_batch(dd, rq, num, HCI_REQ_TIMEOUT) < 0)
 		err = -errno;
+	else
+		err = 0;
+
+	if (rq[num - 1].rlen == 0 || ssp_rp.status) {
+		if (!err)
+			err = -EIO;
 		error("Can't read simple pairing mode on %s: %s (%d)",
-					adapter->path, strerror(errno), errno);
+					adapter->path, strerror(-err), -err);
 		/* Fall through since some chips have broken
 		 * read_simple_pairing_mode behavior */
-	}
+	} else
+		dev->ssp_mode = ssp_rp.mode;
 
 setup:
 	hci_send_cmd(dd, OGF_LINK_POLICY, OCF_READ_DEFAULT_LINK_POLICY,
@@ -2700,14 +2859,45 @@ void adapter_emit_device_found(struct btd_adapter *adapter,
 			NULL);
 
 	g_free(alias);
+
+	dev->found_rssi = dev->rssi;
+	dev->found_pending = FALSE;
+	g_get_current_time(&dev->found_time);
+}
+
+static gboolean device_found_throttled(struct remote_dev_info *dev)
+{
+	GTimeVal now;
+	long elapsed;
+
+	if (dev->rssi == dev->found_rssi)
+		return TRUE;
+
+	if (abs(dev->rssi - dev->found_rssi) < main_opts.found_rssi_delta)
+		return TRUE;
+
+	g_get_current_time(&now);
+
+	elapsed = (now.tv_sec - dev->found_time.tv_sec) * 1000 +
+			(now.tv_usec - dev->found_time.tv_usec) / 1000;
+
+	if (elapsed >= 0 && elapsed < (long) main_opts.found_interval) {
+		/* Report the latest RSSI at the end of the inquiry window */
+		dev->found_pending = TRUE;
+		return TRUE;
+	}
+
+	return FALSE;
 }
 
-void adapter_update_found_devices(struct btd_adapter *adapter, bdaddr_t *bdaddr,
-				int8_t rssi, uint32_t class, const char *name,
-				const char *alias, gboolean legacy,
-				name_status_t name_status)
+struct remote_dev_info *adapter_update_found_devices(struct btd_adapter *adapter,
+				bdaddr_t *bdaddr, int8_t rssi, uint32_t class,
+				const char *name, const char *alias,
+				gboolean legacy, name_status_t name_status,
+				uint8_t *eir)
 {
 	struct remote_dev_info *dev, match;
+	gboolean changed = FALSE;
 
 	memset(&match, 0, sizeof(struct remote_dev_info));
 	bacpy(&match.bdaddr, bdaddr);
@@ -2715,13 +2905,21 @@ void adapter_update_found_devices(struct btd_adapter *adapter, bdaddr_t *bdaddr,
 
 	dev = adapter_search_found_devices(adapter, &match);
 	if (dev) {
-		if (rssi == dev->rssi)
-			return;
-
 		/* Out of range list update */
 		adapter->oor_devices = g_slist_remove(adapter->oor_devices,
 							dev);
 
+		/* A new name is worth a DeviceFound regardless of RSSI */
+		if (name && g_strcmp0(dev->name, name) != 0) {
+			g_free(dev->name);
+			dev->name = g_strdup(name);
+			dev->store |= STORE_NAME;
+			changed = TRUE;
+
+			if (dev->name_status == NAME_REQUIRED)
+				dev->name_status = NAME_NOT_REQUIRED;
+		}
+
 		goto done;
 	}
 
@@ -2735,16 +2933,54 @@ void adapter_update_found_devices(struct btd_adapter *adapter, bdaddr_t *bdaddr,
 		dev->alias = g_strdup(alias);
 	dev->legacy = legacy;
 	dev->name_status = name_status;
+	dev->store = STORE_CLASS;
+	dev->rssi = rssi;
 
 	adapter->found_devices = g_slist_prepend(adapter->found_devices, dev);
 
+	changed = TRUE;
+
 done:
-	dev->rssi = rssi;
+	dev->lastseen = time(NULL);
+	dev->store |= STORE_LASTSEEN;
 
-	adapter->found_devices = g_slist_sort(adapter->found_devices,
+	if (dev->class != class) {
+		dev->class = class;
+		dev->store |= STORE_CLASS;
+		changed = TRUE;
+	}
+
+	if (eir && (!dev->eir || memcmp(dev->eir, eir, EIR_DATA_LENGTH))) {
+		g_free(dev->eir);
+		dev->eir = g_memdup(eir, EIR_DATA_LENGTH);
+		dev->store |= STORE_EIR;
+	}
+
+	if (dev->rssi != rssi || changed) {
+		dev->rssi = rssi;
+		adapter->found_devices = g_slist_sort(adapter->found_devices,
 						(GCompareFunc) dev_rssi_cmp);
+	}
+
+	if (changed || !device_found_throttled(dev))
+		adapter_emit_device_found(adapter, dev);
+
+	return dev;
+}
 
-	adapter_emit_device_found(adapter, dev);
+void adapter_store_found_devices(struct btd_adapter *adapter)
+{
+	GSList *l;
+
+	for (l = adapter->found_devices; l; l = l->next) {
+		struct remote_dev_info *dev = l->data;
+
+		if (dev->store)
+			dev_info_store(adapter, dev);
+
+		if (dev->found_pending)
+			adapter_emit_device_found(adapter, dev);
+	}
 }
 
 int adapter_remove_found_device(struct btd_adapter *adapter, bdaddr_t *bdaddr)
@@ -2780,6 +3016,7 @@ void adapter_update_oor_devices(struct btd_adapter *adapter)
 				DBUS_TYPE_INVALID);
 
 		adapter->found_devices = g_slist_remove(adapter->found_devices, dev);
+		dev_info_store(adapter, dev);
 		dev_info_free(dev);
 	}
 
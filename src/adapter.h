@@ -38,6 +38,14 @@
 
 #define MAX_NAME_LENGTH		248
 
+#define EIR_DATA_LENGTH		240
+
+/* Storage updates deferred until the end of the inquiry window */
+#define STORE_CLASS		0x01
+#define STORE_EIR		0x02
+#define STORE_NAME		0x04
+#define STORE_LASTSEEN		0x08
+
 typedef enum {
 	NAME_ANY,
 	NAME_NOT_REQUIRED, /* used by get remote name without name resolving */
@@ -56,6 +64,15 @@ struct remote_dev_info {
 	char *alias;
 	dbus_bool_t legacy;
 	name_status_t name_status;
+	uint8_t *eir;			/* last received EIR data */
+	time_t lastseen;		/* last inquiry response */
+	uint8_t store;			/* pending STORE_* updates */
+	uint8_t pscan_rep_mode;		/* from the inquiry result */
+	uint16_t clock_offset;		/* bit 15 set when valid */
+	gboolean recent;		/* known or previously used peer */
+	int8_t found_rssi;		/* RSSI of last DeviceFound signal */
+	GTimeVal found_time;		/* time of last DeviceFound signal */
+	gboolean found_pending;		/* DeviceFound update throttled */
 };
 
 struct hci_dev {
@@ -102,6 +119,8 @@ int pending_remote_name_cancel(struct btd_adapter *adapter);
 
 int adapter_resolve_names(struct btd_adapter *adapter);
 
+int adapter_cancel_resolve_name(struct btd_adapter *adapter, bdaddr_t *bdaddr);
+
 void clear_found_devices_list(struct btd_adapter *adapter);
 
 struct btd_adapter *adapter_create(DBusConnection *conn, int id,
@@ -115,10 +134,12 @@ int adapter_get_state(struct btd_adapter *adapter);
 gboolean adapter_is_ready(struct btd_adapter *adapter);
 struct remote_dev_info *adapter_search_found_devices(struct btd_adapter *adapter,
 						struct remote_dev_info *match);
-void adapter_update_found_devices(struct btd_adapter *adapter, bdaddr_t *bdaddr,
-				int8_t rssi, uint32_t class, const char *name,
-				const char *alias, gboolean legacy,
-				name_status_t name_status);
+struct remote_dev_info *adapter_update_found_devices(struct btd_adapter *adapter,
+				bdaddr_t *bdaddr, int8_t rssi, uint32_t class,
+				const char *name, const char *alias,
+				gboolean legacy, name_status_t name_status,
+				uint8_t *eir);
+void adapter_store_found_devices(struct btd_adapter *adapter);
 int adapter_remove_found_device(struct btd_adapter *adapter, bdaddr_t *bdaddr);
 void adapter_emit_device_found(struct btd_adapter *adapter,
 				struct remote_dev_info *dev);
@@ -176,7 +197,8 @@ struct btd_adapter_ops {
 						gboolean limited);
 	int (*start_discovery) (int index, gboolean periodic);
 	int (*stop_discovery) (int index);
-	int (*resolve_name) (int index, bdaddr_t *bdaddr);
+	int (*resolve_name) (int index, bdaddr_t *bdaddr,
+				uint8_t pscan_rep_mode, uint16_t clock_offset);
 	int (*cancel_resolve_name) (int index, bdaddr_t *bdaddr);
 	int (*set_name) (int index, const char *name);
 	int (*read_name) (int index);
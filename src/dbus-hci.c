@@ -499,31 +499,25 @@ static char *extract_eir_name(uint8_t *data, uint8_t *type)
 }
 
 void hcid_dbus_inquiry_result(bdaddr_t *local, bdaddr_t *peer, uint32_t class,
-				int8_t rssi, uint8_t *data)
+				int8_t rssi, uint8_t *data,
+				uint8_t pscan_rep_mode, uint16_t clock_offset)
 {
 	char filename[PATH_MAX + 1];
 	struct btd_adapter *adapter;
 	struct btd_device *device;
-	char local_addr[18], peer_addr[18], *alias, *name, *tmp_name;
+	char local_addr[18], peer_addr[18], *alias, *name, *tmp_name, *used;
 	struct remote_dev_info *dev, match;
 	uint8_t name_type = 0x00;
 	name_status_t name_status;
+	gboolean stored;
 	int state;
 	dbus_bool_t legacy;
 
-	ba2str(local, local_addr);
-	ba2str(peer, peer_addr);
-
 	if (!get_adapter_and_device(local, peer, &adapter, &device, FALSE)) {
 		error("No matching adapter found");
 		return;
 	}
 
-	write_remote_class(local, peer, class);
-
-	if (data)
-		write_remote_eir(local, peer, data);
-
 	/*
 	 * workaround to identify situation when the daemon started and
 	 * a standard inquiry or periodic inquiry was already running
@@ -539,16 +533,41 @@ void hcid_dbus_inquiry_result(bdaddr_t *local, bdaddr_t *peer, uint32_t class,
 
 	memset(&match, 0, sizeof(struct remote_dev_info));
 	bacpy(&match.bdaddr, peer);
-	match.name_status = NAME_SENT;
-	/* if found: don't send the name again */
+	match.name_status = NAME_ANY;
+
+	/*
+	 * Coalesce repeated responses from a peer already known in this
+	 * inquiry window: no storage lookups, storage writes are deferred
+	 * until the inquiry completes.
+	 */
 	dev = adapter_search_found_devices(adapter, &match);
 	if (dev) {
+		tmp_name = NULL;
+
+		if (data && (!dev->eir || memcmp(dev->eir, data,
+							EIR_DATA_LENGTH)))
+			tmp_name = extract_eir_name(data, &name_type);
+
+		/* Only a complete name may replace the one we have */
+		if (tmp_name && name_type != 0x09) {
+			free(tmp_name);
+			tmp_name = NULL;
+		}
+
 		adapter_update_found_devices(adapter, peer, rssi, class,
-						NULL, NULL, legacy,
-						NAME_NOT_REQUIRED);
+						tmp_name, NULL, legacy,
+						NAME_NOT_REQUIRED, data);
+
+		free(tmp_name);
+
+		dev->pscan_rep_mode = pscan_rep_mode;
+		dev->clock_offset = clock_offset;
 		return;
 	}
 
+	ba2str(local, local_addr);
+	ba2str(peer, peer_addr);
+
 	/* the inquiry result can be triggered by NON D-Bus client */
 	if (adapter_get_state(adapter) & RESOLVE_NAME)
 		name_status = NAME_REQUIRED;
@@ -560,11 +579,11 @@ void hcid_dbus_inquiry_result(bdaddr_t *local, bdaddr_t *peer, uint32_t class,
 
 	create_name(filename, PATH_MAX, STORAGEDIR, local_addr, "names");
 	name = textfile_get(filename, peer_addr);
+	stored = (name != NULL);
 
 	tmp_name = extract_eir_name(data, &name_type);
 	if (tmp_name) {
 		if (name_type == 0x09) {
-			write_device_name(local, peer, tmp_name);
 			name_status = NAME_NOT_REQUIRED;
 
 			if (name)
@@ -580,12 +599,26 @@ void hcid_dbus_inquiry_result(bdaddr_t *local, bdaddr_t *peer, uint32_t class,
 	}
 
 
-	if (name && name_type != 0x08)
+	/* A stored name is good enough, even if EIR only has a short one */
+	if (name && (stored || name_type != 0x08))
 		name_status = NAME_SENT;
 
 	/* add in the list to track name sent/pending */
-	adapter_update_found_devices(adapter, peer, rssi, class, name, alias,
-					legacy, name_status);
+	dev = adapter_update_found_devices(adapter, peer, rssi, class, name,
+					alias, legacy, name_status, data);
+
+	dev->pscan_rep_mode = pscan_rep_mode;
+	dev->clock_offset = clock_offset;
+
+	/* Peers the user has dealt with before get their names first */
+	create_name(filename, PATH_MAX, STORAGEDIR, local_addr, "lastused");
+	used = textfile_get(filename, peer_addr);
+	dev->recent = (device != NULL || used != NULL);
+	free(used);
+
+	/* EIR complete names are written with the rest of the batch */
+	if (name_type == 0x09)
+		dev->store |= STORE_NAME;
 
 	g_free(name);
 	g_free(alias);
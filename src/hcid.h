@@ -44,6 +44,8 @@
 
 #define HCID_DEFAULT_DISCOVERABLE_TIMEOUT 180 /* 3 minutes */
 
+#define HCID_DEFAULT_FOUND_INTERVAL	1000 /* 1 second */
+
 /* Timeout for hci_send_req (milliseconds) */
 #define HCI_REQ_TIMEOUT		5000
 
@@ -64,6 +66,8 @@ struct main_opts {
 	uint8_t		scan;
 	uint8_t		mode;
 	uint8_t		discov_interval;
+	uint32_t	found_interval;	/* DeviceFound rate limit (ms) */
+	uint8_t		found_rssi_delta;
 	char		deviceid[15]; /* FIXME: */
 
 	int		sock;
@@ -84,6 +88,7 @@ void hci_req_queue_remove(int dev_id, bdaddr_t *dba);
 
 void start_security_manager(int hdev);
 void stop_security_manager(int hdev);
+void update_security_manager(int hdev);
 
 void btd_start_exit_timer(void);
 void btd_stop_exit_timer(void);
@@ -159,6 +159,31 @@ static void parse_config(GKeyFile *config)
 		main_opts.discov_interval = val;
 	}
 
+	val = g_key_file_get_integer(config, "General",
+					"DeviceFoundInterval", &err);
+	if (err) {
+		debug("%s", err->message);
+		g_clear_error(&err);
+	} else if (val < 0) {
+		error("Invalid DeviceFoundInterval %d", val);
+	} else {
+		debug("found_interval=%d", val);
+		main_opts.found_interval = val;
+	}
+
+	val = g_key_file_get_integer(config, "General",
+					"DeviceFoundRSSIThreshold", &err);
+	if (err) {
+		debug("%s", err->message);
+		g_clear_error(&err);
+	} else if (val < 0 || val > 255) {
+		error("Invalid DeviceFoundRSSIThreshold %d, must be 0-255",
+									val);
+	} else {
+		debug("found_rssi_delta=%d", val);
+		main_opts.found_rssi_delta = val;
+	}
+
 	boolean = g_key_file_get_boolean(config, "General",
 						"InitiallyPowered", &err);
 	if (err) {
@@ -294,6 +319,7 @@ static void init_defaults(void)
 	main_opts.mode	= MODE_CONNECTABLE;
 	main_opts.name	= g_strdup("BlueZ");
 	main_opts.discovto	= HCID_DEFAULT_DISCOVERABLE_TIMEOUT;
+	main_opts.found_interval = HCID_DEFAULT_FOUND_INTERVAL;
 	main_opts.remember_powered = TRUE;
 	main_opts.reverse_sdp = TRUE;
 	main_opts.name_resolv = TRUE;
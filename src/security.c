@@ -60,27 +60,40 @@ typedef enum {
 	REQ_SENT
 } req_status_t;
 
+/* How long a sent request may wait for its completion event (seconds) */
+#define HCI_REQ_QUEUE_TIMEOUT	10
+
 struct hci_req_data {
 	int dev_id;
 	int event;
 	req_status_t status;
 	bdaddr_t dba;
+	uint16_t handle;
 	uint16_t ogf;
 	uint16_t ocf;
 	void *cparam;
 	int clen;
+	guint timeout;
+	gboolean status_pending;	/* no Command Status seen yet */
 };
 
+/* Maximum number of HCI events handled per main loop wakeup */
+#define SECURITY_EVENT_BATCH	16
+
 struct g_io_info {
 	GIOChannel	*channel;
 	int		watch_id;
 	int		pin_length;
+	int		credits;	/* Num_HCI_Command_Packets */
+	struct hci_dev_info di;
 };
 
 static struct g_io_info io_data[HCI_MAX_DEV];
 
 static GSList *hci_req_queue = NULL;
 
+static void hci_req_queue_process(int dev_id);
+
 static struct hci_req_data *hci_req_data_new(int dev_id, const bdaddr_t *dba,
 					uint16_t ogf, uint16_t ocf, int event,
 					const void *cparam, int clen)
@@ -104,62 +117,104 @@ static struct hci_req_data *hci_req_data_new(int dev_id, const bdaddr_t *dba,
 	return data;
 }
 
-static int hci_req_find_by_devid(const void *data, const void *user_data)
+static void hci_req_data_free(struct hci_req_data *data)
 {
-	const struct hci_req_data *req = data;
-	const int *dev_id = user_data;
+	if (data->timeout)
+		g_source_remove(data->timeout);
+
+	hci_req_queue = g_slist_remove(hci_req_queue, data);
+
+	g_free(data->cparam);
+	g_free(data);
+}
+
+static gboolean hci_req_timeout(gpointer user_data)
+{
+	struct hci_req_data *data = user_data;
+	int dev_id = data->dev_id;
+	char addr[18];
+
+	ba2str(&data->dba, addr);
+	error("HCI request 0x%04x for %s timed out",
+				cmd_opcode_pack(data->ogf, data->ocf), addr);
+
+	data->timeout = 0;
+	hci_req_data_free(data);
 
-	return (*dev_id - req->dev_id);
+	hci_req_queue_process(dev_id);
+
+	return FALSE;
 }
 
+static gboolean hci_req_peer_busy(int dev_id, const bdaddr_t *dba)
+{
+	GSList *l;
+
+	for (l = hci_req_queue; l; l = l->next) {
+		struct hci_req_data *data = l->data;
+
+		if (data->dev_id != dev_id || data->status != REQ_SENT)
+			continue;
+
+		if (!dba || !bacmp(&data->dba, dba))
+			return TRUE;
+	}
+
+	return FALSE;
+}
+
+/*
+ * Send as many pending requests as the controller has command credits
+ * for. Requests for different connections run in parallel, requests for
+ * the same connection are sent one after the other in queue order.
+ */
 static void hci_req_queue_process(int dev_id)
 {
-	int dd, ret_val;
+	GSList *l, *next;
+	int dd;
 
-	/* send the next pending cmd */
-	dd = hci_open_dev(dev_id);
-	if (dd < 0) {
-		error("hci_open_dev(%d): %s (%d)", dev_id, strerror(errno),
-									errno);
+	if (!io_data[dev_id].channel)
 		return;
-	}
 
-	do {
-		struct hci_req_data *data;
-		GSList *l = g_slist_find_custom(hci_req_queue, &dev_id, hci_req_find_by_devid);
+	dd = g_io_channel_unix_get_fd(io_data[dev_id].channel);
 
-		if (!l)
-			break;
+	/* Nothing in flight that could return credits to us */
+	if (io_data[dev_id].credits <= 0 && !hci_req_peer_busy(dev_id, NULL))
+		io_data[dev_id].credits = 1;
 
-		data = l->data;
-		data->status = REQ_SENT;
+	for (l = hci_req_queue; l && io_data[dev_id].credits > 0; l = next) {
+		struct hci_req_data *data = l->data;
+
+		next = l->next;
 
-		ret_val = hci_send_cmd(dd, data->ogf, data->ocf, data->clen, data->cparam);
-		if (ret_val < 0) {
-			hci_req_queue = g_slist_remove(hci_req_queue, data);
-			g_free(data->cparam);
-			g_free(data);
+		if (data->dev_id != dev_id || data->status != REQ_PENDING)
+			continue;
+
+		if (hci_req_peer_busy(dev_id, &data->dba))
+			continue;
+
+		if (hci_send_cmd(dd, data->ogf, data->ocf, data->clen,
+							data->cparam) < 0) {
+			error("Can't send HCI request 0x%04x: %s (%d)",
+				cmd_opcode_pack(data->ogf, data->ocf),
+				strerror(errno), errno);
+			hci_req_data_free(data);
+			continue;
 		}
 
-	} while (ret_val < 0);
+		data->status = REQ_SENT;
+		data->status_pending = TRUE;
+		data->timeout = g_timeout_add_seconds(HCI_REQ_QUEUE_TIMEOUT,
+							hci_req_timeout, data);
 
-	hci_close_dev(dd);
+		io_data[dev_id].credits--;
+	}
 }
 
 static void hci_req_queue_append(struct hci_req_data *data)
 {
-	GSList *l;
-	struct hci_req_data *match;
-
-
 	hci_req_queue = g_slist_append(hci_req_queue, data);
 
-	l = g_slist_find_custom(hci_req_queue, &data->dev_id, hci_req_find_by_devid);
-	match = l->data;
-
-	if (match->status == REQ_SENT)
-		return;
-
 	hci_req_queue_process(data->dev_id);
 }
 
@@ -174,39 +229,148 @@ void hci_req_queue_remove(int dev_id, bdaddr_t *dba)
 		if ((req->dev_id != dev_id) || (bacmp(&req->dba, dba)))
 			continue;
 
-		hci_req_queue = g_slist_remove(hci_req_queue, req);
-		g_free(req->cparam);
-		g_free(req);
+		hci_req_data_free(req);
 	}
+
+	hci_req_queue_process(dev_id);
 }
 
-static void check_pending_hci_req(int dev_id, int event)
+static void hci_req_queue_flush(int dev_id)
 {
-	struct hci_req_data *data;
+	GSList *cur, *next;
+
+	for (cur = hci_req_queue; cur != NULL; cur = next) {
+		struct hci_req_data *req = cur->data;
+
+		next = cur->next;
+		if (req->dev_id == dev_id)
+			hci_req_data_free(req);
+	}
+}
+
+/*
+ * Command Status only carries the opcode, and other users of the adapter
+ * (name resolving, for one) send the same commands. Statuses come back
+ * in command order, so a success settles the oldest request of that
+ * opcode. A failure is only pinned on a request when it is the sole one
+ * waiting for its status; anything else is left to the request timeout.
+ */
+static struct hci_req_data *find_status_pending_hci_req(int dev_id,
+						uint16_t opcode, int *count)
+{
+	struct hci_req_data *match = NULL;
 	GSList *l;
 
-	if (!hci_req_queue)
-		return;
+	*count = 0;
 
-	/* find the first element(pending)*/
-	l = g_slist_find_custom(hci_req_queue, &dev_id, hci_req_find_by_devid);
+	for (l = hci_req_queue; l; l = l->next) {
+		struct hci_req_data *data = l->data;
 
-	if (!l)
-		return;
+		if (data->dev_id != dev_id || data->status != REQ_SENT ||
+						!data->status_pending)
+			continue;
+
+		if (htobs(cmd_opcode_pack(data->ogf, data->ocf)) != opcode)
+			continue;
+
+		if (!match)
+			match = data;
+		(*count)++;
+	}
+
+	return match;
+}
+
+static void settle_hci_req_status(int dev_id, uint16_t opcode)
+{
+	struct hci_req_data *data;
+	int count;
+
+	data = find_status_pending_hci_req(dev_id, opcode, &count);
+	if (data)
+		data->status_pending = FALSE;
+}
+
+static struct hci_req_data *find_failed_hci_req(int dev_id, uint16_t opcode)
+{
+	struct hci_req_data *data;
+	int count;
 
-	data = l->data;
+	data = find_status_pending_hci_req(dev_id, opcode, &count);
+
+	return count == 1 ? data : NULL;
+}
+
+static struct hci_req_data *find_sent_hci_req(int dev_id, int event,
+									void *ptr)
+{
+	GSList *l;
+
+	for (l = hci_req_queue; l; l = l->next) {
+		struct hci_req_data *data = l->data;
+
+		if (data->dev_id != dev_id || data->status != REQ_SENT)
+			continue;
 
-	/* skip if there is pending confirmation */
-	if (data->status == REQ_SENT) {
 		if (data->event != event)
-			return;
+			continue;
 
-		/* remove the confirmed cmd */
-		hci_req_queue = g_slist_remove(hci_req_queue, data);
-		g_free(data->cparam);
-		g_free(data);
+		switch (event) {
+		case EVT_REMOTE_NAME_REQ_COMPLETE:
+			if (bacmp(&data->dba, &((evt_remote_name_req_complete *)
+							ptr)->bdaddr) == 0)
+				return data;
+			break;
+		case EVT_READ_REMOTE_VERSION_COMPLETE:
+		case EVT_READ_REMOTE_FEATURES_COMPLETE:
+			/* handle is the first field after the status */
+			if (data->handle == btohs(bt_get_unaligned(
+						(uint16_t *) (ptr + 1))))
+				return data;
+			break;
+		default:
+			return data;
+		}
 	}
 
+	return NULL;
+}
+
+static void check_pending_hci_req(int dev_id, int event, void *ptr)
+{
+	struct hci_req_data *data = NULL;
+
+	switch (event) {
+	case EVT_CMD_STATUS: {
+		evt_cmd_status *evt = ptr;
+
+		io_data[dev_id].credits = evt->ncmd;
+
+		/* a failed command won't generate its completion event */
+		if (evt->status)
+			data = find_failed_hci_req(dev_id, evt->opcode);
+		else
+			settle_hci_req_status(dev_id, evt->opcode);
+		break;
+	}
+	case EVT_CMD_COMPLETE: {
+		evt_cmd_complete *evt = ptr;
+
+		io_data[dev_id].credits = evt->ncmd;
+		break;
+	}
+	default:
+		data = find_sent_hci_req(dev_id, event, ptr);
+		break;
+	}
+
+	/* remove the confirmed cmd */
+	if (data)
+		hci_req_data_free(data);
+
+	if (!hci_req_queue)
+		return;
+
 	hci_req_queue_process(dev_id);
 }
 
@@ -273,17 +437,6 @@ static inline int get_bdaddr(int dev, bdaddr_t *sba, uint16_t handle, bdaddr_t *
 	return -ENOENT;
 }
 
-static inline void update_lastseen(bdaddr_t *sba, bdaddr_t *dba)
-{
-	time_t t;
-	struct tm *tm;
-
-	t = time(NULL);
-	tm = gmtime(&t);
-
-	write_lastseen_info(sba, dba, tm);
-}
-
 static inline void update_lastused(bdaddr_t *sba, bdaddr_t *dba)
 {
 	time_t t;
@@ -612,6 +765,9 @@ static void inquiry_complete(bdaddr_t *local, uint8_t status, gboolean periodic)
 		return;
 	}
 
+	/* Write out everything coalesced during this inquiry window */
+	adapter_store_found_devices(adapter);
+
 	/*
 	 * The following scenarios can happen:
 	 * 1. standard inquiry: always send discovery completed signal
@@ -743,9 +899,9 @@ static inline void inquiry_result(int dev, bdaddr_t *sba, int plen, void *ptr)
 			| (info->dev_class[1] << 8)
 			| (info->dev_class[2] << 16);
 
-		hcid_dbus_inquiry_result(sba, &info->bdaddr, class, 0, NULL);
-
-		update_lastseen(sba, &info->bdaddr);
+		hcid_dbus_inquiry_result(sba, &info->bdaddr, class, 0, NULL,
+					info->pscan_rep_mode,
+					btohs(info->clock_offset) | 0x8000);
 
 		ptr += INQUIRY_INFO_SIZE;
 	}
@@ -767,9 +923,9 @@ static inline void inquiry_result_with_rssi(int dev, bdaddr_t *sba, int plen, vo
 				| (info->dev_class[2] << 16);
 
 			hcid_dbus_inquiry_result(sba, &info->bdaddr,
-						class, info->rssi, NULL);
-
-			update_lastseen(sba, &info->bdaddr);
+					class, info->rssi, NULL,
+					info->pscan_rep_mode,
+					btohs(info->clock_offset) | 0x8000);
 
 			ptr += INQUIRY_INFO_WITH_RSSI_AND_PSCAN_MODE_SIZE;
 		}
@@ -781,9 +937,9 @@ static inline void inquiry_result_with_rssi(int dev, bdaddr_t *sba, int plen, vo
 				| (info->dev_class[2] << 16);
 
 			hcid_dbus_inquiry_result(sba, &info->bdaddr,
-						class, info->rssi, NULL);
-
-			update_lastseen(sba, &info->bdaddr);
+					class, info->rssi, NULL,
+					info->pscan_rep_mode,
+					btohs(info->clock_offset) | 0x8000);
 
 			ptr += INQUIRY_INFO_WITH_RSSI_SIZE;
 		}
@@ -802,9 +958,9 @@ static inline void extended_inquiry_result(int dev, bdaddr_t *sba, int plen, voi
 			| (info->dev_class[2] << 16);
 
 		hcid_dbus_inquiry_result(sba, &info->bdaddr, class,
-						info->rssi, info->data);
-
-		update_lastseen(sba, &info->bdaddr);
+					info->rssi, info->data,
+					info->pscan_rep_mode,
+					btohs(info->clock_offset) | 0x8000);
 
 		ptr += EXTENDED_INQUIRY_INFO_SIZE;
 	}
@@ -870,6 +1026,7 @@ static inline void conn_complete(int dev, int dev_id, bdaddr_t *sba, void *ptr)
 		data = hci_req_data_new(dev_id, &evt->bdaddr, OGF_LINK_CTL,
 					OCF_READ_REMOTE_VERSION, EVT_READ_REMOTE_VERSION_COMPLETE,
 					&cp, READ_REMOTE_VERSION_CP_SIZE);
+		data->handle = btohs(evt->handle);
 
 		hci_req_queue_append(data);
 	} else
@@ -927,43 +1084,25 @@ static void delete_channel(GIOChannel *chan)
 	error("IO channel not found in the io_data table");
 }
 
-static gboolean io_security_event(GIOChannel *chan, GIOCondition cond, gpointer data)
+static void process_security_event(int dev, struct hci_dev_info *di,
+						unsigned char *buf, int len)
 {
-	unsigned char buf[HCI_MAX_EVENT_SIZE], *ptr = buf;
-	struct hci_dev_info *di = data;
-	int type, dev;
-	size_t len;
+	unsigned char *ptr = buf;
 	hci_event_hdr *eh;
-	GIOError err;
 	evt_cmd_status *evt;
+	int type;
 
-	if (cond & (G_IO_NVAL | G_IO_HUP | G_IO_ERR)) {
-		delete_channel(chan);
-		return FALSE;
-	}
-
-	if ((err = g_io_channel_read(chan, (gchar *) buf, sizeof(buf), &len))) {
-		if (err == G_IO_ERROR_AGAIN)
-			return TRUE;
-		delete_channel(chan);
-		return FALSE;
-	}
+	if (len < 1 + HCI_EVENT_HDR_SIZE)
+		return;
 
 	type = *ptr++;
 
 	if (type != HCI_EVENT_PKT)
-		return TRUE;
+		return;
 
 	eh = (hci_event_hdr *) ptr;
 	ptr += HCI_EVENT_HDR_SIZE;
 
-	dev = g_io_channel_unix_get_fd(chan);
-
-	ioctl(dev, HCIGETDEVINFO, (void *) di);
-
-	if (hci_test_bit(HCI_RAW, &di->flags))
-		return TRUE;
-
 	switch (eh->evt) {
 	case EVT_CMD_STATUS:
 		cmd_status(dev, &di->bdaddr, ptr);
@@ -1024,7 +1163,7 @@ static gboolean io_security_event(GIOChannel *chan, GIOCondition cond, gpointer
 	}
 
 	/* Check for pending command request */
-	check_pending_hci_req(di->dev_id, eh->evt);
+	check_pending_hci_req(di->dev_id, eh->evt, ptr);
 
 	switch (eh->evt) {
 	case EVT_PIN_CODE_REQ:
@@ -1067,6 +1206,47 @@ static gboolean io_security_event(GIOChannel *chan, GIOCondition cond, gpointer
 		remote_oob_data_request(dev, &di->bdaddr, ptr);
 		break;
 	}
+}
+
+static gboolean io_security_event(GIOChannel *chan, GIOCondition cond, gpointer data)
+{
+	unsigned char buf[HCI_MAX_EVENT_SIZE];
+	struct g_io_info *io = data;
+	int dev, i;
+	ssize_t len;
+
+	if (cond & (G_IO_NVAL | G_IO_HUP | G_IO_ERR)) {
+		delete_channel(chan);
+		return FALSE;
+	}
+
+	dev = g_io_channel_unix_get_fd(chan);
+
+	/* Drain everything that is queued on the socket, but don't starve
+	 * the rest of the main loop during inquiry or connection storms */
+	for (i = 0; i < SECURITY_EVENT_BATCH; i++) {
+		len = recv(dev, buf, sizeof(buf), MSG_DONTWAIT);
+		if (len < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN)
+				break;
+			delete_channel(chan);
+			return FALSE;
+		}
+
+		if (len == 0)
+			break;
+
+		if (hci_test_bit(HCI_RAW, &io->di.flags))
+			continue;
+
+		process_security_event(dev, &io->di, buf, len);
+
+		/* One of the handlers may have stopped the security manager */
+		if (io->channel != chan)
+			return FALSE;
+	}
 
 	return TRUE;
 }
@@ -1126,12 +1306,11 @@ void start_security_manager(int hdev)
 		return;
 	}
 
-	di = g_new(struct hci_dev_info, 1);
+	di = &io_data[hdev].di;
 	if (hci_devinfo(hdev, di) < 0) {
 		error("Can't get device info: %s (%d)",
 							strerror(errno), errno);
 		close(dev);
-		g_free(di);
 		return;
 	}
 
@@ -1139,9 +1318,10 @@ void start_security_manager(int hdev)
 	g_io_channel_set_close_on_unref(chan, TRUE);
 	io_data[hdev].watch_id = g_io_add_watch_full(chan, G_PRIORITY_HIGH,
 						G_IO_IN | G_IO_NVAL | G_IO_HUP | G_IO_ERR,
-						io_security_event, di, (GDestroyNotify) g_free);
+						io_security_event, &io_data[hdev], NULL);
 	io_data[hdev].channel = chan;
 	io_data[hdev].pin_length = -1;
+	io_data[hdev].credits = 1;
 
 	if (hci_test_bit(HCI_RAW, &di->flags))
 		return;
@@ -1162,6 +1342,8 @@ void stop_security_manager(int hdev)
 
 	info("Stopping security manager %d", hdev);
 
+	hci_req_queue_flush(hdev);
+
 	g_source_remove(io_data[hdev].watch_id);
 	g_io_channel_unref(io_data[hdev].channel);
 	io_data[hdev].watch_id = -1;
@@ -1169,3 +1351,18 @@ void stop_security_manager(int hdev)
 	io_data[hdev].pin_length = -1;
 }
 
+void update_security_manager(int hdev)
+{
+	struct hci_dev_info di;
+
+	if (!io_data[hdev].channel)
+		return;
+
+	if (hci_devinfo(hdev, &di) < 0) {
+		error("Can't get device info: %s (%d)",
+							strerror(errno), errno);
+		return;
+	}
+
+	memcpy(&io_data[hdev].di, &di, sizeof(di));
+}